@@ -0,0 +1,356 @@
+#include "rsa.h"
+#include "numtheory.h"
+#include "randstate.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OPTIONS "b:n:m:s:h"
+
+// Key sizes measured when "-b" isn't given.
+static const uint64_t default_sizes[] = { 1024, 2048, 3072, 4096 };
+
+// Miller-Rabin iterations used for prime testing and generation, matching keygen's default.
+#define BENCH_ITERS 50
+
+// Everything an operation under test needs for one key size.
+typedef struct {
+    uint64_t bits;
+    mpz_t p, q, n, e, d, dp, dq, qinv, totient; // Key with a random public exponent.
+    mpz_t e4;                                   // The fixed public exponent 65537.
+    mpz_t m, c, s, o;                           // Message, ciphertext, signature, and output.
+    mpz_t prime;                                // A prime half as long as n.
+    rsa_ctx pub, priv;                          // The key loaded into reusable contexts.
+    mpz_t xp, xq, xn, xe, xd, xdp, xdq, xqinv;  // Multi-prime key: 3 primes, or 4 from 4096 bits.
+    rsa_primes x;                               // Its extra primes.
+    mpz_t xc;                                   // A ciphertext under the multi-prime key.
+    rsa_ctx xpriv;                              // The multi-prime key loaded into a context.
+    rand_state rc;                              // A ChaCha20 generator; the keys come from the MT state.
+} bench_key;
+
+// Receives boolean results so the compiler can't discard calls to pure functions.
+static volatile int sink;
+
+// An operation under test; "i" is the sample number.
+typedef void (*bench_fn)(bench_key *k, uint64_t i);
+
+void help_func(void);
+
+// Returns the current time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Orders latencies for the percentile calculation.
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Runs "fn" until "max_samples" samples are taken or "budget" seconds pass, with at least 3 samples,
+// then prints ops/sec and the 50th, 90th, and 99th percentile latencies.
+static void measure(
+    const char *name, bench_fn fn, bench_key *k, uint64_t max_samples, double budget) {
+    double *lat = (double *) calloc(max_samples, sizeof(double));
+    double start = now();
+    double total = 0;
+    uint64_t count = 0;
+
+    while (count < max_samples && (count < 3 || now() - start < budget)) {
+        double t0 = now();
+        fn(k, count);
+        lat[count] = now() - t0;
+        total += lat[count];
+        count += 1;
+    }
+
+    qsort(lat, count, sizeof(double), cmp_double);
+    printf("%-24s %6" PRIu64 " %12.1f %12.1f %12.1f %12.1f %8" PRIu64 "\n", name, k->bits,
+        count / total, lat[(count - 1) * 50 / 100] * 1e6, lat[(count - 1) * 90 / 100] * 1e6,
+        lat[(count - 1) * 99 / 100] * 1e6, count);
+
+    // Freeing of allocated memory.
+    free(lat);
+    return;
+}
+
+// Operations under test.
+static void op_pow_mod(bench_key *k, uint64_t i) {
+    (void) i;
+    pow_mod(k->o, k->c, k->d, k->n);
+}
+
+static void op_mpz_powm(bench_key *k, uint64_t i) {
+    (void) i;
+    mpz_powm(k->o, k->c, k->d, k->n);
+}
+
+static void op_is_prime(bench_key *k, uint64_t i) {
+    (void) i;
+    sink = is_prime(k->prime, BENCH_ITERS);
+}
+
+static void op_mpz_probab_prime_p(bench_key *k, uint64_t i) {
+    (void) i;
+    sink = mpz_probab_prime_p(k->prime, BENCH_ITERS);
+}
+
+static void op_is_prime_bpsw(bench_key *k, uint64_t i) {
+    (void) i;
+    sink = is_prime_bpsw(k->prime, 0, &state);
+}
+
+static void op_rand_urandomb(bench_key *k, uint64_t i) {
+    (void) i;
+    rand_urandomb(k->o, &k->rc, k->bits);
+}
+
+static void op_mpz_urandomb(bench_key *k, uint64_t i) {
+    (void) i;
+    mpz_urandomb(k->o, state.mt, k->bits);
+}
+
+static void op_make_prime(bench_key *k, uint64_t i) {
+    (void) i;
+    make_prime(k->o, k->bits / 2, BENCH_ITERS, PRIME_TEST_MR);
+}
+
+static void op_make_prime_bpsw(bench_key *k, uint64_t i) {
+    (void) i;
+    make_prime(k->o, k->bits / 2, 0, PRIME_TEST_BPSW);
+}
+
+static void op_mod_inverse(bench_key *k, uint64_t i) {
+    (void) i;
+    mod_inverse(k->o, k->e, k->totient);
+}
+
+static void op_mpz_invert(bench_key *k, uint64_t i) {
+    (void) i;
+    mpz_invert(k->o, k->e, k->totient);
+}
+
+static void op_gcd(bench_key *k, uint64_t i) {
+    (void) i;
+    gcd(k->o, k->e, k->totient);
+}
+
+static void op_mpz_gcd(bench_key *k, uint64_t i) {
+    (void) i;
+    mpz_gcd(k->o, k->e, k->totient);
+}
+
+static void op_rsa_encrypt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_encrypt(k->o, k->m, k->e, k->n);
+}
+
+static void op_rsa_encrypt_65537(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_encrypt(k->o, k->m, k->e4, k->n);
+}
+
+static void op_rsa_decrypt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_decrypt(k->o, k->c, k->d, k->n);
+}
+
+static void op_rsa_decrypt_crt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_decrypt_crt(k->o, k->c, k->p, k->q, k->dp, k->dq, k->qinv, NULL);
+}
+
+static void op_rsa_decrypt_crt_multi(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_decrypt_crt(k->o, k->xc, k->xp, k->xq, k->xdp, k->xdq, k->xqinv, &k->x);
+}
+
+static void op_rsa_ctx_encrypt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_ctx_encrypt(&k->pub, 0, k->o, k->m);
+}
+
+static void op_rsa_ctx_decrypt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_ctx_decrypt(&k->priv, 0, k->o, k->c);
+}
+
+static void op_rsa_ctx_decrypt_multi(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_ctx_decrypt(&k->xpriv, 0, k->o, k->xc);
+}
+
+static void op_rsa_sign(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_sign(k->o, k->m, k->d, k->n);
+}
+
+static void op_rsa_sign_crt(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_sign_crt(k->o, k->m, k->p, k->q, k->dp, k->dq, k->qinv, NULL);
+}
+
+static void op_rsa_sign_crt_multi(bench_key *k, uint64_t i) {
+    (void) i;
+    rsa_sign_crt(k->o, k->m, k->xp, k->xq, k->xdp, k->xdq, k->xqinv, &k->x);
+}
+
+static void op_rsa_verify(bench_key *k, uint64_t i) {
+    (void) i;
+    sink = rsa_verify(k->m, k->s, k->e, k->n);
+}
+
+// Operations in the order they are reported. GMP's own routines are listed as reference points.
+static const struct {
+    const char *name;
+    bench_fn fn;
+} ops[] = {
+    { "pow_mod", op_pow_mod },
+    { "  ref mpz_powm", op_mpz_powm },
+    { "is_prime", op_is_prime },
+    { "  ref mpz_probab_prime_p", op_mpz_probab_prime_p },
+    { "is_prime_bpsw", op_is_prime_bpsw },
+    { "rand_urandomb (chacha)", op_rand_urandomb },
+    { "  ref mpz_urandomb (mt)", op_mpz_urandomb },
+    { "make_prime", op_make_prime },
+    { "make_prime (bpsw)", op_make_prime_bpsw },
+    { "mod_inverse", op_mod_inverse },
+    { "  ref mpz_invert", op_mpz_invert },
+    { "gcd", op_gcd },
+    { "  ref mpz_gcd", op_mpz_gcd },
+    { "rsa_encrypt", op_rsa_encrypt },
+    { "rsa_encrypt (e=65537)", op_rsa_encrypt_65537 },
+    { "rsa_decrypt", op_rsa_decrypt },
+    { "rsa_decrypt_crt", op_rsa_decrypt_crt },
+    { "rsa_decrypt_crt (multi)", op_rsa_decrypt_crt_multi },
+    { "rsa_ctx_encrypt", op_rsa_ctx_encrypt },
+    { "rsa_ctx_decrypt", op_rsa_ctx_decrypt },
+    { "rsa_ctx_decrypt (multi)", op_rsa_ctx_decrypt_multi },
+    { "rsa_sign", op_rsa_sign },
+    { "rsa_sign_crt", op_rsa_sign_crt },
+    { "rsa_sign_crt (multi)", op_rsa_sign_crt_multi },
+    { "rsa_verify", op_rsa_verify },
+};
+
+// Generates the keys and operands for one key size.
+static void bench_key_init(bench_key *k, uint64_t bits) {
+    k->bits = bits;
+    mpz_inits(k->p, k->q, k->n, k->e, k->d, k->dp, k->dq, k->qinv, k->totient, k->e4, k->m,
+        k->c, k->s, k->o, k->prime, NULL);
+
+    rsa_make_pub(k->p, k->q, NULL, k->n, k->e, bits, BENCH_ITERS, PRIME_TEST_MR, 1, 0);
+    rsa_make_priv(k->d, k->e, k->p, k->q, NULL);
+    rsa_make_crt(k->dp, k->dq, k->qinv, NULL, k->d, k->p, k->q);
+
+    // totient(n) = (p - 1)(q - 1)
+    mpz_sub_ui(k->totient, k->p, 1);
+    mpz_sub_ui(k->o, k->q, 1);
+    mpz_mul(k->totient, k->totient, k->o);
+
+    // Only the public operation is timed with 65537, so it doesn't need a matching private key.
+    mpz_set_ui(k->e4, RSA_FIXED_E);
+
+    // A random message below n, its ciphertext, and its signature.
+    rand_urandomm(k->m, &state, k->n);
+    rsa_encrypt(k->c, k->m, k->e, k->n);
+    rsa_sign_crt(k->s, k->m, k->p, k->q, k->dp, k->dq, k->qinv, NULL);
+
+    rsa_ctx_init_pub(&k->pub, k->n, k->e, 1);
+    rsa_ctx_init_priv(&k->priv, k->n, k->d, k->p, k->q, k->dp, k->dq, k->qinv, NULL, 1);
+
+    // The same size of key with balanced primes, and the same message encrypted under it.
+    mpz_inits(k->xp, k->xq, k->xn, k->xe, k->xd, k->xdp, k->xdq, k->xqinv, k->xc, NULL);
+    rsa_primes_init(&k->x, bits >= 4096 ? 4 : 3);
+    rsa_make_pub(k->xp, k->xq, &k->x, k->xn, k->xe, bits, BENCH_ITERS, PRIME_TEST_MR, 1, 0);
+    rsa_make_priv(k->xd, k->xe, k->xp, k->xq, &k->x);
+    rsa_make_crt(k->xdp, k->xdq, k->xqinv, &k->x, k->xd, k->xp, k->xq);
+    mpz_mod(k->xc, k->m, k->xn);
+    rsa_encrypt(k->xc, k->xc, k->xe, k->xn);
+    rsa_ctx_init_priv(&k->xpriv, k->xn, k->xd, k->xp, k->xq, k->xdp, k->xdq, k->xqinv, &k->x, 1);
+
+    make_prime(k->prime, bits / 2 - 1, BENCH_ITERS, PRIME_TEST_MR);
+    rand_init(&k->rc, RAND_CHACHA, bits);
+    return;
+}
+
+// Frees the memory held by a bench key.
+static void bench_key_clear(bench_key *k) {
+    rsa_ctx_clear(&k->pub);
+    rsa_ctx_clear(&k->priv);
+    rsa_ctx_clear(&k->xpriv);
+    rsa_primes_clear(&k->x);
+    rand_clear(&k->rc);
+    mpz_clears(k->p, k->q, k->n, k->e, k->d, k->dp, k->dq, k->qinv, k->totient, k->e4, k->m,
+        k->c, k->s, k->o, k->prime, NULL);
+    mpz_clears(k->xp, k->xq, k->xn, k->xe, k->xd, k->xdp, k->xdq, k->xqinv, k->xc, NULL);
+    return;
+}
+
+int main(int argc, char **argv) {
+    uint64_t bits = 0;
+    uint64_t max_samples = 200;
+    double budget = 0.5;
+    uint64_t seed = 2022;
+
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        if (opt == '?') {
+            help_func();
+            return 1;
+        }
+        switch (opt) {
+        case 'b': bits = strtoul(optarg, NULL, 10); break;
+        case 'n': max_samples = strtoul(optarg, NULL, 10); break;
+        case 'm': budget = strtod(optarg, NULL) / 1000; break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'h': help_func(); return 1;
+        }
+    }
+
+    // At least three samples are always taken.
+    if (max_samples < 3) {
+        max_samples = 3;
+    }
+
+    randstate_init(RAND_MT, seed);
+
+    printf("%-24s %6s %12s %12s %12s %12s %8s\n", "operation", "bits", "ops/sec", "p50 (us)",
+        "p90 (us)", "p99 (us)", "samples");
+
+    // Measure every operation at each key size.
+    uint64_t nsizes = bits ? 1 : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    for (uint64_t i = 0; i < nsizes; i += 1) {
+        bench_key k;
+        bench_key_init(&k, bits ? bits : default_sizes[i]);
+        for (uint64_t j = 0; j < sizeof(ops) / sizeof(ops[0]); j += 1) {
+            measure(ops[j].name, ops[j].fn, &k, max_samples, budget);
+        }
+        bench_key_clear(&k);
+    }
+
+    randstate_clear();
+    return 0;
+}
+
+// Helper function to print out manual page.
+void help_func(void) {
+    printf("SYNOPSIS\n"
+           "  Measures the number theory and RSA primitives against GMP's built-in routines.\n\n"
+           "USAGE\n"
+           "  ./benchmark [-h] [-b bits] [-n samples] [-m milliseconds] [-s seed]\n\n"
+           "OPTIONS\n"
+           "  -h             Display program help and usage.\n"
+           "  -b bits        Only measure this key size (default: 1024, 2048, 3072, and 4096).\n"
+           "  -n samples     Maximum samples per operation (default: 200).\n"
+           "  -m ms          Time budget per operation in milliseconds (default: 500).\n"
+           "  -s seed        Random seed for the keys and operands (default: 2022).\n");
+    return;
+}
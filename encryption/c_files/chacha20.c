@@ -0,0 +1,172 @@
+#include "chacha20.h"
+
+#include <string.h>
+
+// Rotates a 32 bit value left by "n" bits.
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+// The ChaCha quarter round.
+#define QUARTER_ROUND(a, b, c, d)                                                                  \
+    do {                                                                                           \
+        a += b;                                                                                    \
+        d ^= a;                                                                                    \
+        d = ROTL32(d, 16);                                                                         \
+        c += d;                                                                                    \
+        b ^= c;                                                                                    \
+        b = ROTL32(b, 12);                                                                         \
+        a += b;                                                                                    \
+        d ^= a;                                                                                    \
+        d = ROTL32(d, 8);                                                                          \
+        c += d;                                                                                    \
+        b ^= c;                                                                                    \
+        b = ROTL32(b, 7);                                                                          \
+    } while (0)
+
+// Reads a little-endian 32 bit value.
+static uint32_t load32_le(const uint8_t *b) {
+    return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16)
+           | ((uint32_t) b[3] << 24);
+}
+
+// Computes the keystream block for the current counter into cc->stream, then advances the counter.
+static void chacha20_block(chacha20_ctx *cc) {
+    uint32_t x[16];
+    memcpy(x, cc->input, sizeof(x));
+
+    // 20 rounds: alternating column and diagonal rounds.
+    for (int i = 0; i < 10; i += 1) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    // Add the input back in and serialize little-endian.
+    for (int i = 0; i < 16; i += 1) {
+        uint32_t v = x[i] + cc->input[i];
+        cc->stream[4 * i] = (uint8_t) v;
+        cc->stream[4 * i + 1] = (uint8_t) (v >> 8);
+        cc->stream[4 * i + 2] = (uint8_t) (v >> 16);
+        cc->stream[4 * i + 3] = (uint8_t) (v >> 24);
+    }
+    cc->input[12] += 1;
+    return;
+}
+
+// Number of blocks computed side by side by chacha20_blocks().
+#define CHACHA20_LANES 8
+
+// One state word for each of the blocks computed together.
+// GCC and Clang lower these vectors onto whatever SIMD registers the target has.
+typedef uint32_t lanes __attribute__((vector_size(4 * CHACHA20_LANES)));
+
+// XORs CHACHA20_LANES whole blocks of "in" with the keystream into "out", then advances the counter.
+// Each state word holds that word for every block, so each step of a round is one vector operation.
+static void chacha20_blocks(chacha20_ctx *cc, uint8_t *out, const uint8_t *in) {
+    lanes x[16], start[16];
+    for (int i = 0; i < 16; i += 1) {
+        for (int l = 0; l < CHACHA20_LANES; l += 1) {
+            start[i][l] = cc->input[i] + (i == 12 ? (uint32_t) l : 0);
+        }
+        x[i] = start[i];
+    }
+
+    for (int i = 0; i < 10; i += 1) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i += 1) {
+        x[i] += start[i];
+    }
+    // The keystream is the words serialized little-endian, so on little-endian hosts whole words can be XORed.
+    for (int l = 0; l < CHACHA20_LANES; l += 1) {
+        for (int i = 0; i < 16; i += 1) {
+            uint32_t v = x[i][l];
+            const uint8_t *src = in + CHACHA20_BLOCK_SIZE * l + 4 * i;
+            uint8_t *dst = out + CHACHA20_BLOCK_SIZE * l + 4 * i;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            uint32_t w;
+            memcpy(&w, src, sizeof(w));
+            w ^= v;
+            memcpy(dst, &w, sizeof(w));
+#else
+            dst[0] = src[0] ^ (uint8_t) v;
+            dst[1] = src[1] ^ (uint8_t) (v >> 8);
+            dst[2] = src[2] ^ (uint8_t) (v >> 16);
+            dst[3] = src[3] ^ (uint8_t) (v >> 24);
+#endif
+        }
+    }
+    cc->input[12] += CHACHA20_LANES;
+    return;
+}
+
+// Sets up a keystream for "key" and "nonce", starting at block "counter".
+void chacha20_init(chacha20_ctx *cc, const uint8_t key[CHACHA20_KEY_SIZE],
+    const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter) {
+    // "expand 32-byte k"
+    cc->input[0] = 0x61707865;
+    cc->input[1] = 0x3320646e;
+    cc->input[2] = 0x79622d32;
+    cc->input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i += 1) {
+        cc->input[4 + i] = load32_le(key + 4 * i);
+    }
+    cc->input[12] = counter;
+    for (int i = 0; i < 3; i += 1) {
+        cc->input[13 + i] = load32_le(nonce + 4 * i);
+    }
+    cc->used = CHACHA20_BLOCK_SIZE;
+    return;
+}
+
+// XORs "len" bytes of "in" with the keystream into "out". "out" may be the same buffer as "in".
+// The keystream carries on across calls, so data can be processed in pieces of any size.
+void chacha20_xor(chacha20_ctx *cc, uint8_t *out, const uint8_t *in, size_t len) {
+    // Finish the keystream left over from the last call.
+    while (len > 0 && cc->used < CHACHA20_BLOCK_SIZE) {
+        *out++ = *in++ ^ cc->stream[cc->used++];
+        len -= 1;
+    }
+
+    // Runs of whole blocks, several at a time.
+    while (len >= CHACHA20_LANES * CHACHA20_BLOCK_SIZE) {
+        chacha20_blocks(cc, out, in);
+        in += CHACHA20_LANES * CHACHA20_BLOCK_SIZE;
+        out += CHACHA20_LANES * CHACHA20_BLOCK_SIZE;
+        len -= CHACHA20_LANES * CHACHA20_BLOCK_SIZE;
+    }
+
+    // Whole blocks.
+    while (len >= CHACHA20_BLOCK_SIZE) {
+        chacha20_block(cc);
+        for (int i = 0; i < CHACHA20_BLOCK_SIZE; i += 1) {
+            out[i] = in[i] ^ cc->stream[i];
+        }
+        in += CHACHA20_BLOCK_SIZE;
+        out += CHACHA20_BLOCK_SIZE;
+        len -= CHACHA20_BLOCK_SIZE;
+    }
+
+    // A final partial block keeps the rest of its keystream for the next call.
+    if (len > 0) {
+        chacha20_block(cc);
+        cc->used = 0;
+        while (len > 0) {
+            *out++ = *in++ ^ cc->stream[cc->used++];
+            len -= 1;
+        }
+    }
+    return;
+}
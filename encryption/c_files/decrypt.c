@@ -1,6 +1,7 @@
 #include "rsa.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "keyring.h"
 
 #include <stdio.h>
 #include <getopt.h>
@@ -9,20 +10,53 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:K:u:vh"
+
+// Long options; "--stats file", "--range start:len", and "--records framing" have no short form.
+static struct option long_options[] = {
+    { "stats", required_argument, NULL, 'S' },
+    { "range", required_argument, NULL, 'R' },
+    { "records", required_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 },
+};
 
 void help_func(void);
 
+// Returns the current time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(int argc, char **argv) {
 
+    double start = now();
     bool verbose = false;
+    char *stats_name = NULL;
+    uint64_t threads = 1;
+
+    // With "--range", only "range_len" bytes of the plaintext from "range_start" are decrypted.
+    bool ranged = false;
+    uint64_t range_start = 0;
+    uint64_t range_len = UINT64_MAX;
+    char *range_end = NULL;
+
+    // With "--records", a records file is written out in the given framing rather than its own.
+    bool records = false;
+    rsa_records framing = RSA_RECORDS_LINE;
 
     // Initialize all mpz_t variables that we'll be using in decrypt.
     // n: product of p and q (public modulus)
     // d: private key
-    mpz_t n, d;
-    mpz_inits(n, d, NULL);
+    // p, q, dp, dq, qinv: Chinese Remainder Theorem components (0 if the key file predates them)
+    // x: the extra primes of a multi-prime key
+    mpz_t n, d, p, q, dp, dq, qinv;
+    rsa_primes x;
+    mpz_inits(n, d, p, q, dp, dq, qinv, NULL);
+    rsa_primes_init(&x, 2);
 
     // Sets default input and output to stdin and stdout respectively.
     FILE *infile = stdin;
@@ -36,34 +70,91 @@ int main(int argc, char **argv) {
     // The private key file is 'rsa.priv' by default.
     char *privkey_name = "rsa.priv";
 
+    // With a keyring, the key is looked up by name instead (default: the current user).
+    char *keyring_name = NULL;
+    char *key_name = getenv("USER");
+
     int opt = 0;
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         if (opt == '?') {
             help_func();
-            mpz_clears(n, d, NULL);
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
             return 1;
         }
         switch (opt) {
         case 'i': infile_name = optarg; break;
         case 'o': outfile_name = optarg; break;
         case 'n': privkey_name = optarg; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'K': keyring_name = optarg; break;
+        case 'u': key_name = optarg; break;
         case 'v': verbose = true; break;
+        case 'S': stats_name = optarg; break;
+        case 'R':
+            // "start:len", or "start:" for the rest of the plaintext.
+            ranged = true;
+            range_start = strtoull(optarg, &range_end, 10);
+            if (*range_end != ':') {
+                fprintf(stderr, "Error: --range takes start:len.\n");
+                mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+                rsa_primes_clear(&x);
+                return 1;
+            }
+            if (range_end[1] != '\0') {
+                range_len = strtoull(range_end + 1, NULL, 10);
+            }
+            break;
+        case 'r':
+            records = true;
+            if (strcmp(optarg, "line") == 0) {
+                framing = RSA_RECORDS_LINE;
+            } else if (strcmp(optarg, "len") == 0) {
+                framing = RSA_RECORDS_LEN;
+            } else {
+                fprintf(stderr, "Error: unknown record framing '%s'.\n", optarg);
+                mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+                rsa_primes_clear(&x);
+                return 1;
+            }
+            break;
         case 'h':
             help_func();
-            mpz_clears(n, d, NULL);
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
             return 1;
         }
     }
 
+    // A range is of the plaintext as a whole, which records don't have.
+    if (records && ranged) {
+        fprintf(stderr, "Error: --records can't be combined with --range.\n");
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        return 1;
+    }
+
     // Opening of files...
 
-    privkey = fopen(privkey_name, "r");
-    // If the file fails to open, print an error.
-    if (!privkey) {
-        fprintf(stderr, "Error: failed to open file.\n");
-        mpz_clears(n, d, NULL);
-        return 1;
+    // Look up the key in the keyring if one was given, otherwise open the private key file.
+    if (keyring_name != NULL) {
+        if (key_name == NULL
+            || !keyring_load_priv(keyring_name, key_name, n, d, p, q, dp, dq, qinv)) {
+            fprintf(stderr, "Error: private key not found in keyring.\n");
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+    } else {
+        privkey = fopen(privkey_name, "r");
+        // If the file fails to open, print an error.
+        if (!privkey) {
+            fprintf(stderr, "Error: failed to open file.\n");
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
     }
 
     if (infile_name != NULL) {
@@ -71,8 +162,11 @@ int main(int argc, char **argv) {
 
         // If the file fails to open, print and error.
         if (!infile) {
-            mpz_clears(n, d, NULL);
-            fclose(privkey);
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            if (privkey) {
+                fclose(privkey);
+            }
             fprintf(stderr, "Error: failed to open infile.\n");
             return 1;
         }
@@ -83,8 +177,11 @@ int main(int argc, char **argv) {
 
         // If the file fails to open, print and error.
         if (!outfile) {
-            mpz_clears(n, d, NULL);
-            fclose(privkey);
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            if (privkey) {
+                fclose(privkey);
+            }
             fclose(infile);
             fprintf(stderr, "Error: failed to open infile.\n");
             return 1;
@@ -92,7 +189,9 @@ int main(int argc, char **argv) {
     }
 
     // Reads in the private key from privkey.
-    rsa_read_priv(n, d, privkey);
+    if (privkey) {
+        rsa_read_priv(n, d, p, q, dp, dq, qinv, &x, privkey);
+    }
 
     // If the user wants verbose output, print out all of the following to stdout...
     if (verbose) {
@@ -101,14 +200,76 @@ int main(int argc, char **argv) {
     }
 
     // Decrypt the infile and send the message to outfile.
-    rsa_decrypt_file(infile, outfile, n, d);
+    // If the ciphertext header doesn't match the key, throw an error and end the program.
+    rsa_ctx ctx;
+    rsa_ctx_init_priv(&ctx, n, d, p, q, dp, dq, qinv, &x, threads);
+    ctx.timing = verbose || stats_name != NULL;
+    if (ranged && !rsa_decrypt_range(&ctx, infile, outfile, range_start, range_len)) {
+        fprintf(stderr, "Error: --range needs a seekable indexed ciphertext for this key, "
+                        "or failed to write outfile.\n");
+        rsa_ctx_clear(&ctx);
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        if (privkey) {
+            fclose(privkey);
+        }
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+    if (records && !rsa_decrypt_records(&ctx, infile, outfile, framing)) {
+        fprintf(stderr, "Error: --records needs a records ciphertext for this key, "
+                        "the ciphertext is cut short, or failed to write outfile.\n");
+        rsa_ctx_clear(&ctx);
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        if (privkey) {
+            fclose(privkey);
+        }
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+    if (!ranged && !records && !rsa_decrypt_file(&ctx, infile, outfile)) {
+        fprintf(stderr, "Error: invalid ciphertext header, wrong key, damaged or cut short "
+                        "ciphertext, or failed to write outfile.\n");
+        rsa_ctx_clear(&ctx);
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        if (privkey) {
+            fclose(privkey);
+        }
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    // Report the counters as JSON: to stderr with -v, and to the --stats file if one was given.
+    bool stats_ok = true;
+    if (verbose) {
+        rsa_write_stats(stderr, "decrypt", &ctx, now() - start);
+    }
+    if (stats_name != NULL) {
+        FILE *statsfile = fopen(stats_name, "w");
+        if (!statsfile) {
+            fprintf(stderr, "Error: failed to open stats file.\n");
+            stats_ok = false;
+        } else {
+            rsa_write_stats(statsfile, "decrypt", &ctx, now() - start);
+            fclose(statsfile);
+        }
+    }
 
     // Freeing of allocated memory.
-    mpz_clears(n, d, NULL);
-    fclose(privkey);
+    rsa_ctx_clear(&ctx);
+    mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+    rsa_primes_clear(&x);
+    if (privkey) {
+        fclose(privkey);
+    }
     fclose(infile);
     fclose(outfile);
-    return 0;
+    return stats_ok ? 0 : 1;
 }
 
 // Helper function to print out manual page.
@@ -117,12 +278,22 @@ void help_func(void) {
            "  Decrypts data using RSA decryption.\n"
            "  Encrypted data is encrypted by the encrypt program.\n\n"
            "USAGE\n"
-           "  ./decrypt [-hv] [-i infile] [-o outfile] -n pubkey -d privkey\n\n"
+           "  ./decrypt [-hv] [--stats file] [--range start:len | --records framing] [-t threads] [-i infile] [-o outfile] -n privkey | -K keyring [-u name]\n\n"
            "OPTIONS\n"
            "  -h             Display program help and usage.\n"
-           "  -v             Display verbose program output.\n"
-           "  -i infile      Input file of data to decrypt (default: stdin).\n"
+           "  -v             Display verbose program output, with statistics as JSON on stderr.\n"
+           "  -i infile      Input file of data to decrypt, in any format encrypt writes: hex, bin, hybrid,\n"
+           "                 indexed, records or compressed (default: stdin).\n"
            "  -o outfile     Output file for decrypted data (default: stdout).\n"
-           "  -n pvfile      Private key file (default: rsa.priv).\n");
+           "  -n pvfile      Private key file (default: rsa.priv).\n"
+           "  -t threads     Worker threads for decrypting blocks (default: 1).\n"
+           "  -K keyring     Look the private key up in a binary keyring instead of a key file.\n"
+           "  -u name        Name of the key in the keyring (default: $USER).\n"
+           "  --stats file   Write statistics as JSON to a file.\n"
+           "  --range start:len\n"
+           "                 Only decrypt len bytes from byte start of an indexed file (start: for the rest).\n"
+           "  --records framing\n"
+           "                 Write the records of a records file as lines (line) or after a 4 byte big-endian\n"
+           "                 length (len), rather than as they were encrypted.\n");
     return;
 }
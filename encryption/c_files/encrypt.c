@@ -1,6 +1,7 @@
 #include "rsa.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "keyring.h"
 
 #include <stdio.h>
 #include <getopt.h>
@@ -9,15 +10,42 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:f:t:c:K:u:zvh"
+
+// Long options; "--stats file" and "--records framing" have no short form.
+static struct option long_options[] = {
+    { "stats", required_argument, NULL, 'S' },
+    { "records", required_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 },
+};
 
 void help_func(void);
 
+// Returns the current time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(int argc, char **argv) {
 
+    double start = now();
     char username[1024];
     bool verbose = false;
+    char *stats_name = NULL;
+    bool verified = false;
+    uint64_t threads = 1;
+    uint64_t cache = 1024;
+    rsa_format format = RSA_FORMAT_HEX;
+    bool format_given = false;
+    bool compress = false;
+
+    // With "--records", each line or length-prefixed record is encrypted on its own.
+    bool records = false;
+    rsa_records framing = RSA_RECORDS_LINE;
 
     // Initialize all mpz_t variables that we'll be using in encrypt.
     // n: product of p and q (public modulus)
@@ -39,9 +67,13 @@ int main(int argc, char **argv) {
     // The public key file is 'rsa.pub' by default.
     char *pubkey_name = "rsa.pub";
 
+    // With a keyring, the key is looked up by name instead (default: the current user).
+    char *keyring_name = NULL;
+    char *key_name = getenv("USER");
+
     int opt = 0;
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         if (opt == '?') {
             help_func();
             mpz_clears(n, e, s, user, NULL);
@@ -51,7 +83,41 @@ int main(int argc, char **argv) {
         case 'i': infile_name = optarg; break;
         case 'o': outfile_name = optarg; break;
         case 'n': pubkey_name = optarg; break;
+        case 'f':
+            format_given = true;
+            if (strcmp(optarg, "bin") == 0) {
+                format = RSA_FORMAT_BIN;
+            } else if (strcmp(optarg, "hex") == 0) {
+                format = RSA_FORMAT_HEX;
+            } else if (strcmp(optarg, "hybrid") == 0) {
+                format = RSA_FORMAT_HYBRID;
+            } else if (strcmp(optarg, "indexed") == 0) {
+                format = RSA_FORMAT_INDEXED;
+            } else {
+                fprintf(stderr, "Error: unknown format '%s'.\n", optarg);
+                mpz_clears(n, e, s, user, NULL);
+                return 1;
+            }
+            break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'c': cache = strtoul(optarg, NULL, 10); break;
+        case 'K': keyring_name = optarg; break;
+        case 'u': key_name = optarg; break;
+        case 'z': compress = true; break;
         case 'v': verbose = true; break;
+        case 'S': stats_name = optarg; break;
+        case 'r':
+            records = true;
+            if (strcmp(optarg, "line") == 0) {
+                framing = RSA_RECORDS_LINE;
+            } else if (strcmp(optarg, "len") == 0) {
+                framing = RSA_RECORDS_LEN;
+            } else {
+                fprintf(stderr, "Error: unknown record framing '%s'.\n", optarg);
+                mpz_clears(n, e, s, user, NULL);
+                return 1;
+            }
+            break;
         case 'h':
             help_func();
             mpz_clears(n, e, s, user, NULL);
@@ -59,23 +125,50 @@ int main(int argc, char **argv) {
         }
     }
 
-    // Opening of files...
+    // The records format is a format of its own.
+    if (records && format_given) {
+        fprintf(stderr, "Error: --records can't be combined with -f.\n");
+        mpz_clears(n, e, s, user, NULL);
+        return 1;
+    }
 
-    pubkey = fopen(pubkey_name, "r");
-    // If the file fails to open, print an error.
-    if (!pubkey) {
-        fprintf(stderr, "Error: failed to open file.\n");
+    // Only the binary and hybrid formats have a header to record the compression in.
+    if (compress && (records || (format != RSA_FORMAT_BIN && format != RSA_FORMAT_HYBRID))) {
+        fprintf(stderr, "Error: -z needs the bin or hybrid format.\n");
         mpz_clears(n, e, s, user, NULL);
         return 1;
     }
 
+    // Opening of files...
+
+    // Look up the key in the keyring if one was given, otherwise open the public key file.
+    if (keyring_name != NULL) {
+        if (key_name == NULL || strlen(key_name) >= sizeof(username)
+            || !keyring_load_pub(keyring_name, key_name, n, e, s, &verified)) {
+            fprintf(stderr, "Error: key not found in keyring.\n");
+            mpz_clears(n, e, s, user, NULL);
+            return 1;
+        }
+        strcpy(username, key_name);
+    } else {
+        pubkey = fopen(pubkey_name, "r");
+        // If the file fails to open, print an error.
+        if (!pubkey) {
+            fprintf(stderr, "Error: failed to open file.\n");
+            mpz_clears(n, e, s, user, NULL);
+            return 1;
+        }
+    }
+
     if (infile_name != NULL) {
         infile = fopen(infile_name, "r");
 
         // If the file fails to open, print an error.
         if (!infile) {
             mpz_clears(n, e, s, user, NULL);
-            fclose(pubkey);
+            if (pubkey) {
+                fclose(pubkey);
+            }
             fprintf(stderr, "Error: failed to open infile.\n");
             return 1;
         }
@@ -87,14 +180,18 @@ int main(int argc, char **argv) {
         // If the file fails to open, print an error.
         if (!outfile) {
             mpz_clears(n, e, s, user, NULL);
-            fclose(pubkey);
+            if (pubkey) {
+                fclose(pubkey);
+            }
             fprintf(stderr, "Error: failed to open infile.\n");
             return 1;
         }
     }
 
     // Read the public key, username, and signature from pubkey.
-    rsa_read_pub(n, e, s, username, pubkey);
+    if (pubkey) {
+        rsa_read_pub(n, e, s, username, pubkey);
+    }
 
     // If the user wants verbose output, print out all of the following to stdout...
     if (verbose) {
@@ -104,27 +201,76 @@ int main(int argc, char **argv) {
         gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
     }
 
-    // Verify the signature.
+    // Verify the signature, unless the keyring says it already was.
     mpz_set_str(user, username, 62);
     // If the signature isn't verified, throw an error and end the program.
-    if (!rsa_verify(user, s, e, n)) {
+    if (!verified && !rsa_verify(user, s, e, n)) {
         fprintf(stderr, "Error: Signature couldn't be verified.\n");
         mpz_clears(n, e, s, user, NULL);
-        fclose(pubkey);
+        if (pubkey) {
+            fclose(pubkey);
+        }
         fclose(infile);
         fclose(outfile);
         return 1;
     }
 
     // Encrypt the infile and send the ciphertext to outfile.
-    rsa_encrypt_file(infile, outfile, n, e);
+    rsa_ctx ctx;
+    rsa_ctx_init_pub(&ctx, n, e, threads);
+    ctx.timing = verbose || stats_name != NULL;
+    ctx.compress = compress;
+    rsa_ctx_cache(&ctx, cache);
+    if (records && !rsa_encrypt_records(&ctx, infile, outfile, framing)) {
+        fprintf(stderr, "Error: key too small, input ends inside a length-prefixed record, "
+                        "or failed to write outfile.\n");
+        rsa_ctx_clear(&ctx);
+        mpz_clears(n, e, s, user, NULL);
+        if (pubkey) {
+            fclose(pubkey);
+        }
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+    if (!records && !rsa_encrypt_file(&ctx, infile, outfile, format)) {
+        fprintf(stderr, "Error: key too small, failed to generate a session key, "
+                        "or failed to write outfile.\n");
+        rsa_ctx_clear(&ctx);
+        mpz_clears(n, e, s, user, NULL);
+        if (pubkey) {
+            fclose(pubkey);
+        }
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+
+    // Report the counters as JSON: to stderr with -v, and to the --stats file if one was given.
+    bool stats_ok = true;
+    if (verbose) {
+        rsa_write_stats(stderr, "encrypt", &ctx, now() - start);
+    }
+    if (stats_name != NULL) {
+        FILE *statsfile = fopen(stats_name, "w");
+        if (!statsfile) {
+            fprintf(stderr, "Error: failed to open stats file.\n");
+            stats_ok = false;
+        } else {
+            rsa_write_stats(statsfile, "encrypt", &ctx, now() - start);
+            fclose(statsfile);
+        }
+    }
+    rsa_ctx_clear(&ctx);
 
     // Freeing of allocated memory.
     mpz_clears(n, e, s, user, NULL);
-    fclose(pubkey);
+    if (pubkey) {
+        fclose(pubkey);
+    }
     fclose(infile);
     fclose(outfile);
-    return 0;
+    return stats_ok ? 0 : 1;
 }
 
 // Helper function to print out manual page.
@@ -133,12 +279,23 @@ void help_func(void) {
            "  Encrypts data using RSA encryption.\n"
            "  Encrypted data is decrypted by the decrypt program.\n\n"
            "USAGE\n"
-           "  ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey -d privkey\n\n"
+           "  ./encrypt [-hvz] [--stats file] [-f format | --records framing] [-t threads] [-c entries] [-i infile] [-o outfile] -n pubkey | -K keyring [-u name]\n\n"
            "OPTIONS\n"
            "  -h             Display program help and usage.\n"
-           "  -v             Display verbose program output.\n"
+           "  -v             Display verbose program output, with statistics as JSON on stderr.\n"
            "  -i infile      Input file of data to encrypt (default: stdin).\n"
            "  -o outfile     Output file for encrypted data (default: stdout).\n"
-           "  -n pbfile      Public key file (default: rsa.pub).\n");
+           "  -n pbfile      Public key file (default: rsa.pub).\n"
+           "  -f format      Ciphertext format, hex, bin, hybrid, or indexed (default: hex).\n"
+           "  -z             Compress the data before encrypting it (bin and hybrid formats only).\n"
+           "  -t threads     Worker threads for encrypting blocks (default: 1).\n"
+           "  -c entries     Ciphertexts of recent blocks each thread keeps for repeated blocks, 0 for none\n"
+           "                 (default: 1024).\n"
+           "  -K keyring     Look the public key up in a binary keyring instead of a key file.\n"
+           "  -u name        Name of the key in the keyring (default: $USER).\n"
+           "  --stats file   Write statistics as JSON to a file.\n"
+           "  --records framing\n"
+           "                 Encrypt each record on its own, taking lines (line) or records after a 4 byte\n"
+           "                 big-endian length (len).\n");
     return;
 }
@@ -1,6 +1,8 @@
 #include "rsa.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "keyring.h"
+#include "pipeline.h"
 
 #include <stdio.h>
 #include <getopt.h>
@@ -9,19 +11,239 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
 
-#define OPTIONS "b:i:n:d:s:vh"
+#define OPTIONS "b:i:n:d:s:t:K:P:N:o:k:r:evh"
+
+// Long options; "--stats file" has no short form.
+static struct option long_options[] = {
+    { "stats", required_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+};
+
+// Phases of key generation that are timed for the statistics.
+enum { PHASE_PUB, PHASE_PRIV, PHASE_CRT, PHASE_SIGN, PHASE_WRITE, PHASES };
+
+static const char *phase_names[PHASES] = { "make_pub", "make_priv", "make_crt", "sign", "write" };
 
 void help_func(void);
 
+// Returns the current time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes the phase times and the prime search counters to "f" as a single line of JSON.
+// With several keys, the phase times add up over all workers.
+static void write_stats(FILE *f, uint64_t bits, uint64_t primes, uint64_t threads, prime_test test,
+    uint64_t keys, double wall, double phases[]) {
+    numtheory_stats st;
+    numtheory_stats_get(&st);
+    fprintf(f,
+        "{\"program\":\"keygen\",\"bits\":%" PRIu64 ",\"primes\":%" PRIu64 ",\"threads\":%" PRIu64
+        ",\"prime_test\":\"%s\",\"rng\":\"%s\",\"keys\":%" PRIu64
+        ",\"keys_per_s\":%.3f,\"wall_s\":%.6f",
+        bits, primes, threads, test == PRIME_TEST_BPSW ? "bpsw" : "mr",
+        state.backend == RAND_MT ? "mt" : "chacha", keys, wall > 0 ? keys / wall : 0, wall);
+    for (int i = 0; i < PHASES; i += 1) {
+        fprintf(f, ",\"%s_s\":%.6f", phase_names[i], phases[i]);
+    }
+    fprintf(f,
+        ",\"candidates\":%" PRIu64 ",\"size_rejects\":%" PRIu64 ",\"sieve_rejects\":%" PRIu64
+        ",\"mr_rejects\":%" PRIu64 ",\"mr_rounds\":%" PRIu64 ",\"lucas_tests\":%" PRIu64
+        ",\"pow_mod_calls\":%" PRIu64 "}\n",
+        st.candidates, st.size_rejects, st.sieve_rejects, st.mr_rejects, st.mr_rounds,
+        st.lucas_tests, st.pow_mod_calls);
+    return;
+}
+
+// Shared state of a bulk run, which makes many key pairs on the pipeline:
+// the reader hands each key a seed, the workers make the keys, and the writer saves them in order.
+typedef struct {
+    uint64_t count;    // Key pairs to make.
+    uint64_t next;     // Keys handed out by the reader so far.
+    uint64_t written;  // Keys saved by the writer so far.
+    uint64_t bits;     // Options shared by every key.
+    uint64_t primes;
+    uint64_t iters;
+    prime_test test;
+    uint64_t fixed_e;
+    rand_backend backend;
+    char *dir;         // Directory the key files go in.
+    char *username;    // Username every key signs.
+    bool ok;           // False once a key file fails to open.
+    double *phases;    // Phase times, one row of PHASES per worker.
+} bulk_job;
+
+// Reader: gives the next key a seed drawn from the global state.
+// Seeds are drawn in key order, so a fixed "-s seed" gives the same keys with any number of threads.
+static bool bulk_read(void *arg, pipeline_slot *slot) {
+    bulk_job *job = (bulk_job *) arg;
+    if (job->next == job->count) {
+        return false;
+    }
+    rand_draw_seed(&state, slot->in);
+    slot->in_len = RAND_SEED_SIZE;
+    job->next += 1;
+    return true;
+}
+
+// Worker: makes one key pair from the seed in the slot, with its own random state,
+// and formats the public key file followed by the private key file into the slot, separated by a 0 byte.
+static void bulk_work(void *arg, uint64_t worker, pipeline_slot *slot) {
+    bulk_job *job = (bulk_job *) arg;
+    double *phases = job->phases + worker * PHASES;
+    double t0 = 0;
+    rand_state rs;
+    rsa_primes x;
+    mpz_t p, q, n, e, d, user, s, dp, dq, qinv;
+
+    rand_init_seed(&rs, job->backend, slot->in);
+    mpz_inits(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_primes_init(&x, job->primes);
+
+    t0 = now();
+    rsa_make_pub_r(p, q, &x, n, e, job->bits, job->iters, job->test, job->fixed_e, &rs);
+    phases[PHASE_PUB] += now() - t0;
+    t0 = now();
+    rsa_make_priv(d, e, p, q, &x);
+    phases[PHASE_PRIV] += now() - t0;
+    t0 = now();
+    rsa_make_crt(dp, dq, qinv, &x, d, p, q);
+    phases[PHASE_CRT] += now() - t0;
+    t0 = now();
+    mpz_set_str(user, job->username, 62);
+    rsa_sign_crt(s, user, p, q, dp, dq, qinv, &x);
+    phases[PHASE_SIGN] += now() - t0;
+
+    // The slot is sized for the largest key, so the files always fit.
+    FILE *mem = fmemopen(slot->out, slot->out_cap, "w");
+    rsa_write_pub(n, e, s, job->username, mem);
+    fputc('\0', mem);
+    rsa_write_priv(n, d, p, q, dp, dq, qinv, &x, mem);
+    fflush(mem);
+    slot->out_len = ftell(mem);
+    fclose(mem);
+
+    // Freeing of allocated memory.
+    mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_primes_clear(&x);
+    rand_clear(&rs);
+    return;
+}
+
+// Writes "len" bytes of "buf" to a new file "name", with permissions "mode".
+// Returns false if the file can't be opened.
+static bool write_key_file(const char *name, const uint8_t *buf, size_t len, mode_t mode) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0) {
+        return false;
+    }
+    FILE *f = fdopen(fd, "w");
+    fchmod(fd, mode);
+    fwrite(buf, 1, len, f);
+    fclose(f);
+    return true;
+}
+
+// Writer: saves key i as "dir/key<i>.pub" and "dir/key<i>.priv", the private key readable by the user only.
+static void bulk_write(void *arg, pipeline_slot *slot) {
+    bulk_job *job = (bulk_job *) arg;
+    double t0 = now();
+    char name[4096];
+    size_t pub_len = strlen((char *) slot->out);
+
+    snprintf(name, sizeof(name), "%s/key%06" PRIu64 ".pub", job->dir, job->written);
+    bool ok = write_key_file(name, slot->out, pub_len, 0644);
+    snprintf(name, sizeof(name), "%s/key%06" PRIu64 ".priv", job->dir, job->written);
+    ok = ok && write_key_file(name, slot->out + pub_len + 1, slot->out_len - pub_len - 1, 0600);
+    if (!ok && job->ok) {
+        fprintf(stderr, "Error: failed to open file.\n");
+        job->ok = false;
+    }
+    job->written += 1;
+    job->phases[PHASE_WRITE] += now() - t0;
+    return;
+}
+
+// Makes "job->count" key pairs into "job->dir" across "threads" workers, and reports keys per second.
+// Returns the exit status for keygen.
+static int bulk_main(bulk_job *job, uint64_t threads, bool verbose, char *stats_name, double start) {
+    uint64_t workers = threads > 0 ? threads : 1;
+    double phases[PHASES] = { 0 };
+
+    // Create the output directory unless it already exists.
+    if (mkdir(job->dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: failed to create directory '%s'.\n", job->dir);
+        return 1;
+    }
+
+    // Each slot carries one key's seed in, and both of its key files out: ten numbers, plus three for
+    // each extra prime. Every number in them takes at most (bits + 2) / 4 + 1 hex digits and a newline.
+    size_t numbers = 10 + 3 * (job->primes - 2);
+    size_t out_cap = numbers * ((job->bits + 2) / 4 + 2) + strlen(job->username) + 2;
+    job->phases = (double *) calloc(workers * PHASES, sizeof(double));
+    job->ok = true;
+    pipeline_run(threads, RAND_SEED_SIZE, out_cap, bulk_read, bulk_work, bulk_write, job);
+
+    double wall = now() - start;
+    for (uint64_t w = 0; w < workers; w += 1) {
+        for (int i = 0; i < PHASES; i += 1) {
+            phases[i] += job->phases[w * PHASES + i];
+        }
+    }
+    printf("Generated %" PRIu64 " keys in %.3f s (%.1f keys/s).\n", job->written, wall,
+        job->written / wall);
+
+    // Report the statistics as JSON: to stderr with -v, and to the --stats file if one was given.
+    bool stats_ok = true;
+    if (verbose) {
+        write_stats(stderr, job->bits, job->primes, threads, job->test, job->written, wall, phases);
+    }
+    if (stats_name != NULL) {
+        FILE *statsfile = fopen(stats_name, "w");
+        if (!statsfile) {
+            fprintf(stderr, "Error: failed to open stats file.\n");
+            stats_ok = false;
+        } else {
+            write_stats(
+                statsfile, job->bits, job->primes, threads, job->test, job->written, wall, phases);
+            fclose(statsfile);
+        }
+    }
+
+    // Freeing of allocated memory.
+    free(job->phases);
+    return job->ok && stats_ok ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
 
+    double start = now();
+    double phases[PHASES] = { 0 };
+    double t0 = 0;
+
     // Default values for the command line options.
     uint64_t num_bits = 256;
-    uint64_t mr_iters = 50;
-    time_t seed = time(NULL);
+    uint64_t num_primes = 2;
+    // Miller-Rabin iterations default to 50 on their own, and to no extra rounds after Baillie-PSW.
+    uint64_t mr_iters = 0;
+    bool iters_given = false;
+    prime_test test = PRIME_TEST_BPSW;
+    uint64_t threads = 1;
+    uint64_t fixed_e = 0;
+    uint64_t seed = 0;
+    bool seed_given = false;
+    rand_backend backend = RAND_CHACHA;
     char *username = NULL;
     bool verbose = false;
+    char *stats_name = NULL;
+    uint64_t bulk_count = 0;
+    char *bulk_dir = NULL;
 
     // Initialize all mpz_t variables that we'll be using in keygen.
     // p: prime number 1
@@ -31,8 +253,11 @@ int main(int argc, char **argv) {
     // d: private key
     // user: username of type mpz_t
     // s: signature
-    mpz_t p, q, n, e, d, user, s;
-    mpz_inits(p, q, n, e, d, user, s, NULL);
+    // dp, dq, qinv: Chinese Remainder Theorem components of the private key
+    // x: the extra primes of a multi-prime key, with their CRT components
+    mpz_t p, q, n, e, d, user, s, dp, dq, qinv;
+    mpz_inits(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_primes x;
 
     // File pointers for public and private keys.
     FILE *pbfile = NULL;
@@ -42,28 +267,118 @@ int main(int argc, char **argv) {
     char *pbfile_name = "rsa.pub";
     char *pvfile_name = "rsa.priv";
 
+    // Keyring to also add the key to, if any.
+    char *keyring_name = NULL;
+
     int opt = 0;
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         if (opt == '?') {
             help_func();
-            mpz_clears(p, q, n, e, d, user, s, NULL);
+            mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
             return 1;
         }
         switch (opt) {
         case 'b': num_bits = strtoul(optarg, NULL, 10); break;
-        case 'i': mr_iters = strtoul(optarg, NULL, 10); break;
+        case 'i':
+            mr_iters = strtoul(optarg, NULL, 10);
+            iters_given = true;
+            break;
         case 'n': pbfile_name = optarg; break;
         case 'd': pvfile_name = optarg; break;
-        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            seed_given = true;
+            break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'e': fixed_e = RSA_FIXED_E; break;
+        case 'K': keyring_name = optarg; break;
+        case 'P':
+            if (strcmp(optarg, "bpsw") == 0) {
+                test = PRIME_TEST_BPSW;
+            } else if (strcmp(optarg, "mr") == 0) {
+                test = PRIME_TEST_MR;
+            } else {
+                fprintf(stderr, "Error: unknown primality test '%s'.\n", optarg);
+                mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "chacha") == 0) {
+                backend = RAND_CHACHA;
+            } else if (strcmp(optarg, "mt") == 0) {
+                backend = RAND_MT;
+            } else {
+                fprintf(stderr, "Error: unknown random generator '%s'.\n", optarg);
+                mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+                return 1;
+            }
+            break;
+        case 'k': num_primes = strtoul(optarg, NULL, 10); break;
+        case 'N': bulk_count = strtoul(optarg, NULL, 10); break;
+        case 'o': bulk_dir = optarg; break;
         case 'v': verbose = true; break;
+        case 'S': stats_name = optarg; break;
         case 'h':
             help_func();
-            mpz_clears(p, q, n, e, d, user, s, NULL);
+            mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
             return 1;
         }
     }
 
+    if (!iters_given && test == PRIME_TEST_MR) {
+        mr_iters = 50;
+    }
+
+    // A key has 2 to RSA_MAX_PRIMES primes, and the keyring only has room for two.
+    if (num_primes < 2 || num_primes > RSA_MAX_PRIMES) {
+        fprintf(stderr, "Error: -k takes 2 to %d primes.\n", RSA_MAX_PRIMES);
+        mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+        return 1;
+    }
+    if (num_primes > 2 && keyring_name != NULL) {
+        fprintf(stderr, "Error: multi-prime keys can't be added to a keyring.\n");
+        mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+        return 1;
+    }
+
+    // Seed the random state from "-s seed", or from the operating system.
+    if (seed_given) {
+        randstate_init(backend, seed);
+    } else if (!randstate_init_os(backend)) {
+        fprintf(stderr, "Error: failed to seed the random state.\n");
+        mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+        return 1;
+    }
+
+    // With "-N count", make that many key pairs into the "-o" directory instead of one into pbfile and pvfile.
+    if (bulk_count > 0) {
+        int status = 1;
+        if (bulk_dir == NULL || keyring_name != NULL) {
+            fprintf(stderr, "Error: -N needs -o dir, and can't be used with -K.\n");
+        } else {
+            bulk_job job = { 0 };
+            job.count = bulk_count;
+            job.bits = num_bits;
+            job.primes = num_primes;
+            job.iters = mr_iters;
+            job.test = test;
+            job.fixed_e = fixed_e;
+            job.backend = backend;
+            job.dir = bulk_dir;
+            job.username = getenv("USER");
+            if (!job.username) {
+                fprintf(stderr, "Error: failed to retrieve username, setting username to 'USER'.\n");
+                job.username = "USER";
+            }
+            status = bulk_main(&job, threads, verbose, stats_name, start);
+        }
+        mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+        randstate_clear();
+        return status;
+    }
+
     // Opening of files to print the public and private keys to.
     pbfile = fopen(pbfile_name, "w");
     pvfile = fopen(pvfile_name, "w");
@@ -78,12 +393,18 @@ int main(int argc, char **argv) {
     int fd = fileno(pvfile);
     fchmod(fd, 0600);
 
-    // Initialize the random state with the given seed.
-    randstate_init(seed);
+    rsa_primes_init(&x, num_primes);
 
     // Make both public and private keys.
-    rsa_make_pub(p, q, n, e, num_bits, mr_iters);
-    rsa_make_priv(d, e, p, q);
+    t0 = now();
+    rsa_make_pub(p, q, &x, n, e, num_bits, mr_iters, test, threads, fixed_e);
+    phases[PHASE_PUB] = now() - t0;
+    t0 = now();
+    rsa_make_priv(d, e, p, q, &x);
+    phases[PHASE_PRIV] = now() - t0;
+    t0 = now();
+    rsa_make_crt(dp, dq, qinv, &x, d, p, q);
+    phases[PHASE_CRT] = now() - t0;
 
     // Retrieve the user's username; if we fail to retrieve the username, set the username to 'USER'.
     username = getenv("USER");
@@ -93,12 +414,34 @@ int main(int argc, char **argv) {
     }
 
     // Sign the username.
+    t0 = now();
     mpz_set_str(user, username, 62);
-    rsa_sign(s, user, d, n);
+    rsa_sign_crt(s, user, p, q, dp, dq, qinv, &x);
+    phases[PHASE_SIGN] = now() - t0;
 
     // Write both the public and private keys to their respective files.
+    t0 = now();
     rsa_write_pub(n, e, s, username, pbfile);
-    rsa_write_priv(n, d, pvfile);
+    rsa_write_priv(n, d, p, q, dp, dq, qinv, &x, pvfile);
+
+    // Add the key to the keyring under the username.
+    // The signature is checked once here, so encrypt can skip checking it on every run.
+    if (keyring_name != NULL) {
+        uint32_t flags = KEYRING_PRIVATE;
+        if (rsa_verify(user, s, e, n)) {
+            flags |= KEYRING_VERIFIED;
+        }
+        if (!keyring_add(keyring_name, username, flags, n, e, s, d, p, q, dp, dq, qinv)) {
+            fprintf(stderr, "Error: failed to add key to keyring.\n");
+            mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            randstate_clear();
+            fclose(pbfile);
+            fclose(pvfile);
+            return 1;
+        }
+    }
+    phases[PHASE_WRITE] = now() - t0;
 
     // If the user wants verbose output, print out all of the following to stdout...
     if (verbose) {
@@ -106,17 +449,37 @@ int main(int argc, char **argv) {
         gmp_printf("s (%d bits) = %Zd\n", mpz_sizeinbase(s, 2), s);
         gmp_printf("p (%d bits) = %Zd\n", mpz_sizeinbase(p, 2), p);
         gmp_printf("q (%d bits) = %Zd\n", mpz_sizeinbase(q, 2), q);
+        for (uint64_t i = 0; i + 2 < x.count; i += 1) {
+            gmp_printf("r%d (%d bits) = %Zd\n", (int) i + 3, mpz_sizeinbase(x.r[i], 2), x.r[i]);
+        }
         gmp_printf("n (%d bits) = %Zd\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("e (%d bits) = %Zd\n", mpz_sizeinbase(e, 2), e);
         gmp_printf("d (%d bits) = %Zd\n", mpz_sizeinbase(d, 2), d);
     }
 
+    // Report the statistics as JSON: to stderr with -v, and to the --stats file if one was given.
+    bool stats_ok = true;
+    if (verbose) {
+        write_stats(stderr, num_bits, num_primes, threads, test, 1, now() - start, phases);
+    }
+    if (stats_name != NULL) {
+        FILE *statsfile = fopen(stats_name, "w");
+        if (!statsfile) {
+            fprintf(stderr, "Error: failed to open stats file.\n");
+            stats_ok = false;
+        } else {
+            write_stats(statsfile, num_bits, num_primes, threads, test, 1, now() - start, phases);
+            fclose(statsfile);
+        }
+    }
+
     // Freeing of allocated memory.
-    mpz_clears(p, q, n, e, d, user, s, NULL);
+    mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_primes_clear(&x);
     randstate_clear();
     fclose(pbfile);
     fclose(pvfile);
-    return 0;
+    return stats_ok ? 0 : 1;
 }
 
 // Helper function to print out manual page.
@@ -124,14 +487,24 @@ void help_func(void) {
     printf("SYNOPSIS\n"
            "  Generates an RSA public/private key pair.\n\n"
            "USAGE\n"
-           "  ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n\n"
+           "  ./keygen [-hve] [--stats file] [-b bits] [-k primes] [-P test] [-r rng] [-s seed] [-i iterations] [-t threads] [-K keyring] -n pbfile -d pvfile\n"
+           "  ./keygen [-hve] [--stats file] [-b bits] [-k primes] [-P test] [-r rng] [-s seed] [-i iterations] [-t threads] -N count -o dir\n\n"
            "OPTIONS\n"
            "  -h             Display program help and usage.\n"
-           "  -v             Display verbose program output.\n"
+           "  -v             Display verbose program output, with statistics as JSON on stderr.\n"
            "  -b bits        Minimum bits needed for public key n.\n"
-           "  -i iterations  Miller-Rabin iterations for testing primes (default: 50).\n"
+           "  -k primes      Primes in n, 2 to 4; more than 2 makes balanced primes (3 suits 3072 bits, 4 suits 4096).\n"
+           "  -P test        Primality test for the primes, bpsw (Baillie-PSW) or mr (Miller-Rabin) (default: bpsw).\n"
+           "  -i iterations  Miller-Rabin iterations for testing primes, or extra rounds after bpsw (default: 50 or 0).\n"
            "  -n pbfile      Public key file (default: rsa.pub).\n"
            "  -d pvfile      Private key file (default: rsa.priv).\n"
-           "  -s seed        Random seed for testing.\n");
+           "  -s seed        Random seed for testing (default: seeded by the operating system).\n"
+           "  -r rng         Random generator, chacha (ChaCha20) or mt (Mersenne Twister) (default: chacha).\n"
+           "  -t threads     Worker threads for the prime search, or for making keys with -N (default: 1).\n"
+           "  -e             Use the fixed public exponent 65537 instead of a random one.\n"
+           "  -K keyring     Also add the key to a binary keyring, under the username.\n"
+           "  -N count       Make this many key pairs, as dir/key000000.pub, dir/key000000.priv, and so on.\n"
+           "  -o dir         Directory for the key pairs made with -N, created if needed.\n"
+           "  --stats file   Write statistics as JSON to a file.\n");
     return;
 }
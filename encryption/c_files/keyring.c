@@ -0,0 +1,368 @@
+#include "keyring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Offsets of the fields within an entry record.
+#define ENTRY_HASH   64
+#define ENTRY_FLAGS  72
+#define ENTRY_BITS   76
+#define ENTRY_NBYTES 80
+#define ENTRY_K      84
+#define ENTRY_DATA   88
+#define ENTRY_LEN    96
+
+// Reads a big-endian 32 bit value.
+static uint32_t get32(const uint8_t *b) {
+    return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+}
+
+// Reads a big-endian 64 bit value.
+static uint64_t get64(const uint8_t *b) {
+    return ((uint64_t) get32(b) << 32) | get32(b + 4);
+}
+
+// Writes a big-endian 32 bit value.
+static void put32(uint8_t *b, uint32_t v) {
+    for (int i = 0; i < 4; i += 1) {
+        b[i] = (uint8_t) (v >> (24 - 8 * i));
+    }
+    return;
+}
+
+// Writes a big-endian 64 bit value.
+static void put64(uint8_t *b, uint64_t v) {
+    put32(b, (uint32_t) (v >> 32));
+    put32(b + 4, (uint32_t) v);
+    return;
+}
+
+// Hashes a key name with 64 bit FNV-1a.
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const uint8_t *c = (const uint8_t *) name; *c; c += 1) {
+        h ^= *c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Returns a pointer to entry record "i" in a mapped keyring.
+static const uint8_t *entry_record(keyring *kr, uint32_t i) {
+    return kr->map + KEYRING_HEADER + 4 * (size_t) kr->buckets + KEYRING_ENTRY_SIZE * (size_t) i;
+}
+
+// Fills in "ke" from entry record "i".
+// Returns false if the entry's data runs past the end of the file.
+static bool entry_read(keyring *kr, uint32_t i, keyring_entry *ke) {
+    const uint8_t *rec = entry_record(kr, i);
+    uint64_t offset = get64(rec + ENTRY_DATA);
+
+    memcpy(ke->name, rec, KEYRING_NAME_MAX);
+    ke->name[KEYRING_NAME_MAX - 1] = '\0';
+    ke->flags = get32(rec + ENTRY_FLAGS);
+    ke->bits = get32(rec + ENTRY_BITS);
+    ke->nbytes = get32(rec + ENTRY_NBYTES);
+    ke->k = get32(rec + ENTRY_K);
+    for (int f = 0; f < KEYRING_FIELDS; f += 1) {
+        ke->len[f] = get32(rec + ENTRY_LEN + 4 * f);
+        if (offset > kr->size || ke->len[f] > kr->size - offset) {
+            return false;
+        }
+        ke->data[f] = kr->map + offset;
+        offset += ke->len[f];
+    }
+    return true;
+}
+
+// Maps the keyring at "path" read-only into memory.
+// Returns false if the file can't be opened or isn't a valid keyring.
+bool keyring_open(keyring *kr, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < KEYRING_HEADER) {
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    kr->size = (size_t) st.st_size;
+    void *map = mmap(NULL, kr->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    kr->map = (const uint8_t *) map;
+
+    // Check the header, then make sure the index and the entry records fit in the file.
+    kr->count = get32(kr->map + 8);
+    kr->buckets = get32(kr->map + 12);
+    if (memcmp(kr->map, KEYRING_MAGIC, 4) != 0 || kr->map[4] == 0 || kr->map[4] > KEYRING_VERSION
+        || kr->buckets == 0 || (kr->buckets & (kr->buckets - 1)) != 0
+        || KEYRING_HEADER + 4 * (uint64_t) kr->buckets
+                   + KEYRING_ENTRY_SIZE * (uint64_t) kr->count
+               > kr->size) {
+        munmap(map, kr->size);
+        return false;
+    }
+    return true;
+}
+
+// Unmaps a keyring.
+void keyring_close(keyring *kr) {
+    munmap((void *) kr->map, kr->size);
+    return;
+}
+
+// Looks up the key called "name" through the hash index.
+// Returns true and fills in "ke" if it was found.
+bool keyring_find(keyring *kr, const char *name, keyring_entry *ke) {
+    uint64_t h = name_hash(name);
+    const uint8_t *index = kr->map + KEYRING_HEADER;
+
+    // Linear probing; the index is never full, so an empty bucket ends the search.
+    for (uint32_t probe = 0; probe < kr->buckets; probe += 1) {
+        uint32_t slot = get32(index + 4 * ((h + probe) & (kr->buckets - 1)));
+        if (slot == 0) {
+            return false;
+        }
+        if (slot > kr->count) {
+            continue;
+        }
+        const uint8_t *rec = entry_record(kr, slot - 1);
+        if (get64(rec + ENTRY_HASH) == h && strncmp((const char *) rec, name, KEYRING_NAME_MAX) == 0) {
+            return entry_read(kr, slot - 1, ke);
+        }
+    }
+    return false;
+}
+
+// Sets "v" to a field of a key found in a keyring. Missing fields are 0.
+void keyring_get(keyring_entry *ke, keyring_field field, mpz_t v) {
+    if (ke->len[field] == 0) {
+        mpz_set_ui(v, 0);
+        return;
+    }
+    mpz_import(v, ke->len[field], 1, sizeof(uint8_t), 1, 0, ke->data[field]);
+    return;
+}
+
+// Takes the lock that keeps writers of the keyring at "path" from overlapping: an exclusive flock() on
+// the file "<path>.lock", which is created if needed. The keyring itself can't be locked, since every
+// write replaces it with a new file.
+// Returns the descriptor holding the lock, or -1 if it can't be taken.
+static int keyring_lock(const char *path) {
+    size_t lock_len = strlen(path) + 6;
+    char *lock = (char *) calloc(lock_len, sizeof(char));
+    snprintf(lock, lock_len, "%s.lock", path);
+    int fd = open(lock, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    free(lock);
+    return fd;
+}
+
+// Adds a key called "name" to the keyring at "path", replacing any key with the same name.
+// The keyring is created if it doesn't exist yet. It is rewritten to a temporary file that then takes
+// its place, so readers never see a partial keyring. Writers take turns through keyring_lock(), so keys
+// added at the same time by separate processes are all kept. Pass 0 for the private fields of a public-only key.
+// Returns false if the name is too long, the existing file isn't a keyring, or the new one can't be written.
+bool keyring_add(const char *path, const char *name, uint32_t flags, mpz_t n, mpz_t e, mpz_t s,
+    mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv) {
+    keyring kr = { 0 };
+    bool have_old = false;
+    bool ok = true;
+    mpz_ptr values[KEYRING_FIELDS] = { n, e, s, d, p, q, dp, dq, qinv };
+
+    if (strlen(name) >= KEYRING_NAME_MAX) {
+        return false;
+    }
+
+    // The lock is held from reading the old keyring until the new one has taken its place.
+    int lock_fd = keyring_lock(path);
+    if (lock_fd < 0) {
+        return false;
+    }
+
+    // An existing file has to be a keyring; anything else is left alone.
+    if (access(path, F_OK) == 0) {
+        if (!keyring_open(&kr, path)) {
+            close(lock_fd);
+            return false;
+        }
+        have_old = true;
+    }
+
+    // Gather the entries to keep, then the new one.
+    uint32_t count = 0;
+    keyring_entry *entries = (keyring_entry *) calloc(kr.count + 1, sizeof(keyring_entry));
+    for (uint32_t i = 0; i < kr.count; i += 1) {
+        if (!entry_read(&kr, i, &entries[count])) {
+            ok = false;
+            break;
+        }
+        if (strcmp(entries[count].name, name) != 0) {
+            count += 1;
+        }
+    }
+
+    keyring_entry *ke = &entries[count];
+    uint8_t *fresh[KEYRING_FIELDS] = { NULL };
+    strcpy(ke->name, name);
+    ke->flags = flags;
+    ke->bits = (uint32_t) mpz_sizeinbase(n, 2);
+    ke->nbytes = (uint32_t) mpz_sizeinbase(n, 256);
+    ke->k = (uint32_t) ((mpz_sizeinbase(n, 2) - 1) / 8);
+    for (int f = 0; f < KEYRING_FIELDS; f += 1) {
+        size_t len = 0;
+        if (mpz_sgn(values[f]) != 0) {
+            fresh[f] = (uint8_t *) mpz_export(NULL, &len, 1, sizeof(uint8_t), 1, 0, values[f]);
+        }
+        ke->data[f] = fresh[f];
+        ke->len[f] = (uint32_t) len;
+    }
+    count += 1;
+
+    // Keep the index at most half full so probe sequences stay short.
+    uint32_t buckets = 1;
+    while (buckets < 2 * count) {
+        buckets *= 2;
+    }
+
+    // Build the header, index, and entry records in memory.
+    size_t table = KEYRING_HEADER + 4 * (size_t) buckets + KEYRING_ENTRY_SIZE * (size_t) count;
+    uint8_t *head = (uint8_t *) calloc(table, sizeof(uint8_t));
+    memcpy(head, KEYRING_MAGIC, 4);
+    head[4] = KEYRING_VERSION;
+    put32(head + 8, count);
+    put32(head + 12, buckets);
+
+    uint64_t offset = table;
+    for (uint32_t i = 0; i < count; i += 1) {
+        uint8_t *rec = head + KEYRING_HEADER + 4 * (size_t) buckets + KEYRING_ENTRY_SIZE * (size_t) i;
+        uint64_t h = name_hash(entries[i].name);
+
+        memcpy(rec, entries[i].name, strlen(entries[i].name));
+        put64(rec + ENTRY_HASH, h);
+        put32(rec + ENTRY_FLAGS, entries[i].flags);
+        put32(rec + ENTRY_BITS, entries[i].bits);
+        put32(rec + ENTRY_NBYTES, entries[i].nbytes);
+        put32(rec + ENTRY_K, entries[i].k);
+        put64(rec + ENTRY_DATA, offset);
+        for (int f = 0; f < KEYRING_FIELDS; f += 1) {
+            put32(rec + ENTRY_LEN + 4 * f, entries[i].len[f]);
+            offset += entries[i].len[f];
+        }
+
+        // Insert into the first free bucket along the probe sequence.
+        uint32_t b = (uint32_t) (h & (buckets - 1));
+        while (get32(head + KEYRING_HEADER + 4 * (size_t) b) != 0) {
+            b = (b + 1) & (buckets - 1);
+        }
+        put32(head + KEYRING_HEADER + 4 * (size_t) b, i + 1);
+    }
+
+    // Write everything to a temporary file next to the keyring, with a name of its own so that nothing else
+    // writes to it. mkstemp() creates it so only the owner can read it, since it may hold private keys.
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = (char *) calloc(tmp_len, sizeof(char));
+    snprintf(tmp, tmp_len, "%s.XXXXXX", path);
+    int fd = ok ? mkstemp(tmp) : -1;
+    FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (out) {
+        ok = fwrite(head, sizeof(uint8_t), table, out) == table;
+        for (uint32_t i = 0; ok && i < count; i += 1) {
+            for (int f = 0; ok && f < KEYRING_FIELDS; f += 1) {
+                ok = fwrite(entries[i].data[f], sizeof(uint8_t), entries[i].len[f], out)
+                     == entries[i].len[f];
+            }
+        }
+        ok = (fclose(out) == 0) && ok;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    } else {
+        if (fd >= 0) {
+            close(fd);
+        }
+        ok = false;
+    }
+
+    // Freeing of allocated memory.
+    void (*free_fn)(void *, size_t) = NULL;
+    mp_get_memory_functions(NULL, NULL, &free_fn);
+    for (int f = 0; f < KEYRING_FIELDS; f += 1) {
+        if (fresh[f]) {
+            free_fn(fresh[f], ke->len[f]);
+        }
+    }
+    free(tmp);
+    free(head);
+    free(entries);
+    if (have_old) {
+        keyring_close(&kr);
+    }
+    close(lock_fd);
+    return ok;
+}
+
+// Looks up the public key called "name" in the keyring at "path".
+// "verified" is set if the signature was already checked when the key was added.
+// Returns false if the keyring can't be opened or has no such key.
+bool keyring_load_pub(const char *path, const char *name, mpz_t n, mpz_t e, mpz_t s,
+    bool *verified) {
+    keyring kr;
+    keyring_entry ke;
+
+    if (!keyring_open(&kr, path)) {
+        return false;
+    }
+    if (!keyring_find(&kr, name, &ke)) {
+        keyring_close(&kr);
+        return false;
+    }
+    keyring_get(&ke, KEYRING_N, n);
+    keyring_get(&ke, KEYRING_E, e);
+    keyring_get(&ke, KEYRING_S, s);
+    *verified = (ke.flags & KEYRING_VERIFIED) != 0;
+    keyring_close(&kr);
+    return true;
+}
+
+// Looks up the private key called "name" in the keyring at "path".
+// Returns false if the keyring can't be opened, has no such key, or only holds its public half.
+bool keyring_load_priv(const char *path, const char *name, mpz_t n, mpz_t d, mpz_t p, mpz_t q,
+    mpz_t dp, mpz_t dq, mpz_t qinv) {
+    keyring kr;
+    keyring_entry ke;
+
+    if (!keyring_open(&kr, path)) {
+        return false;
+    }
+    if (!keyring_find(&kr, name, &ke) || !(ke.flags & KEYRING_PRIVATE)) {
+        keyring_close(&kr);
+        return false;
+    }
+    keyring_get(&ke, KEYRING_N, n);
+    keyring_get(&ke, KEYRING_D, d);
+    keyring_get(&ke, KEYRING_P, p);
+    keyring_get(&ke, KEYRING_Q, q);
+    keyring_get(&ke, KEYRING_DP, dp);
+    keyring_get(&ke, KEYRING_DQ, dq);
+    keyring_get(&ke, KEYRING_QINV, qinv);
+    keyring_close(&kr);
+    return true;
+}
@@ -0,0 +1,266 @@
+#include "lz.h"
+
+#include <string.h>
+
+// Shortest match worth a sequence of its own.
+#define LZ_MIN_MATCH 4
+
+// Reads 4 bytes as a 32 bit value, in host order.
+static uint32_t load32(const uint8_t *b) {
+    uint32_t v = 0;
+    memcpy(&v, b, sizeof(v));
+    return v;
+}
+
+// Returns the hash table slot of a 4 byte sequence.
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that doesn't fit in a token nibble: a byte of 255 for as long as it lasts,
+// then the rest. Returns the number of bytes written.
+static size_t put_length(uint8_t *out, size_t len) {
+    size_t op = 0;
+    while (len >= 255) {
+        out[op] = 255;
+        op += 1;
+        len -= 255;
+    }
+    out[op] = (uint8_t) len;
+    return op + 1;
+}
+
+// Reads the rest of a length started in a token nibble, adding it to "n".
+// Returns false if the input runs out first.
+static bool get_length(const uint8_t *in, size_t len, size_t *ip, size_t *n) {
+    uint8_t b = 0;
+    do {
+        if (*ip == len) {
+            return false;
+        }
+        b = in[*ip];
+        *ip += 1;
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// Writes a sequence at out + *op: a token holding the literal count and match length (15 in either nibble
+// meaning more follows), the rest of the literal count, the "lits" literals, and then, unless "mlen" is 0,
+// the match offset (2 bytes, big-endian) and the rest of the match length.
+// Returns false if the sequence might not fit in "cap" bytes.
+static bool put_sequence(uint8_t *out, size_t cap, size_t *op, const uint8_t *lit, size_t lits,
+    size_t offset, size_t mlen) {
+    size_t m = mlen > 0 ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *p = out + *op;
+
+    if (1 + lits / 255 + 1 + lits + 2 + m / 255 + 1 > cap - *op) {
+        return false;
+    }
+    *p = (uint8_t) (((lits < 15 ? lits : 15) << 4) | (m < 15 ? m : 15));
+    p += 1;
+    if (lits >= 15) {
+        p += put_length(p, lits - 15);
+    }
+    memcpy(p, lit, lits);
+    p += lits;
+    if (mlen > 0) {
+        p[0] = (uint8_t) (offset >> 8);
+        p[1] = (uint8_t) offset;
+        p += 2;
+        if (m >= 15) {
+            p += put_length(p, m - 15);
+        }
+    }
+    *op = p - out;
+    return true;
+}
+
+// Compresses the "len" bytes at "in" (at most LZ_CHUNK) into "out", using "table" (1 << LZ_HASH_BITS entries)
+// to find earlier occurrences of each 4 byte sequence. The output is a run of sequences, each some literal
+// bytes and a match copying bytes from further back; the last one has no match.
+// Returns the compressed length, or 0 if it doesn't fit in "cap" bytes.
+size_t lz_compress(uint32_t table[], const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t seq = load32(in + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = (uint32_t) (ip + 1);
+
+        // No match: move on, faster the longer it has been since the last one, so data that doesn't compress
+        // goes through quickly.
+        if (ref == 0 || load32(in + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        ref -= 1;
+
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && in[ref + mlen] == in[ip + mlen]) {
+            mlen += 1;
+        }
+        if (!put_sequence(out, cap, &op, in + anchor, ip - anchor, ip - ref, mlen)) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    // The rest goes out as literals.
+    if (!put_sequence(out, cap, &op, in + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+// Decompresses the "len" bytes at "in", as written by lz_compress(), into "out" of "cap" bytes,
+// and stores the decompressed length in "out_len".
+// Returns false if the input isn't valid or doesn't fit, without reading or writing out of bounds.
+bool lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip];
+        size_t lits = token >> 4;
+        size_t mlen = token & 15;
+        ip += 1;
+
+        if (lits == 15 && !get_length(in, len, &ip, &lits)) {
+            return false;
+        }
+        if (lits > len - ip || lits > cap - op) {
+            return false;
+        }
+        memcpy(out + op, in + ip, lits);
+        ip += lits;
+        op += lits;
+
+        // The last sequence has no match.
+        if (ip == len) {
+            break;
+        }
+        if (len - ip < 2) {
+            return false;
+        }
+        size_t offset = ((size_t) in[ip] << 8) | in[ip + 1];
+        ip += 2;
+        if (mlen == 15 && !get_length(in, len, &ip, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > cap - op) {
+            return false;
+        }
+
+        // A match can overlap the bytes it copies, repeating them, so those go a byte at a time.
+        if (offset >= mlen) {
+            memcpy(out + op, out + op - offset, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; i += 1) {
+                out[op + i] = out[op + i - offset];
+            }
+        }
+        op += mlen;
+    }
+    *out_len = op;
+    return true;
+}
+
+// Initializes a compressed stream, with no frame in hand.
+void lz_init(lz_stream *lz) {
+    lz->frame_len = 0;
+    lz->frame_pos = 0;
+    lz->chunk_len = 0;
+    lz->damaged = false;
+    return;
+}
+
+// Compresses the "len" bytes at "in" (1 to LZ_CHUNK) into the stream's frame, for the caller to hand out
+// from lz->frame_pos up to lz->frame_len. A chunk that wouldn't come out shorter is stored as is.
+void lz_pack(lz_stream *lz, const uint8_t *in, size_t len) {
+    uint8_t *body = lz->frame + LZ_FRAME_HEADER;
+    size_t n = len > 1 ? lz_compress(lz->table, in, len, body, len - 1) : 0;
+    uint32_t head = (uint32_t) n;
+
+    if (n == 0) {
+        memcpy(body, in, len);
+        n = len;
+        head = (uint32_t) len | LZ_STORED;
+    }
+    for (int i = 0; i < LZ_FRAME_HEADER; i += 1) {
+        lz->frame[i] = (uint8_t) (head >> (24 - 8 * i));
+    }
+    lz->frame_len = LZ_FRAME_HEADER + n;
+    lz->frame_pos = 0;
+    return;
+}
+
+// Takes up to "len" bytes of a compressed stream towards the frame being gathered, and returns how many it took.
+// It stops at the end of a frame, which it decompresses into lz->chunk; the caller writes out the
+// lz->chunk_len bytes there and sets chunk_len back to 0 before the next call.
+// Once a frame turns out not to be valid, the stream is marked damaged and the rest of its input is dropped.
+size_t lz_unpack(lz_stream *lz, const uint8_t *in, size_t len) {
+    size_t used = 0;
+    size_t take = 0;
+    uint32_t head = 0;
+
+    if (lz->damaged) {
+        return len;
+    }
+
+    // The header gives the length of the frame.
+    if (lz->frame_pos < LZ_FRAME_HEADER) {
+        take = LZ_FRAME_HEADER - lz->frame_pos < len ? LZ_FRAME_HEADER - lz->frame_pos : len;
+        memcpy(lz->frame + lz->frame_pos, in, take);
+        lz->frame_pos += take;
+        used = take;
+        if (lz->frame_pos < LZ_FRAME_HEADER) {
+            return used;
+        }
+        for (int i = 0; i < LZ_FRAME_HEADER; i += 1) {
+            head = (head << 8) | lz->frame[i];
+        }
+        if ((head & ~LZ_STORED) == 0 || (head & ~LZ_STORED) > LZ_CHUNK) {
+            lz->damaged = true;
+            return len;
+        }
+        lz->frame_len = LZ_FRAME_HEADER + (head & ~LZ_STORED);
+    }
+
+    take = lz->frame_len - lz->frame_pos < len - used ? lz->frame_len - lz->frame_pos : len - used;
+    memcpy(lz->frame + lz->frame_pos, in + used, take);
+    lz->frame_pos += take;
+    used += take;
+    if (lz->frame_pos < lz->frame_len) {
+        return used;
+    }
+
+    // The frame is whole.
+    head = 0;
+    for (int i = 0; i < LZ_FRAME_HEADER; i += 1) {
+        head = (head << 8) | lz->frame[i];
+    }
+    if (head & LZ_STORED) {
+        lz->chunk_len = lz->frame_len - LZ_FRAME_HEADER;
+        memcpy(lz->chunk, lz->frame + LZ_FRAME_HEADER, lz->chunk_len);
+    } else if (!lz_decompress(lz->frame + LZ_FRAME_HEADER, lz->frame_len - LZ_FRAME_HEADER, lz->chunk,
+                   LZ_CHUNK, &lz->chunk_len)) {
+        lz->damaged = true;
+        lz->chunk_len = 0;
+        return len;
+    }
+    lz->frame_pos = 0;
+    lz->frame_len = 0;
+    return used;
+}
+
+// Returns true if a decompressed stream ended cleanly: every frame was valid, and none was cut short.
+bool lz_finish(lz_stream *lz) {
+    return !lz->damaged && lz->frame_pos == 0;
+}
@@ -0,0 +1,519 @@
+#include "montgomery.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+static mont_fixed_fn fixed_kernel(mp_size_t limbs);
+
+// Computes the Montgomery constants for the odd modulus "n".
+void mont_init(mont_ctx *ctx, mpz_t n) {
+    mpz_inits(ctx->n, ctx->r2, ctx->one, NULL);
+    mpz_set(ctx->n, n);
+    ctx->limbs = mpz_size(n);
+
+    // Newton's iteration for n^-1 mod 2^GMP_NUMB_BITS.
+    // Any odd n0 is its own inverse mod 8, and each step doubles the number of correct bits.
+    mp_limb_t n0 = mpz_getlimbn(n, 0);
+    mp_limb_t inv = n0;
+    for (int i = 0; i < 6; i += 1) {
+        inv *= 2 - n0 * inv;
+    }
+    ctx->ninv = -inv;
+
+    // one = R mod n
+    mpz_set_ui(ctx->one, 0);
+    mpz_setbit(ctx->one, GMP_NUMB_BITS * ctx->limbs);
+    mpz_mod(ctx->one, ctx->one, n);
+
+    // r2 = R^2 mod n
+    mpz_mul(ctx->r2, ctx->one, ctx->one);
+    mpz_mod(ctx->r2, ctx->r2, n);
+
+    // Pick the fixed-size kernel for this modulus once, and give it a padded copy of r2.
+    ctx->fixed = fixed_kernel(ctx->limbs);
+    ctx->r2p = NULL;
+    if (ctx->fixed != NULL) {
+        ctx->r2p = (mp_limb_t *) calloc(ctx->limbs, sizeof(mp_limb_t));
+        mpz_export(ctx->r2p, NULL, -1, sizeof(mp_limb_t), 0, GMP_NAIL_BITS, ctx->r2);
+    }
+    return;
+}
+
+// Frees the memory held by a Montgomery context.
+void mont_clear(mont_ctx *ctx) {
+    mpz_clears(ctx->n, ctx->r2, ctx->one, NULL);
+    free(ctx->r2p);
+    return;
+}
+
+// Initializes Montgomery working storage.
+void mont_scratch_init(mont_scratch *sc) {
+    mpz_inits(sc->t, sc->acc, NULL);
+    for (int i = 0; i < (1 << (MONT_MAX_WINDOW - 1)); i += 1) {
+        mpz_init(sc->table[i]);
+    }
+    return;
+}
+
+// Grows Montgomery working storage up front for moduli of up to "bits" bits,
+// so that operations on such moduli don't have to allocate as they go.
+void mont_scratch_reserve(mont_scratch *sc, uint64_t bits) {
+    mpz_realloc2(sc->t, 2 * bits + 2 * GMP_NUMB_BITS);
+    mpz_realloc2(sc->acc, bits + GMP_NUMB_BITS);
+    for (int i = 0; i < (1 << (MONT_MAX_WINDOW - 1)); i += 1) {
+        mpz_realloc2(sc->table[i], bits + GMP_NUMB_BITS);
+    }
+    return;
+}
+
+// Frees Montgomery working storage.
+void mont_scratch_clear(mont_scratch *sc) {
+    mpz_clears(sc->t, sc->acc, NULL);
+    for (int i = 0; i < (1 << (MONT_MAX_WINDOW - 1)); i += 1) {
+        mpz_clear(sc->table[i]);
+    }
+    return;
+}
+
+// Picks the sliding window width for an exponent that is "ebits" bits long.
+// Wider windows cost more table entries up front but save multiplications per bit.
+uint64_t mont_window_bits(uint64_t ebits) {
+    if (ebits <= 7) {
+        return 1;
+    }
+    if (ebits <= 36) {
+        return 3;
+    }
+    if (ebits <= 140) {
+        return 4;
+    }
+    if (ebits <= 450) {
+        return 5;
+    }
+    if (ebits <= 1303) {
+        return 6;
+    }
+    return MONT_MAX_WINDOW;
+}
+
+// Montgomery reduction: computes t x R^-1 mod n and stores it in "o".
+// "t" must be less than n x R, and its contents are destroyed.
+static void mont_redc(mont_ctx *ctx, mpz_t o, mpz_t t) {
+    mp_size_t limbs = ctx->limbs;
+    mp_size_t size = mpz_size(t);
+    const mp_limb_t *np = mpz_limbs_read(ctx->n);
+    mp_limb_t *tp = mpz_limbs_modify(t, 2 * limbs);
+    mp_limb_t *op = NULL;
+    mp_limb_t cy = 0;
+
+    // Zero-extend t to exactly 2 x limbs.
+    for (mp_size_t i = size; i < 2 * limbs; i += 1) {
+        tp[i] = 0;
+    }
+
+    // Clear one low limb per step by adding a multiple of n.
+    // The carry out of each step belongs limbs positions higher; it is parked in the limb that was just cleared.
+    for (mp_size_t i = 0; i < limbs; i += 1) {
+        mp_limb_t q = tp[i] * ctx->ninv;
+        tp[i] = mpn_addmul_1(tp + i, np, limbs, q);
+    }
+
+    // Add the parked carries to the high half, then bring the result below n.
+    op = mpz_limbs_write(o, limbs);
+    cy = mpn_add_n(op, tp + limbs, tp, limbs);
+    if (cy != 0 || mpn_cmp(op, np, limbs) >= 0) {
+        mpn_sub_n(op, op, np, limbs);
+    }
+    mpz_limbs_finish(o, limbs);
+    mpz_limbs_finish(t, 0);
+    return;
+}
+
+// Converts "a" into Montgomery form (a x R mod n) and stores it in "o".
+void mont_to(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a) {
+    // Inputs outside of [0, n) have to be reduced first.
+    if (mpz_sgn(a) < 0 || mpz_cmp(a, ctx->n) >= 0) {
+        mpz_mod(sc->t, a, ctx->n);
+        mpz_mul(sc->t, sc->t, ctx->r2);
+    } else {
+        mpz_mul(sc->t, a, ctx->r2);
+    }
+    mont_redc(ctx, o, sc->t);
+    return;
+}
+
+// Converts "a" out of Montgomery form and stores it in "o".
+void mont_from(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a) {
+    mpz_set(sc->t, a);
+    mont_redc(ctx, o, sc->t);
+    return;
+}
+
+// Multiplies "a" and "b", both in Montgomery form, and stores the product in "o".
+void mont_mul(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t b) {
+    mpz_mul(sc->t, a, b);
+    mont_redc(ctx, o, sc->t);
+    return;
+}
+
+// Squares "a", which is in Montgomery form, and stores the result in "o".
+void mont_sqr(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a) {
+    mpz_mul(sc->t, a, a);
+    mont_redc(ctx, o, sc->t);
+    return;
+}
+
+// Raises "a" to the power of "d", with "a" and the result "o" both in Montgomery form.
+// The exponent is scanned left to right in sliding windows of odd values.
+void mont_exp(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t d) {
+    uint64_t ebits = 0;
+    uint64_t w = 0;
+    uint64_t entries = 0;
+    bool started = false;
+
+    // Anything to the power of 0 is 1.
+    if (mpz_sgn(d) <= 0) {
+        mpz_set(o, ctx->one);
+        return;
+    }
+
+    ebits = mpz_sizeinbase(d, 2);
+    w = mont_window_bits(ebits);
+    entries = (uint64_t) 1 << (w - 1);
+
+    // table[i] = a^(2i + 1)
+    mpz_set(sc->table[0], a);
+    if (entries > 1) {
+        mont_sqr(ctx, sc, sc->acc, a);
+        for (uint64_t i = 1; i < entries; i += 1) {
+            mont_mul(ctx, sc, sc->table[i], sc->table[i - 1], sc->acc);
+        }
+    }
+
+    // Walk the exponent from its top bit down.
+    int64_t i = (int64_t) ebits - 1;
+    while (i >= 0) {
+        // A zero bit only needs a squaring.
+        if (mpz_tstbit(d, i) == 0) {
+            mont_sqr(ctx, sc, sc->acc, sc->acc);
+            i -= 1;
+            continue;
+        }
+
+        // Find the longest window of at most w bits starting at bit i that ends in a one.
+        int64_t low = i - (int64_t) w + 1;
+        if (low < 0) {
+            low = 0;
+        }
+        while (mpz_tstbit(d, low) == 0) {
+            low += 1;
+        }
+
+        // Collect the window's value.
+        uint64_t value = 0;
+        for (int64_t j = i; j >= low; j -= 1) {
+            value = (value << 1) | mpz_tstbit(d, j);
+        }
+
+        // acc = acc^(2^width) x a^value
+        if (started) {
+            for (int64_t j = i; j >= low; j -= 1) {
+                mont_sqr(ctx, sc, sc->acc, sc->acc);
+            }
+            mont_mul(ctx, sc, sc->acc, sc->acc, sc->table[value >> 1]);
+        } else {
+            mpz_set(sc->acc, sc->table[value >> 1]);
+            started = true;
+        }
+        i = low - 1;
+    }
+
+    mpz_set(o, sc->acc);
+    return;
+}
+
+// Fixed-size kernel.
+// The routines below work on plain limb arrays exactly as long as the modulus, instead of mpz_t values,
+// so nothing is normalized or reallocated between steps. They are always inlined into one exponentiation
+// function per supported size, where the limb count is a constant and the working storage is on the stack.
+
+// Montgomery reduction of the 2 x limbs product "tp" into "op", which ends up below n. "tp" is destroyed.
+static inline __attribute__((always_inline)) void fixed_redc(
+    mp_limb_t *op, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, mp_size_t limbs) {
+    // Same steps as mont_redc(): clear one low limb at a time, parking each carry in the cleared limb.
+    for (mp_size_t i = 0; i < limbs; i += 1) {
+        tp[i] = mpn_addmul_1(tp + i, np, limbs, tp[i] * ninv);
+    }
+    if (mpn_add_n(op, tp + limbs, tp, limbs) != 0 || mpn_cmp(op, np, limbs) >= 0) {
+        mpn_sub_n(op, op, np, limbs);
+    }
+    return;
+}
+
+// op = a x b x R^-1 mod n. "op" may be the same array as "ap" or "bp".
+static inline __attribute__((always_inline)) void fixed_mul(mp_limb_t *op, const mp_limb_t *ap,
+    const mp_limb_t *bp, mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, mp_size_t limbs) {
+    mpn_mul_n(tp, ap, bp, limbs);
+    fixed_redc(op, tp, np, ninv, limbs);
+    return;
+}
+
+// op = a^2 x R^-1 mod n. "op" may be the same array as "ap".
+static inline __attribute__((always_inline)) void fixed_sqr(mp_limb_t *op, const mp_limb_t *ap,
+    mp_limb_t *tp, const mp_limb_t *np, mp_limb_t ninv, mp_size_t limbs) {
+    mpn_sqr(tp, ap, limbs);
+    fixed_redc(op, tp, np, ninv, limbs);
+    return;
+}
+
+// Computes op = a^e mod n for an "a" below n, where e is the recoding "r", or "d" if "r" is NULL.
+// "table" has room for 2^(MONT_MAX_WINDOW - 1) values, "acc" for one, and "tp" for a double-width product.
+static inline __attribute__((always_inline)) void fixed_pow(const mp_limb_t *np, const mp_limb_t *r2,
+    mp_limb_t ninv, mp_limb_t *op, const mp_limb_t *ap, const mont_recoding *r, mpz_srcptr d,
+    mp_size_t limbs, mp_limb_t *table, mp_limb_t *acc, mp_limb_t *tp) {
+    uint64_t ebits = r != NULL ? 0 : mpz_sizeinbase(d, 2);
+    uint64_t w = r != NULL ? r->w : mont_window_bits(ebits);
+    uint64_t entries = (uint64_t) 1 << (w - 1);
+
+    // table[i] = a^(2i + 1), in Montgomery form.
+    fixed_mul(table, ap, r2, tp, np, ninv, limbs);
+    if (entries > 1) {
+        fixed_sqr(acc, table, tp, np, ninv, limbs);
+        for (uint64_t i = 1; i < entries; i += 1) {
+            fixed_mul(table + i * limbs, table + (i - 1) * limbs, acc, tp, np, ninv, limbs);
+        }
+    }
+
+    if (r != NULL) {
+        // Replay the recoded windows, as in mont_exp_recoded().
+        mpn_copyi(acc, table + (r->value[0] >> 1) * limbs, limbs);
+        for (uint64_t i = 1; i < r->count; i += 1) {
+            for (uint32_t j = 0; j < r->shift[i]; j += 1) {
+                fixed_sqr(acc, acc, tp, np, ninv, limbs);
+            }
+            if (r->value[i] != 0) {
+                fixed_mul(acc, acc, table + (r->value[i] >> 1) * limbs, tp, np, ninv, limbs);
+            }
+        }
+    } else {
+        // Find the windows as it goes, as in mont_exp().
+        bool started = false;
+        int64_t i = (int64_t) ebits - 1;
+        while (i >= 0) {
+            if (mpz_tstbit(d, i) == 0) {
+                fixed_sqr(acc, acc, tp, np, ninv, limbs);
+                i -= 1;
+                continue;
+            }
+            int64_t low = i - (int64_t) w + 1;
+            if (low < 0) {
+                low = 0;
+            }
+            while (mpz_tstbit(d, low) == 0) {
+                low += 1;
+            }
+            uint64_t value = 0;
+            for (int64_t j = i; j >= low; j -= 1) {
+                value = (value << 1) | mpz_tstbit(d, j);
+            }
+            if (started) {
+                for (int64_t j = i; j >= low; j -= 1) {
+                    fixed_sqr(acc, acc, tp, np, ninv, limbs);
+                }
+                fixed_mul(acc, acc, table + (value >> 1) * limbs, tp, np, ninv, limbs);
+            } else {
+                mpn_copyi(acc, table + (value >> 1) * limbs, limbs);
+                started = true;
+            }
+            i = low - 1;
+        }
+    }
+
+    // Leave Montgomery form by reducing acc on its own.
+    mpn_copyi(tp, acc, limbs);
+    mpn_zero(tp + limbs, limbs);
+    fixed_redc(op, tp, np, ninv, limbs);
+    return;
+}
+
+// Defines the kernel for one limb count.
+#define MONT_FIXED_KERNEL(L)                                                                           \
+    static void fixed_pow_##L(const mp_limb_t *np, const mp_limb_t *r2, mp_limb_t ninv, mp_limb_t *op, \
+        const mp_limb_t *ap, const mont_recoding *r, mpz_srcptr d) {                                   \
+        mp_limb_t table[(1 << (MONT_MAX_WINDOW - 1)) * (L)];                                           \
+        mp_limb_t acc[L];                                                                              \
+        mp_limb_t tp[2 * (L)];                                                                         \
+        fixed_pow(np, r2, ninv, op, ap, r, d, (L), table, acc, tp);                                    \
+        return;                                                                                        \
+    }
+
+// With 64-bit limbs: the halves of 1024, 2048, and 3072-bit keys used by CRT decryption,
+// and the full 1024, 2048, 3072, and 4096-bit moduli used by encryption and verification.
+MONT_FIXED_KERNEL(8)
+MONT_FIXED_KERNEL(16)
+MONT_FIXED_KERNEL(24)
+MONT_FIXED_KERNEL(32)
+MONT_FIXED_KERNEL(48)
+MONT_FIXED_KERNEL(64)
+
+// Returns the fixed-size kernel for a modulus of "limbs" limbs, or NULL if there isn't one.
+static mont_fixed_fn fixed_kernel(mp_size_t limbs) {
+    switch (limbs) {
+    case 8: return fixed_pow_8;
+    case 16: return fixed_pow_16;
+    case 24: return fixed_pow_24;
+    case 32: return fixed_pow_32;
+    case 48: return fixed_pow_48;
+    case 64: return fixed_pow_64;
+    }
+    return NULL;
+}
+
+// Runs the context's fixed-size kernel: o = a^e mod n, with e the recoding "r", or "d" if "r" is NULL.
+// "a" is reduced first if it isn't already below n; sc->t is only used for that.
+static void fixed_run(
+    mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, const mont_recoding *r, mpz_srcptr d) {
+    mp_limb_t ap[MONT_FIXED_MAX_LIMBS];
+    mp_limb_t out[MONT_FIXED_MAX_LIMBS];
+    mp_size_t limbs = ctx->limbs;
+    mpz_srcptr base = a;
+
+    if (mpz_sgn(a) < 0 || mpz_cmp(a, ctx->n) >= 0) {
+        mpz_mod(sc->t, a, ctx->n);
+        base = sc->t;
+    }
+    mp_size_t size = mpz_size(base);
+    mpn_copyi(ap, mpz_limbs_read(base), size);
+    mpn_zero(ap + size, limbs - size);
+
+    ctx->fixed(mpz_limbs_read(ctx->n), ctx->r2p, ctx->ninv, out, ap, r, d);
+
+    mpn_copyi(mpz_limbs_write(o, limbs), out, limbs);
+    mpz_limbs_finish(o, limbs);
+    return;
+}
+
+// Computes "a" raised to the power of "d" mod n, and stores that value in "o".
+// Both "a" and "o" are ordinary (non-Montgomery) values.
+void mont_pow(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t d) {
+    // Moduli with a fixed-size kernel skip the mpz routines entirely.
+    if (ctx->fixed != NULL && mpz_sgn(d) > 0) {
+        fixed_run(ctx, sc, o, a, NULL, d);
+        return;
+    }
+
+    // The base goes straight into the first table slot so that "o" may alias "d".
+    mont_to(ctx, sc, sc->table[0], a);
+    mont_exp(ctx, sc, o, sc->table[0], d);
+    mont_from(ctx, sc, o, o);
+    return;
+}
+
+// Recodes the exponent "d" into the sliding windows mont_exp() would use, for use with mont_exp_recoded().
+void mont_recode(mont_recoding *r, mpz_t d) {
+    uint64_t ebits = mpz_sgn(d) > 0 ? mpz_sizeinbase(d, 2) : 0;
+    uint64_t pending = 0;
+
+    r->w = mont_window_bits(ebits);
+    r->count = 0;
+
+    // There are never more windows than bits, plus one for trailing squarings.
+    r->value = (uint32_t *) calloc(ebits + 1, sizeof(uint32_t));
+    r->shift = (uint32_t *) calloc(ebits + 1, sizeof(uint32_t));
+
+    int64_t i = (int64_t) ebits - 1;
+    while (i >= 0) {
+        // Zero bits turn into squarings in front of the next window.
+        if (mpz_tstbit(d, i) == 0) {
+            pending += 1;
+            i -= 1;
+            continue;
+        }
+
+        // Find the longest window of at most w bits starting at bit i that ends in a one.
+        int64_t low = i - (int64_t) r->w + 1;
+        if (low < 0) {
+            low = 0;
+        }
+        while (mpz_tstbit(d, low) == 0) {
+            low += 1;
+        }
+
+        uint32_t value = 0;
+        for (int64_t j = i; j >= low; j -= 1) {
+            value = (value << 1) | mpz_tstbit(d, j);
+        }
+
+        r->value[r->count] = value;
+        r->shift[r->count] = (uint32_t) (pending + (uint64_t) (i - low + 1));
+        r->count += 1;
+        pending = 0;
+        i = low - 1;
+    }
+
+    // Squarings for any zero bits at the bottom of the exponent.
+    if (pending > 0) {
+        r->value[r->count] = 0;
+        r->shift[r->count] = (uint32_t) pending;
+        r->count += 1;
+    }
+    return;
+}
+
+// Frees the memory held by a recoded exponent.
+void mont_recoding_clear(mont_recoding *r) {
+    free(r->value);
+    free(r->shift);
+    r->value = NULL;
+    r->shift = NULL;
+    r->count = 0;
+    return;
+}
+
+// Raises "a" to the power of a recoded exponent, with "a" and the result "o" both in Montgomery form.
+void mont_exp_recoded(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mont_recoding *r) {
+    uint64_t entries = (uint64_t) 1 << (r->w - 1);
+
+    // An exponent of 0 has no windows.
+    if (r->count == 0) {
+        mpz_set(o, ctx->one);
+        return;
+    }
+
+    // table[i] = a^(2i + 1)
+    mpz_set(sc->table[0], a);
+    if (entries > 1) {
+        mont_sqr(ctx, sc, sc->acc, a);
+        for (uint64_t i = 1; i < entries; i += 1) {
+            mont_mul(ctx, sc, sc->table[i], sc->table[i - 1], sc->acc);
+        }
+    }
+
+    // The first window seeds the accumulator; its shift is never needed.
+    mpz_set(sc->acc, sc->table[r->value[0] >> 1]);
+    for (uint64_t i = 1; i < r->count; i += 1) {
+        for (uint32_t j = 0; j < r->shift[i]; j += 1) {
+            mont_sqr(ctx, sc, sc->acc, sc->acc);
+        }
+        if (r->value[i] != 0) {
+            mont_mul(ctx, sc, sc->acc, sc->acc, sc->table[r->value[i] >> 1]);
+        }
+    }
+
+    mpz_set(o, sc->acc);
+    return;
+}
+
+// Computes "a" raised to the power of a recoded exponent mod n, and stores that value in "o".
+// Both "a" and "o" are ordinary (non-Montgomery) values.
+void mont_pow_recoded(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mont_recoding *r) {
+    if (ctx->fixed != NULL && r->count > 0) {
+        fixed_run(ctx, sc, o, a, r, NULL);
+        return;
+    }
+
+    mont_to(ctx, sc, sc->table[0], a);
+    mont_exp_recoded(ctx, sc, o, sc->table[0], r);
+    mont_from(ctx, sc, o, o);
+    return;
+}
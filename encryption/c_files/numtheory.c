@@ -1,5 +1,35 @@
 #include "numtheory.h"
 #include "randstate.h"
+#include "montgomery.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Running totals behind numtheory_stats_get(), shared by every thread.
+static struct {
+    _Atomic uint64_t candidates;
+    _Atomic uint64_t size_rejects;
+    _Atomic uint64_t sieve_rejects;
+    _Atomic uint64_t mr_rejects;
+    _Atomic uint64_t mr_rounds;
+    _Atomic uint64_t lucas_tests;
+    _Atomic uint64_t pow_mod_calls;
+} counts;
+
+// Copies the counters kept by the prime search and the modular exponentiation routines into "st".
+// The counts cover every thread since the program started.
+void numtheory_stats_get(numtheory_stats *st) {
+    st->candidates = atomic_load(&counts.candidates);
+    st->size_rejects = atomic_load(&counts.size_rejects);
+    st->sieve_rejects = atomic_load(&counts.sieve_rejects);
+    st->mr_rejects = atomic_load(&counts.mr_rejects);
+    st->mr_rounds = atomic_load(&counts.mr_rounds);
+    st->lucas_tests = atomic_load(&counts.lucas_tests);
+    st->pow_mod_calls = atomic_load(&counts.pow_mod_calls);
+    return;
+}
 
 // Computes the greatest common divisor of two numbers "a" and "b", then stores that value in "g".
 void gcd(mpz_t g, mpz_t a, mpz_t b) {
@@ -98,26 +128,27 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
     return;
 }
 
-// Performs fast modular exponentiation by computing "a" rasied to the power of "d" mod "n", then stores that vlaue in "o".
-void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
-    // Declares variables "a_temp", "d_temp", and "n_temp" that will hold the values of "mpz_t a", "mpz_t d", "mpz_t n" respectively.
-    // Also declares vairables "v" and "p" that will be intermediary variables between computations.
-    mpz_t a_temp, d_temp, n_temp, v, p;
+// Exponents shorter than this many bits don't repay the Montgomery setup cost.
+#define POW_MOD_MONT_MIN_BITS 32
+
+// Performs modular exponentiation one exponent bit at a time.
+// Used for even moduli, which Montgomery reduction can't handle, and for very short exponents.
+static void pow_mod_binary(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    // Declares vairables "v" and "p" that will be intermediary variables between computations.
+    mpz_t v, p;
+    uint64_t bits = mpz_sgn(d) > 0 ? mpz_sizeinbase(d, 2) : 0;
 
     // Initializes variables that were declared above.
-    mpz_inits(a_temp, d_temp, n_temp, v, p, NULL);
+    mpz_inits(v, p, NULL);
 
     // Setting values.
-    mpz_set(a_temp, a);
-    mpz_set(d_temp, d);
-    mpz_set(n_temp, n);
     mpz_set_ui(v, 1);
-    mpz_set(p, a_temp);
+    mpz_mod(p, a, n);
 
-    // While d > 0...
-    while (mpz_cmp_ui(d_temp, 0) > 0) {
-        // If d is odd...
-        if (mpz_odd_p(d_temp) != 0) {
+    // For each bit of d, from the lowest up...
+    for (uint64_t i = 0; i < bits; i += 1) {
+        // If the bit is set...
+        if (mpz_tstbit(d, i) != 0) {
             // v = (v x p) mod n
             mpz_mul(v, v, p);
             mpz_mod(v, v, n);
@@ -126,118 +157,577 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
         // p = (p x p) mod n
         mpz_mul(p, p, p);
         mpz_mod(p, p, n);
-
-        // d = floor(d / 2)
-        mpz_fdiv_q_ui(d_temp, d_temp, 2);
     }
     // Sets "o" to the exponentiation.
+    mpz_mod(o, v, n);
+
+    // Freeing of allocated memory.
+    mpz_clears(v, p, NULL);
+    return;
+}
+
+// Performs fast modular exponentiation by computing "a" rasied to the power of "d" mod "n", then stores that vlaue in "o".
+// Odd moduli go through the sliding-window Montgomery engine.
+void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    mont_ctx ctx;
+    mont_scratch sc;
+
+    atomic_fetch_add_explicit(&counts.pow_mod_calls, 1, memory_order_relaxed);
+    if (mpz_even_p(n) != 0 || mpz_sgn(d) <= 0 || mpz_sizeinbase(d, 2) < POW_MOD_MONT_MIN_BITS) {
+        pow_mod_binary(o, a, d, n);
+        return;
+    }
+
+    mont_init(&ctx, n);
+    mont_scratch_init(&sc);
+    mont_pow(&ctx, &sc, o, a, d);
+
+    // Freeing of allocated memory.
+    mont_scratch_clear(&sc);
+    mont_clear(&ctx);
+    return;
+}
+
+// Computes "a" raised to the power of the word-sized exponent "d" mod "n", and stores that value in "o".
+// Short public exponents such as 65537 are scanned left to right straight from the machine word,
+// which needs no Montgomery setup and only one extra multiplication per set bit.
+void pow_mod_ui(mpz_t o, mpz_t a, uint64_t d, mpz_t n) {
+    mpz_t base, v;
+
+    atomic_fetch_add_explicit(&counts.pow_mod_calls, 1, memory_order_relaxed);
+
+    // Anything to the power of 0 is 1.
+    if (d == 0) {
+        mpz_set_ui(o, 1);
+        mpz_mod(o, o, n);
+        return;
+    }
+
+    mpz_inits(base, v, NULL);
+    mpz_mod(base, a, n);
+    mpz_set(v, base);
+
+    // The top bit of d is accounted for by starting at v = a.
+    for (int i = 62 - __builtin_clzll(d); i >= 0; i -= 1) {
+        // v = v^2 mod n
+        mpz_mul(v, v, v);
+        mpz_tdiv_r(v, v, n);
+
+        // If the bit is set, v = (v x a) mod n
+        if ((d >> i) & 1) {
+            mpz_mul(v, v, base);
+            mpz_tdiv_r(v, v, n);
+        }
+    }
     mpz_set(o, v);
 
     // Freeing of allocated memory.
-    mpz_clears(a_temp, d_temp, n_temp, v, p, NULL);
+    mpz_clears(base, v, NULL);
     return;
 }
 
+// Runs one Miller-Rabin round on the odd modulus of "ctx" with the base "a", which is overwritten.
+// "r" and "s" satisfy n - 1 = 2^s * r with r odd, and "n_min_one" is n - 1 in Montgomery form.
+// "x" is working storage. Returns true if n is a strong probable prime to base a.
+static bool strong_round(mont_ctx *ctx, mont_scratch *sc, mpz_t x, mpz_t a, mpz_t r, uint64_t s,
+    mpz_t n_min_one) {
+    atomic_fetch_add_explicit(&counts.mr_rounds, 1, memory_order_relaxed);
+
+    // x = a ^ r (mod n)
+    mont_to(ctx, sc, a, a);
+    mont_exp(ctx, sc, x, a, r);
+
+    // If x is equal to 1 or n - 1, this round passes.
+    if (mpz_cmp(x, ctx->one) == 0 || mpz_cmp(x, n_min_one) == 0) {
+        return true;
+    }
+
+    // Square up to s - 1 times looking for n - 1.
+    // Reaching 1 first, or never reaching n - 1, means n is composite.
+    for (uint64_t j = 1; j < s; j += 1) {
+        // x = x ^ 2 (mod n)
+        mont_sqr(ctx, sc, x, x);
+        if (mpz_cmp(x, n_min_one) == 0) {
+            return true;
+        }
+        if (mpz_cmp(x, ctx->one) == 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
 // Performs the Miller-Rabin Primality test.
 // Returns true if "n" is prime, otherwise returns false.
 bool is_prime(mpz_t n, uint64_t iters) {
-    // Declares variables "n_temp", "s", "r", "j", "rand_number", "range", "power_mod", "n_min_one", "s_min_one", and "param_of_two".
-    // The variable "n_temp" will hold the value of "n".
-    // Variables "s" and "r" will represent the variables in the equation, n - 1 = 2^s * r such that r is odd.
-    // The variable "j" will hold values during arithmetic.
+    return is_prime_r(n, iters, &state);
+}
+
+// Performs the Miller-Rabin Primality test, drawing the random bases from "rs" instead of the global state.
+// Returns true if "n" is prime, otherwise returns false.
+// Each round works in Montgomery form against a single context set up for "n".
+bool is_prime_r(mpz_t n, uint64_t iters, rand_state *rs) {
+    // Declares variables "r", "rand_number", "range", "power_mod", and "n_min_one".
+    // The variable "r" and the count "s" represent the variables in the equation, n - 1 = 2^s * r such that r is odd.
     // The variable "rand_number" will hold the value of a random number found in the range [2, n - 2].
     // The variable "range" will hold the range.
-    // The variable "power_mod" will hold the modular exponentiation during each iteration.
-    // The variables "n_min_one" and "s_min_one" wil hold the values of n - 1 and s - 1 without affecting their values.
-    // The variable "param_of_two" will hold the value of 2 and be used as a parameter when calling pow_mod().
-    mpz_t n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one, param_of_two;
+    // The variable "power_mod" will hold the modular exponentiation during each iteration, in Montgomery form.
+    // The variable "n_min_one" will hold the Montgomery form of n - 1.
+    mpz_t r, rand_number, range, power_mod, n_min_one;
+    uint64_t s = 0;
+    bool prime = true;
+    mont_ctx ctx;
+    mont_scratch sc;
+
+    // If n is 2 or 3, then it's prime.
+    if (mpz_cmp_ui(n, 2) == 0 || mpz_cmp_ui(n, 3) == 0) {
+        return true;
+    }
+
+    // If n is even or less than 2, then it will not be prime.
+    if (mpz_even_p(n) != 0 || mpz_cmp_ui(n, 1) <= 0) {
+        return false;
+    }
 
     // Initializes variables that were declared above.
-    mpz_inits(
-        n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one, param_of_two, NULL);
+    mpz_inits(r, rand_number, range, power_mod, n_min_one, NULL);
+    mont_init(&ctx, n);
+    mont_scratch_init(&sc);
+
+    // n - 1 = 2^s * r such that r is odd
+    mpz_sub_ui(r, n, 1);
+    s = mpz_scan1(r, 0);
+    mpz_fdiv_q_2exp(r, r, s);
 
-    // Sets the values.
-    mpz_set(n_temp, n);
-    mpz_sub_ui(r, n_temp, 1);
-    mpz_sub_ui(n_min_one, n_temp, 1);
-    mpz_set_ui(param_of_two, 2);
+    // In Montgomery form, n - 1 is n - (R mod n).
+    mpz_sub(n_min_one, n, ctx.one);
 
     // Sets range to n - 3 since mpz_urandomm() picks a random number from range [0 - (n - 1)].
     // When adding 2 to our generated number from range [0 - (n - 1)], we will get a number within the range [2, (n - 2)], which is what we want.
-    mpz_sub_ui(range, n_temp, 3);
+    mpz_sub_ui(range, n, 3);
 
-    // If n is 2 or 3, then it's prime.
-    if (mpz_cmp_ui(n_temp, 2) == 0 || mpz_cmp_ui(n_temp, 3) == 0) {
-        mpz_clears(n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one,
-            param_of_two, NULL);
-        return true;
+    // For i < iters...
+    for (uint64_t i = 1; i < iters && prime; i += 1) {
+        // Pick a random number rand_num in the set {2,...,(n - 2)}
+        rand_urandomm(rand_number, rs, range);
+        mpz_add_ui(rand_number, rand_number, 2);
+
+        prime = strong_round(&ctx, &sc, power_mod, rand_number, r, s, n_min_one);
+    }
+
+    // Freeing of allocated memory.
+    mont_scratch_clear(&sc);
+    mont_clear(&ctx);
+    mpz_clears(r, rand_number, range, power_mod, n_min_one, NULL);
+    return prime;
+}
+
+// Odd primes below 100, checked by division before Baillie-PSW so that its tests only see larger numbers.
+static const uint32_t bpsw_small_primes[] = { 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47,
+    53, 59, 61, 67, 71, 73, 79, 83, 89, 97 };
+
+// Sets "o" to x / 2 mod n, for an "x" in [0, n) and an odd n.
+static void half_mod(mpz_t o, mpz_t x, mpz_t n) {
+    if (mpz_odd_p(x)) {
+        mpz_add(o, x, n);
+        mpz_fdiv_q_2exp(o, o, 1);
+    } else {
+        mpz_fdiv_q_2exp(o, x, 1);
+    }
+    return;
+}
+
+// Runs the strong Lucas probable prime test on the odd modulus of "ctx", with Selfridge's parameters:
+// the first D in 5, -7, 9, -11, ... with Jacobi symbol (D / n) = -1, P = 1, and Q = (1 - D) / 4.
+// With n + 1 = 2^s * d for an odd d, n passes if U_d = 0, or V_(d * 2^r) = 0 for some 0 <= r < s.
+// The sequences are computed in Montgomery form, since every step is a sum of products mod n.
+// Returns true if n is a strong Lucas probable prime, and false if it's composite.
+static bool strong_lucas(mont_ctx *ctx, mont_scratch *sc) {
+    mpz_ptr n = ctx->n;
+    int64_t D = 5;
+    bool prime = false;
+
+    atomic_fetch_add_explicit(&counts.lucas_tests, 1, memory_order_relaxed);
+
+    // Find D. Perfect squares have no D with (D / n) = -1, so they are ruled out after a few tries.
+    for (uint64_t tries = 0;; tries += 1) {
+        int j = mpz_si_kronecker(D, n);
+        if (j == -1) {
+            break;
+        }
+        if (j == 0 && mpz_cmpabs_ui(n, (unsigned long) (D < 0 ? -D : D)) > 0) {
+            return false;
+        }
+        if (tries == 8 && mpz_perfect_square_p(n)) {
+            return false;
+        }
+        D = D > 0 ? -(D + 2) : -D + 2;
+    }
+
+    // Declares "d" for n + 1 = 2^s * d, the Lucas terms "u" and "v", "qk" for Q^k, "qm" for Q, and a temporary "t".
+    // Apart from "d", all of them are in Montgomery form.
+    mpz_t d, u, v, qk, qm, t;
+    uint64_t s = 0;
+    mpz_inits(d, u, v, qk, qm, t, NULL);
+
+    // n + 1 = 2^s * d such that d is odd
+    mpz_add_ui(d, n, 1);
+    s = mpz_scan1(d, 0);
+    mpz_fdiv_q_2exp(d, d, s);
+
+    // U_1 = 1, V_1 = P = 1, and Q^1 = Q.
+    mpz_set_si(qm, (1 - D) / 4);
+    mont_to(ctx, sc, qm, qm);
+    mpz_set(u, ctx->one);
+    mpz_set(v, ctx->one);
+    mpz_set(qk, qm);
+
+    // Walk the bits of d below the top one, doubling k for each, and adding one for each set bit.
+    for (int64_t i = (int64_t) mpz_sizeinbase(d, 2) - 2; i >= 0; i -= 1) {
+        // U_2k = U_k * V_k, V_2k = V_k^2 - 2 * Q^k, and Q^2k = (Q^k)^2.
+        mont_mul(ctx, sc, u, u, v);
+        mont_sqr(ctx, sc, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mont_sqr(ctx, sc, qk, qk);
+
+        if (mpz_tstbit(d, i) != 0) {
+            // U_k+1 = (P * U_k + V_k) / 2, V_k+1 = (D * U_k + P * V_k) / 2, and Q^k+1 = Q^k * Q.
+            mpz_mul_si(t, u, D);
+            mpz_add(t, t, v);
+            mpz_mod(t, t, n);
+            mpz_add(u, u, v);
+            if (mpz_cmp(u, n) >= 0) {
+                mpz_sub(u, u, n);
+            }
+            half_mod(u, u, n);
+            half_mod(v, t, n);
+            mont_mul(ctx, sc, qk, qk, qm);
+        }
+    }
+
+    // U_d = 0 or V_d = 0 pass right away, otherwise keep doubling and look for V_(d * 2^r) = 0.
+    prime = mpz_sgn(u) == 0 || mpz_sgn(v) == 0;
+    for (uint64_t r = 1; r < s && !prime; r += 1) {
+        mont_sqr(ctx, sc, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mont_sqr(ctx, sc, qk, qk);
+        prime = mpz_sgn(v) == 0;
     }
 
-    // If n is even or 1, then it will not be prime.
-    if (mpz_even_p(n_temp) != 0 || mpz_cmp_ui(n_temp, 1) == 0) {
-        mpz_clears(n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one,
-            param_of_two, NULL);
+    // Freeing of allocated memory.
+    mpz_clears(d, u, v, qk, qm, t, NULL);
+    return prime;
+}
+
+// Performs the Baillie-PSW Primality test: a Miller-Rabin round to base 2 followed by a strong Lucas test,
+// then "iters" more Miller-Rabin rounds with random bases drawn from "rs".
+// No composite is known to pass the first two tests, so iters can be 0, where Miller-Rabin alone needs dozens of rounds.
+// Returns true if "n" is prime, otherwise returns false.
+bool is_prime_bpsw(mpz_t n, uint64_t iters, rand_state *rs) {
+    mpz_t r, base, range, power_mod, n_min_one;
+    uint64_t s = 0;
+    bool prime = true;
+    mont_ctx ctx;
+    mont_scratch sc;
+
+    // If n is 2, then it's prime; if n is even or less than 2, then it will not be prime.
+    if (mpz_cmp_ui(n, 2) == 0) {
+        return true;
+    }
+    if (mpz_even_p(n) != 0 || mpz_cmp_ui(n, 1) <= 0) {
         return false;
     }
 
+    // Small primes are settled by division.
+    for (uint64_t i = 0; i < sizeof(bpsw_small_primes) / sizeof(bpsw_small_primes[0]); i += 1) {
+        if (mpz_cmp_ui(n, bpsw_small_primes[i]) == 0) {
+            return true;
+        }
+        if (mpz_divisible_ui_p(n, bpsw_small_primes[i]) != 0) {
+            return false;
+        }
+    }
+
+    // Initializes variables that were declared above.
+    mpz_inits(r, base, range, power_mod, n_min_one, NULL);
+    mont_init(&ctx, n);
+    mont_scratch_init(&sc);
+
     // n - 1 = 2^s * r such that r is odd
-    while (mpz_even_p(r) != 0) {
-        mpz_fdiv_q_ui(r, r, 2);
-        mpz_add_ui(s, s, 1);
+    mpz_sub_ui(r, n, 1);
+    s = mpz_scan1(r, 0);
+    mpz_fdiv_q_2exp(r, r, s);
+
+    // In Montgomery form, n - 1 is n - (R mod n).
+    mpz_sub(n_min_one, n, ctx.one);
+
+    // The base 2 round, then the Lucas test.
+    mpz_set_ui(base, 2);
+    prime = strong_round(&ctx, &sc, power_mod, base, r, s, n_min_one) && strong_lucas(&ctx, &sc);
+
+    // The extra rounds pick their bases from {2,...,(n - 2)}, like is_prime_r().
+    mpz_sub_ui(range, n, 3);
+    for (uint64_t i = 0; i < iters && prime; i += 1) {
+        rand_urandomm(base, rs, range);
+        mpz_add_ui(base, base, 2);
+        prime = strong_round(&ctx, &sc, power_mod, base, r, s, n_min_one);
     }
 
-    mpz_sub_ui(s_min_one, s, 1);
+    // Freeing of allocated memory.
+    mont_scratch_clear(&sc);
+    mont_clear(&ctx);
+    mpz_clears(r, base, range, power_mod, n_min_one, NULL);
+    return prime;
+}
 
-    // For i < iters...
-    for (uint64_t i = 1; i < iters; i += 1) {
-        // Pick a random number rand_num in the set {2,...,(n - 2)}
-        mpz_urandomm(rand_number, state, range);
-        mpz_add_ui(rand_number, rand_number, 2);
+// Tests "n" with the primality test "test", drawing any random bases from "rs".
+static bool probable_prime(mpz_t n, uint64_t iters, prime_test test, rand_state *rs) {
+    if (test == PRIME_TEST_BPSW) {
+        return is_prime_bpsw(n, iters, rs);
+    }
+    return is_prime_r(n, iters, rs);
+}
 
-        // power_mod = rand_number ^ r (mod n)
-        pow_mod(power_mod, rand_number, r, n_temp);
-
-        // If power_mod is not equal to 1 and not equal to n - 1...
-        if ((mpz_cmp_ui(power_mod, 1) != 0) && (mpz_cmp(power_mod, n_min_one) != 0)) {
-            mpz_set_ui(j, 1);
-
-            // While j <= s - 1 and power_mod is not equal to n - 1...
-            while ((mpz_cmp(j, s_min_one) <= 0) && (mpz_cmp(power_mod, n_min_one) != 0)) {
-                // power_mod = power_mod ^ 2 (mod n)
-                pow_mod(power_mod, power_mod, param_of_two, n_temp);
-                // If power_mod is equal to 1, return false.
-                if (mpz_cmp_ui(power_mod, 1) == 0) {
-                    mpz_clears(n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one,
-                        param_of_two, NULL);
-                    return false;
-                }
-                mpz_add_ui(j, j, 1);
-            }
+// Odd primes below this bound are used to sieve prime candidates.
+#define SIEVE_PRIME_LIMIT 32768
+
+// Number of consecutive odd candidates covered by one sieve window.
+#define SIEVE_WINDOW 4096
+
+// Table of the odd primes below SIEVE_PRIME_LIMIT, filled once on first use.
+static uint32_t sieve_primes[SIEVE_PRIME_LIMIT / 8];
+static uint64_t sieve_count = 0;
+static pthread_once_t sieve_once = PTHREAD_ONCE_INIT;
+
+// Fills the small prime table with a sieve of Eratosthenes.
+static void sieve_init(void) {
+    static uint8_t composite[SIEVE_PRIME_LIMIT];
+    for (uint64_t i = 3; i < SIEVE_PRIME_LIMIT; i += 2) {
+        if (composite[i]) {
+            continue;
+        }
+        sieve_primes[sieve_count] = (uint32_t) i;
+        sieve_count += 1;
+        for (uint64_t j = i * i; j < SIEVE_PRIME_LIMIT; j += 2 * i) {
+            composite[j] = 1;
+        }
+    }
+    return;
+}
 
-            // If power_mod is not equal to n - 1, return false.
-            if (mpz_cmp(power_mod, n_min_one) != 0) {
-                mpz_clears(n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one,
-                    param_of_two, NULL);
+// Shared state of one parallel prime search.
+// Every candidate that survives the sieve gets the key (survivor index x workers + worker).
+// The prime with the smallest key wins, which makes the result independent of thread timing.
+typedef struct {
+    uint64_t bits;
+    uint64_t iters;
+    prime_test test;
+    uint64_t workers;
+    _Atomic uint64_t best; // Smallest key of a prime found so far; UINT64_MAX if none.
+    pthread_mutex_t lock;
+    mpz_ptr result;
+} prime_race;
+
+// Searches for a prime exactly bits + 1 bits long, drawing random numbers from "rs".
+// Without a race, the first prime found is stored in "p" and true is returned.
+// In a race, the search gives up and returns false as soon as another worker holds a smaller key.
+// Starting from a random odd base, consecutive odd numbers are sieved against the small primes,
+// and only the survivors are given to the primality test "test".
+static bool prime_search(mpz_t p, uint64_t bits, uint64_t iters, prime_test test,
+    rand_state *rs, prime_race *race, uint64_t worker) {
+    uint8_t composite[SIEVE_WINDOW];
+    uint64_t workers = race ? race->workers : 1;
+    uint64_t key = worker;
+    bool found = false;
+    mpz_t base;
+
+    // The sieve would reject small primes that are in the table, so tiny sizes keep the plain random search.
+    // Generate a random number from 0 - 2^n-1 inclusive.
+    // While that number isn't prime OR its size in bits is less than "bits",
+    // continue generating a number until it's  prime and at least "bits" number of bits long.
+    if (bits + 1 <= 16) {
+        for (;; key += workers) {
+            if (race && key > atomic_load(&race->best)) {
                 return false;
             }
+            rand_urandomb(p, rs, bits + 1);
+            atomic_fetch_add_explicit(&counts.candidates, 1, memory_order_relaxed);
+            if (mpz_sizeinbase(p, 2) != bits + 1) {
+                atomic_fetch_add_explicit(&counts.size_rejects, 1, memory_order_relaxed);
+                continue;
+            }
+            if (probable_prime(p, iters, test, rs)) {
+                break;
+            }
+            atomic_fetch_add_explicit(&counts.mr_rejects, 1, memory_order_relaxed);
         }
+        found = true;
     }
 
-    // Freeing of allocated memory.
-    mpz_clears(
-        n_temp, s, r, j, rand_number, range, power_mod, n_min_one, s_min_one, param_of_two, NULL);
+    pthread_once(&sieve_once, sieve_init);
+    mpz_init(base);
+
+    while (!found) {
+        // Pick a random odd base exactly bits + 1 bits long.
+        rand_urandomb(base, rs, bits + 1);
+        mpz_setbit(base, bits);
+        mpz_setbit(base, 0);
+
+        // Walk forward one window at a time until the candidates outgrow bits + 1 bits.
+        while (!found && mpz_sizeinbase(base, 2) == bits + 1) {
+            // Candidate j of this window is base + 2j.
+            // For each small prime q, base + 2j is divisible by q when j = -base / 2 (mod q).
+            memset(composite, 0, sizeof(composite));
+            for (uint64_t i = 0; i < sieve_count; i += 1) {
+                uint64_t q = sieve_primes[i];
+                uint64_t r = mpz_fdiv_ui(base, q);
+                uint64_t j = ((q - r) % q) * ((q + 1) / 2) % q;
+                for (; j < SIEVE_WINDOW; j += q) {
+                    composite[j] = 1;
+                }
+            }
 
+            // Run the primality test on the survivors.
+            // The counters are only updated once per window, so threads don't fight over them.
+            uint64_t seen = 0;
+            uint64_t sieved = 0;
+            uint64_t failed = 0;
+            for (uint64_t j = 0; j < SIEVE_WINDOW; j += 1) {
+                if (composite[j]) {
+                    seen += 1;
+                    sieved += 1;
+                    continue;
+                }
+                mpz_add_ui(p, base, 2 * j);
+                if (mpz_sizeinbase(p, 2) != bits + 1) {
+                    break;
+                }
+                if (race && key > atomic_load(&race->best)) {
+                    break;
+                }
+                seen += 1;
+                if (probable_prime(p, iters, test, rs)) {
+                    found = true;
+                    break;
+                }
+                failed += 1;
+                key += workers;
+            }
+            atomic_fetch_add_explicit(&counts.candidates, seen, memory_order_relaxed);
+            atomic_fetch_add_explicit(&counts.sieve_rejects, sieved, memory_order_relaxed);
+            atomic_fetch_add_explicit(&counts.mr_rejects, failed, memory_order_relaxed);
+            if (!found && race && key > atomic_load(&race->best)) {
+                mpz_clear(base);
+                return false;
+            }
+
+            mpz_add_ui(base, base, 2 * SIEVE_WINDOW);
+        }
+    }
+    mpz_clear(base);
+
+    // Report the prime to the race if it beats the current best.
+    if (race) {
+        pthread_mutex_lock(&race->lock);
+        if (key < atomic_load(&race->best)) {
+            atomic_store(&race->best, key);
+            mpz_set(race->result, p);
+        }
+        pthread_mutex_unlock(&race->lock);
+    }
     return true;
 }
 
-// Generates a prime number that is at least "bits" numbers of bits long.
+// Generates a prime number that is at least "bits" numbers of bits long, checked with the primality test "test".
 // Stores the prime number in "p".
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    // Generate a random number from 0 - 2^n-1 inclusive.
-    // While that number isn't prime OR its size in bits is less than "bits",
-    // continue generating a number until it's  prime and at least "bits" number of bits long.
-    do {
-        mpz_urandomb(p, state, bits + 1);
-    } while (!is_prime(p, iters) || mpz_sizeinbase(p, 2) < bits + 1);
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, prime_test test) {
+    prime_search(p, bits, iters, test, &state, NULL, 0);
+    return;
+}
+
+// Generates a prime like make_prime(), drawing random numbers from "rs" instead of the global state.
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, rand_state *rs) {
+    prime_search(p, bits, iters, test, rs, NULL, 0);
+    return;
+}
+
+// Arguments handed to each prime search worker thread.
+typedef struct {
+    prime_race *race;
+    uint64_t worker;
+    rand_backend backend;
+    uint8_t seed[RAND_SEED_SIZE];
+} race_worker;
+
+// Runs one worker of a prime race with its own random state.
+static void *race_worker_main(void *varg) {
+    race_worker *rw = (race_worker *) varg;
+    rand_state rs;
+    mpz_t p;
+
+    rand_init_seed(&rs, rw->backend, rw->seed);
+    mpz_init(p);
+
+    prime_search(p, rw->race->bits, rw->race->iters, rw->race->test, &rs, rw->race, rw->worker);
+
+    // Freeing of allocated memory.
+    mpz_clear(p);
+    rand_clear(&rs);
+    return NULL;
+}
+
+// Generates "count" primes at once; primes[i] is at least bits[i] bits long.
+// The available threads are split between the primes, and the workers searching for the same prime race each other.
+// Each worker is seeded from the global random state, so a fixed seed and thread count always give the same primes.
+void make_primes_parallel(mpz_ptr primes[], uint64_t bits[], uint64_t count, uint64_t iters,
+    prime_test test, uint64_t threads) {
+    if (threads < count) {
+        threads = count;
+    }
+
+    prime_race *races = (prime_race *) calloc(count, sizeof(prime_race));
+    race_worker *rws = (race_worker *) calloc(threads, sizeof(race_worker));
+    pthread_t *tids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+
+    for (uint64_t i = 0; i < count; i += 1) {
+        races[i].bits = bits[i];
+        races[i].iters = iters;
+        races[i].test = test;
+        races[i].workers = threads / count + (i < threads % count ? 1 : 0);
+        atomic_init(&races[i].best, UINT64_MAX);
+        pthread_mutex_init(&races[i].lock, NULL);
+        races[i].result = primes[i];
+    }
+
+    // Hand out the workers and draw each one's seed from the global state in a fixed order.
+    pthread_once(&sieve_once, sieve_init);
+    for (uint64_t t = 0, i = 0, w = 0; t < threads; t += 1) {
+        rws[t].race = &races[i];
+        rws[t].worker = w;
+        rws[t].backend = state.backend;
+        rand_draw_seed(&state, rws[t].seed);
+        w += 1;
+        if (w == races[i].workers) {
+            i += 1;
+            w = 0;
+        }
+    }
+
+    for (uint64_t t = 0; t < threads; t += 1) {
+        pthread_create(&tids[t], NULL, race_worker_main, &rws[t]);
+    }
+    for (uint64_t t = 0; t < threads; t += 1) {
+        pthread_join(tids[t], NULL);
+    }
+
+    // Freeing of allocated memory.
+    for (uint64_t i = 0; i < count; i += 1) {
+        pthread_mutex_destroy(&races[i].lock);
+    }
+    free(races);
+    free(rws);
+    free(tids);
     return;
 }
@@ -0,0 +1,221 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Number of slots per worker thread, so the reader can stay ahead of the workers.
+#define SLOTS_PER_THREAD 4
+
+// Slot statuses.
+enum { SLOT_EMPTY, SLOT_FILLED, SLOT_WORKING, SLOT_DONE };
+
+// Shared state of a running pipeline.
+typedef struct {
+    pipeline_slot *slots;
+    uint64_t nslots;
+    uint64_t next_read;  // Sequence number the reader fills next.
+    uint64_t next_work;  // Sequence number the next idle worker picks up.
+    uint64_t next_write; // Sequence number the writer drains next.
+    bool reader_done;    // Set once the reader has run out of input.
+    pthread_mutex_t lock;
+    pthread_cond_t filled; // Signalled when a slot is filled or the reader finishes.
+    pthread_cond_t done;   // Signalled when a worker finishes a slot.
+    pthread_cond_t empty;  // Signalled when the writer frees a slot.
+    pipeline_read_fn read;
+    pipeline_work_fn work;
+    pipeline_write_fn write;
+    void *arg;
+} pipeline;
+
+// Arguments handed to each worker thread.
+typedef struct {
+    pipeline *pl;
+    uint64_t id;
+} worker_arg;
+
+// Reader stage: fills slots in order until the input runs out.
+static void *reader_main(void *varg) {
+    pipeline *pl = (pipeline *) varg;
+
+    for (;;) {
+        // Wait for the next slot in the ring to be drained by the writer.
+        pthread_mutex_lock(&pl->lock);
+        pipeline_slot *slot = &pl->slots[pl->next_read % pl->nslots];
+        while (slot->status != SLOT_EMPTY) {
+            pthread_cond_wait(&pl->empty, &pl->lock);
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        // The slot belongs to the reader while it's empty, so it can be filled without the lock.
+        bool more = pl->read(pl->arg, slot);
+
+        pthread_mutex_lock(&pl->lock);
+        if (!more) {
+            pl->reader_done = true;
+            pthread_cond_broadcast(&pl->filled);
+            pthread_cond_broadcast(&pl->done);
+            pthread_mutex_unlock(&pl->lock);
+            return NULL;
+        }
+        slot->seq = pl->next_read;
+        slot->status = SLOT_FILLED;
+        pl->next_read += 1;
+        pthread_cond_broadcast(&pl->filled);
+        pthread_mutex_unlock(&pl->lock);
+    }
+}
+
+// Worker stage: processes filled slots in whatever order they become available.
+static void *worker_main(void *varg) {
+    worker_arg *wa = (worker_arg *) varg;
+    pipeline *pl = wa->pl;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        // Wait until the next unclaimed block has been read, or there are no more blocks.
+        while (pl->next_work == pl->next_read && !pl->reader_done) {
+            pthread_cond_wait(&pl->filled, &pl->lock);
+        }
+        if (pl->next_work == pl->next_read) {
+            break;
+        }
+
+        // Claim the block, then process it without holding the lock.
+        pipeline_slot *slot = &pl->slots[pl->next_work % pl->nslots];
+        slot->status = SLOT_WORKING;
+        pl->next_work += 1;
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->work(pl->arg, wa->id, slot);
+
+        pthread_mutex_lock(&pl->lock);
+        slot->status = SLOT_DONE;
+        pthread_cond_broadcast(&pl->done);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+// Returns the number of slots pipeline_run_slots() needs for "threads" worker threads.
+uint64_t pipeline_slot_count(uint64_t threads) {
+    return threads == 0 ? 1 : threads * SLOTS_PER_THREAD;
+}
+
+// Gives each of "count" slots input and output buffers of "in_cap" and "out_cap" bytes.
+void pipeline_slots_init(pipeline_slot *slots, uint64_t count, size_t in_cap, size_t out_cap) {
+    for (uint64_t i = 0; i < count; i += 1) {
+        slots[i] = (pipeline_slot) { 0 };
+        slots[i].in = (uint8_t *) calloc(in_cap, sizeof(uint8_t));
+        slots[i].in_cap = in_cap;
+        slots[i].out = (uint8_t *) calloc(out_cap, sizeof(uint8_t));
+        slots[i].out_cap = out_cap;
+    }
+    return;
+}
+
+// Frees the buffers of "count" slots.
+void pipeline_slots_clear(pipeline_slot *slots, uint64_t count) {
+    for (uint64_t i = 0; i < count; i += 1) {
+        free(slots[i].in);
+        free(slots[i].out);
+    }
+    return;
+}
+
+// Runs "read", "work", and "write" as a three stage pipeline over caller-owned slots.
+// One reader thread and "threads" worker threads are started; the calling thread is the writer,
+// so output is written in exactly the order the input was read.
+// With 0 threads, the three stages take turns on the calling thread instead (as worker 0).
+// "slots" must hold pipeline_slot_count(threads) slots set up by pipeline_slots_init(). The callbacks
+// may grow their buffers with realloc(), and the slots can be reused for later runs.
+void pipeline_run_slots(uint64_t threads, pipeline_slot *slots, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg) {
+    pipeline pl = { 0 };
+    pthread_t reader;
+
+    if (threads == 0) {
+        slots[0].seq = 0;
+        while (read(arg, &slots[0])) {
+            work(arg, 0, &slots[0]);
+            write(arg, &slots[0]);
+            slots[0].seq += 1;
+        }
+        return;
+    }
+
+    pl.nslots = pipeline_slot_count(threads);
+    pl.slots = slots;
+    for (uint64_t i = 0; i < pl.nslots; i += 1) {
+        pl.slots[i].status = SLOT_EMPTY;
+    }
+    pl.read = read;
+    pl.work = work;
+    pl.write = write;
+    pl.arg = arg;
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.filled, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    pthread_cond_init(&pl.empty, NULL);
+
+    // Start the reader and the workers.
+    pthread_t *workers = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    worker_arg *wargs = (worker_arg *) calloc(threads, sizeof(worker_arg));
+    pthread_create(&reader, NULL, reader_main, &pl);
+    for (uint64_t i = 0; i < threads; i += 1) {
+        wargs[i].pl = &pl;
+        wargs[i].id = i;
+        pthread_create(&workers[i], NULL, worker_main, &wargs[i]);
+    }
+
+    // Writer stage: drain slots in sequence order.
+    pthread_mutex_lock(&pl.lock);
+    for (;;) {
+        pipeline_slot *slot = &pl.slots[pl.next_write % pl.nslots];
+        while (!(pl.next_write < pl.next_read && slot->status == SLOT_DONE)
+               && !(pl.reader_done && pl.next_write == pl.next_read)) {
+            pthread_cond_wait(&pl.done, &pl.lock);
+        }
+        if (pl.next_write == pl.next_read) {
+            break;
+        }
+        pthread_mutex_unlock(&pl.lock);
+
+        write(arg, slot);
+
+        pthread_mutex_lock(&pl.lock);
+        slot->status = SLOT_EMPTY;
+        pl.next_write += 1;
+        pthread_cond_broadcast(&pl.empty);
+    }
+    pthread_mutex_unlock(&pl.lock);
+
+    pthread_join(reader, NULL);
+    for (uint64_t i = 0; i < threads; i += 1) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Freeing of allocated memory.
+    free(workers);
+    free(wargs);
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.filled);
+    pthread_cond_destroy(&pl.done);
+    pthread_cond_destroy(&pl.empty);
+    return;
+}
+
+// Runs "read", "work", and "write" as a three stage pipeline, like pipeline_run_slots(), with slots
+// of "in_cap" and "out_cap" bytes that only last for this run.
+void pipeline_run(uint64_t threads, size_t in_cap, size_t out_cap, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg) {
+    uint64_t count = pipeline_slot_count(threads);
+    pipeline_slot *slots = (pipeline_slot *) calloc(count, sizeof(pipeline_slot));
+
+    pipeline_slots_init(slots, count, in_cap, out_cap);
+    pipeline_run_slots(threads, slots, read, work, write, arg);
+
+    // Freeing of allocated memory.
+    pipeline_slots_clear(slots, count);
+    free(slots);
+    return;
+}
@@ -0,0 +1,107 @@
+#include "proto.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Reads exactly "len" bytes from fd.
+// Returns false on end of file or an error.
+bool proto_read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *) buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        len -= (size_t) r;
+    }
+    return true;
+}
+
+// Writes exactly "len" bytes to fd.
+// Returns false on an error, such as the other side having closed the connection.
+bool proto_write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *) buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        len -= (size_t) w;
+    }
+    return true;
+}
+
+// Sends one frame holding "code" and "len" bytes of payload.
+bool proto_send(int fd, uint8_t code, const uint8_t *payload, uint32_t len) {
+    uint8_t head[5];
+    uint32_t frame = len + 1;
+    for (int i = 0; i < 4; i += 1) {
+        head[i] = (uint8_t) (frame >> (24 - 8 * i));
+    }
+    head[4] = code;
+    return proto_write_full(fd, head, sizeof(head)) && proto_write_full(fd, payload, len);
+}
+
+// Receives one frame into "code" and "payload".
+// "payload" is a buffer of "cap" bytes that is grown with realloc() as needed; it may start out NULL.
+// Returns false if the connection closed, failed, or sent a frame that is empty or larger than RSAD_MAX_FRAME.
+bool proto_recv(int fd, uint8_t *code, uint8_t **payload, uint32_t *len, uint32_t *cap) {
+    uint8_t head[4];
+    uint32_t frame = 0;
+
+    if (!proto_read_full(fd, head, sizeof(head))) {
+        return false;
+    }
+    for (int i = 0; i < 4; i += 1) {
+        frame = (frame << 8) | head[i];
+    }
+    if (frame == 0 || frame > RSAD_MAX_FRAME) {
+        return false;
+    }
+    if (!proto_read_full(fd, code, 1)) {
+        return false;
+    }
+
+    *len = frame - 1;
+    if (*len > *cap || *payload == NULL) {
+        *cap = *len > 0 ? *len : 1;
+        *payload = (uint8_t *) realloc(*payload, *cap);
+    }
+    return proto_read_full(fd, *payload, *len);
+}
+
+// Connects to the daemon listening at the socket "path".
+// Returns the connected descriptor, or -1 on failure.
+int proto_connect(const char *path) {
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -1,18 +1,194 @@
 #include "randstate.h"
+#include "chacha20.h"
 #include <gmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
 
-gmp_randstate_t state;
+rand_state state;
 
-// This function initializes a global random state variable and sets its random seed.
-void randstate_init(uint64_t seed) {
-    // Initialize global random state variable
-    gmp_randinit_mt(state);
-    gmp_randseed_ui(state, seed);
+// Makes the next RAND_BUFFER bytes of keystream under the current key. The first CHACHA20_KEY_SIZE bytes
+// replace the key straight away, so earlier output can't be worked out from the state later on.
+static void rand_refill(rand_state *rs) {
+    static const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0 };
+    chacha20_ctx cc;
+
+    memset(rs->buf, 0, RAND_BUFFER);
+    chacha20_init(&cc, rs->key, nonce, 0);
+    chacha20_xor(&cc, rs->buf, rs->buf, RAND_BUFFER);
+    memcpy(rs->key, rs->buf, CHACHA20_KEY_SIZE);
+    memset(rs->buf, 0, CHACHA20_KEY_SIZE);
+    rs->pos = CHACHA20_KEY_SIZE;
+    return;
+}
+
+// Initializes a random state with the generator "backend" and seeds it with "seed".
+// The same backend and seed always give the same numbers.
+void rand_init(rand_state *rs, rand_backend backend, uint64_t seed) {
+    uint8_t material[RAND_SEED_SIZE] = { 0 };
+
+    // The seed fills the first 8 bytes of the seed material, least significant byte first.
+    for (int i = 0; i < 8; i += 1) {
+        material[i] = (uint8_t) (seed >> (8 * i));
+    }
+    rand_init_seed(rs, backend, material);
+    return;
+}
+
+// Initializes a random state with the generator "backend", seeded from the operating system.
+// Returns false if the operating system couldn't supply the seed.
+bool rand_init_os(rand_state *rs, rand_backend backend) {
+    uint8_t material[RAND_SEED_SIZE];
+    size_t got = 0;
+
+    while (got < RAND_SEED_SIZE) {
+        ssize_t n = getrandom(material + got, RAND_SEED_SIZE - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += (size_t) n;
+    }
+    rand_init_seed(rs, backend, material);
+    return true;
+}
+
+// Draws seed material for another random state from "rs".
+// The Mersenne Twister hands out the same 64 bit seeds as older versions did, two 32 bit draws at a time.
+void rand_draw_seed(rand_state *rs, uint8_t seed[RAND_SEED_SIZE]) {
+    if (rs->backend == RAND_MT) {
+        uint64_t v = (rand_bits(rs, 32) << 32) | rand_bits(rs, 32);
+        memset(seed, 0, RAND_SEED_SIZE);
+        for (int i = 0; i < 8; i += 1) {
+            seed[i] = (uint8_t) (v >> (8 * i));
+        }
+        return;
+    }
+    rand_bytes(rs, seed, RAND_SEED_SIZE);
+    return;
+}
+
+// Initializes a random state with the generator "backend" from seed material, as made by rand_draw_seed().
+// ChaCha20 takes all of it as its first key; the Mersenne Twister takes the first 8 bytes as a 64 bit seed.
+void rand_init_seed(rand_state *rs, rand_backend backend, const uint8_t seed[RAND_SEED_SIZE]) {
+    rs->backend = backend;
+    if (backend == RAND_MT) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i += 1) {
+            v |= (uint64_t) seed[i] << (8 * i);
+        }
+        gmp_randinit_mt(rs->mt);
+        gmp_randseed_ui(rs->mt, v);
+        return;
+    }
+    memcpy(rs->key, seed, CHACHA20_KEY_SIZE);
+    rs->pos = RAND_BUFFER;
+    return;
+}
+
+// Frees the memory held by a random state, and wipes its key.
+void rand_clear(rand_state *rs) {
+    if (rs->backend == RAND_MT) {
+        gmp_randclear(rs->mt);
+        return;
+    }
+    memset(rs->key, 0, CHACHA20_KEY_SIZE);
+    memset(rs->buf, 0, RAND_BUFFER);
     return;
 }
 
+// Fills "buf" with "len" random bytes.
+void rand_bytes(rand_state *rs, uint8_t *buf, size_t len) {
+    if (rs->backend == RAND_MT) {
+        for (size_t i = 0; i < len; i += 1) {
+            buf[i] = (uint8_t) gmp_urandomb_ui(rs->mt, 8);
+        }
+        return;
+    }
+    while (len > 0) {
+        if (rs->pos == RAND_BUFFER) {
+            rand_refill(rs);
+        }
+        size_t take = RAND_BUFFER - rs->pos < len ? RAND_BUFFER - rs->pos : len;
+        memcpy(buf, rs->buf + rs->pos, take);
+        memset(rs->buf + rs->pos, 0, take);
+        rs->pos += take;
+        buf += take;
+        len -= take;
+    }
+    return;
+}
+
+// Returns a random number of "bits" bits (at most 32), like gmp_urandomb_ui().
+uint64_t rand_bits(rand_state *rs, uint64_t bits) {
+    if (rs->backend == RAND_MT) {
+        return gmp_urandomb_ui(rs->mt, bits);
+    }
+    uint8_t b[4];
+    rand_bytes(rs, b, sizeof(b));
+    uint64_t v = (uint64_t) b[0] | ((uint64_t) b[1] << 8) | ((uint64_t) b[2] << 16)
+                 | ((uint64_t) b[3] << 24);
+    return bits < 32 ? v & ((UINT64_C(1) << bits) - 1) : v;
+}
+
+// Sets "o" to a random number from 0 to 2^bits - 1, like mpz_urandomb().
+// ChaCha20 output is imported straight from the state's buffer when it holds enough, so a prime candidate
+// costs one mpz_import() and no copying. It is taken as whole little-endian 64 bit words from a word-aligned
+// position, which mpz_import() copies directly into the limbs on little-endian hosts.
+void rand_urandomb(mpz_t o, rand_state *rs, uint64_t bits) {
+    if (rs->backend == RAND_MT) {
+        mpz_urandomb(o, rs->mt, bits);
+        return;
+    }
+    size_t words = (bits + 63) / 64;
+    size_t len = 8 * words;
+    if (len <= RAND_BUFFER - CHACHA20_KEY_SIZE) {
+        size_t pos = (rs->pos + 7) & ~(size_t) 7;
+        if (pos + len > RAND_BUFFER) {
+            rand_refill(rs);
+            pos = rs->pos;
+        }
+        mpz_import(o, words, -1, sizeof(uint64_t), -1, 0, rs->buf + pos);
+        memset(rs->buf + rs->pos, 0, pos + len - rs->pos);
+        rs->pos = pos + len;
+    } else {
+        uint8_t *tmp = (uint8_t *) malloc(len);
+        rand_bytes(rs, tmp, len);
+        mpz_import(o, words, -1, sizeof(uint64_t), -1, 0, tmp);
+        memset(tmp, 0, len);
+        free(tmp);
+    }
+    mpz_tdiv_r_2exp(o, o, bits);
+    return;
+}
+
+// Sets "o" to a random number from 0 to n - 1, like mpz_urandomm(). "o" must not be "n".
+// With ChaCha20, numbers as long as n are drawn until one is below it, which takes two tries at most on average.
+void rand_urandomm(mpz_t o, rand_state *rs, mpz_t n) {
+    if (rs->backend == RAND_MT) {
+        mpz_urandomm(o, rs->mt, n);
+        return;
+    }
+    uint64_t bits = mpz_sizeinbase(n, 2);
+    do {
+        rand_urandomb(o, rs, bits);
+    } while (mpz_cmp(o, n) >= 0);
+    return;
+}
+
+// This function initializes the global random state with the generator "backend" and sets its random seed.
+void randstate_init(rand_backend backend, uint64_t seed) {
+    rand_init(&state, backend, seed);
+    return;
+}
+
+// Initializes the global random state with the generator "backend", seeded from the operating system.
+// Returns false if the operating system couldn't supply the seed.
+bool randstate_init_os(rand_backend backend) {
+    return rand_init_os(&state, backend);
+}
+
 // This function clears and frees all allocated memory used by the global random state variable.
 void randstate_clear(void) {
-    gmp_randclear(state);
+    rand_clear(&state);
     return;
 }
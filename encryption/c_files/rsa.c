@@ -1,55 +1,207 @@
 #include "rsa.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "pipeline.h"
+#include "chacha20.h"
+#include "lz.h"
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-// Makes a public key in the pair <e, n>
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+// Session secret wrapped with RSA in the hybrid format: a ChaCha20 key followed by a nonce.
+#define HYBRID_SECRET (CHACHA20_KEY_SIZE + CHACHA20_NONCE_SIZE)
+
+// Bytes read and encrypted at a time in the hybrid format.
+#define HYBRID_CHUNK (1 << 16)
+
+// Output gathered for each write to a regular file.
+#define OUT_CHUNK (1 << 20)
+
+// Records (or blocks' worth of record bytes) gathered into one pipeline slot in the records format.
+// Records are never split between slots, so a slot holding one long record goes over.
+#define RECORD_BATCH 64
+
+// Bytes of a length-prefixed record read at a time, so a damaged length can't allocate past the input.
+#define RECORD_CHUNK (1 << 16)
+
+// Bytes of a piped indexed file read ahead at a time (see held_read()).
+#define HELD_CHUNK (1 << 16)
+
+// Size of the length or block count in front of each record packed into a pipeline slot.
+#define RECORD_SLOT_PREFIX 8
+
+// Set in a slot's prefix for a record that is a last line without its newline (see RSA_RECORD_OPEN).
+#define RECORD_SLOT_OPEN (UINT64_C(1) << 63)
+
+// Marks the end of a list of cache entries.
+#define CACHE_NONE UINT32_MAX
+
+// Makes a balanced multi-prime modulus for make_pub(): the "x->count" primes p, q, and x->r[] split "nbits"
+// as evenly as they can, so n is at least as long as a two-prime modulus while each prime is much smaller.
+// The primes are drawn again until they are distinct and, with a fixed public exponent, until it is coprime
+// to each of their totients. Leaves the product of the totients in "totient".
+static void make_primes_multi(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, mpz_t totient,
+    uint64_t nbits, uint64_t iters, prime_test test, uint64_t threads, uint64_t fixed_e,
+    rand_state *rs) {
+    mpz_ptr primes[RSA_MAX_PRIMES] = { p, q };
+    uint64_t bits[RSA_MAX_PRIMES];
+    bool again = false;
+
+    mpz_t r_min_one, gcd_e;
+    mpz_inits(r_min_one, gcd_e, NULL);
+
+    // The first nbits mod count primes take one bit more than the rest.
+    for (uint64_t i = 0; i < x->count; i += 1) {
+        if (i >= 2) {
+            primes[i] = x->r[i - 2];
+        }
+        bits[i] = nbits / x->count + (i < nbits % x->count ? 1 : 0);
+    }
+
+    mpz_set_ui(e, fixed_e);
+    do {
+        if (threads > 1) {
+            make_primes_parallel(primes, bits, x->count, iters, test, threads);
+        } else {
+            for (uint64_t i = 0; i < x->count; i += 1) {
+                make_prime_r(primes[i], bits[i], iters, test, rs);
+            }
+        }
+
+        // totient(n) = (p - 1)(q - 1)(r[0] - 1)...
+        again = false;
+        mpz_set_ui(totient, 1);
+        mpz_set_ui(n, 1);
+        for (uint64_t i = 0; i < x->count; i += 1) {
+            for (uint64_t j = 0; j < i; j += 1) {
+                again = again || mpz_cmp(primes[i], primes[j]) == 0;
+            }
+            mpz_sub_ui(r_min_one, primes[i], 1);
+            mpz_mul(totient, totient, r_min_one);
+            mpz_mul(n, n, primes[i]);
+        }
+        if (fixed_e != 0) {
+            gcd(gcd_e, e, totient);
+            again = again || mpz_cmp_ui(gcd_e, 1) != 0;
+        }
+    } while (again);
+
+    // Freeing of allocated memory.
+    mpz_clears(r_min_one, gcd_e, NULL);
+    return;
+}
+
+// Makes a public key for rsa_make_pub() and rsa_make_pub_r(), drawing random numbers from "rs".
+// With more than one thread, the primes come from make_primes_parallel(), which seeds its workers from the global state.
+static void make_pub(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, prime_test test, uint64_t threads, uint64_t fixed_e, rand_state *rs) {
     uint64_t remainder_bits = 0;
 
     mpz_t rand_num_bits, range, nbits_div_four, p_min_one, q_min_one, totient, gcd_e;
 
     mpz_inits(rand_num_bits, range, nbits_div_four, p_min_one, q_min_one, totient, gcd_e, NULL);
 
-    // Calculates (nbits / 4) and sets nbits_div_four to the quotient.
-    mpz_set_ui(nbits_div_four, nbits);
-    mpz_fdiv_q_ui(nbits_div_four, nbits_div_four, 4);
+    // A multi-prime key has balanced primes rather than a random split.
+    if (x != NULL && x->count > 2) {
+        make_primes_multi(p, q, x, n, e, totient, nbits, iters, test, threads, fixed_e, rs);
+        gcd(gcd_e, e, totient);
+    } else {
+        // Calculates (nbits / 4) and sets nbits_div_four to the quotient.
+        mpz_set_ui(nbits_div_four, nbits);
+        mpz_fdiv_q_ui(nbits_div_four, nbits_div_four, 4);
 
-    // Calculates the range.
-    mpz_set_ui(range, nbits);
-    mpz_mul_ui(range, range, 3);
-    mpz_fdiv_q_ui(range, range, 4);
-    mpz_sub(range, range, nbits_div_four);
+        // Calculates the range.
+        mpz_set_ui(range, nbits);
+        mpz_mul_ui(range, range, 3);
+        mpz_fdiv_q_ui(range, range, 4);
+        mpz_sub(range, range, nbits_div_four);
 
-    // Generates a random number of bits from range [(nbits / 4), (3 x nbits) / 4] for prime number "p".
-    mpz_urandomm(rand_num_bits, state, range);
-    mpz_add(rand_num_bits, rand_num_bits, nbits_div_four);
+        // Generates a random number of bits from range [(nbits / 4), (3 x nbits) / 4] for prime number "p".
+        rand_urandomm(rand_num_bits, rs, range);
+        mpz_add(rand_num_bits, rand_num_bits, nbits_div_four);
 
-    // Finds the amount of bits left over for "q".
-    remainder_bits = nbits - mpz_get_ui(rand_num_bits);
+        // Finds the amount of bits left over for "q".
+        remainder_bits = nbits - mpz_get_ui(rand_num_bits);
 
-    // Make the prime numbers "p" and "q"
-    make_prime(p, mpz_get_ui(rand_num_bits), iters);
-    make_prime(q, remainder_bits, iters);
-    mpz_mul(n, p, q);
+        // Make the prime numbers "p" and "q"
+        // With a fixed public exponent, start over until it is coprime to both p - 1 and q - 1.
+        mpz_set_ui(e, fixed_e);
+        do {
+            if (threads > 1) {
+                mpz_ptr primes[2] = { p, q };
+                uint64_t bits[2] = { mpz_get_ui(rand_num_bits), remainder_bits };
+                make_primes_parallel(primes, bits, 2, iters, test, threads);
+            } else {
+                make_prime_r(p, mpz_get_ui(rand_num_bits), iters, test, rs);
+                make_prime_r(q, remainder_bits, iters, test, rs);
+            }
 
-    // Calculates the totient, totient(n) = (p - 1)(q - 1)
-    mpz_sub_ui(p_min_one, p, 1);
-    mpz_sub_ui(q_min_one, q, 1);
-    mpz_mul(totient, p_min_one, q_min_one);
+            // Calculates the totient, totient(n) = (p - 1)(q - 1)
+            mpz_sub_ui(p_min_one, p, 1);
+            mpz_sub_ui(q_min_one, q, 1);
+            mpz_mul(totient, p_min_one, q_min_one);
+            gcd(gcd_e, e, totient);
+        } while (fixed_e != 0 && mpz_cmp_ui(gcd_e, 1) != 0);
+        mpz_mul(n, p, q);
+    }
 
     // Find the public exponent.
-    do {
-        mpz_urandomb(e, state, nbits);
+    while (fixed_e == 0 && mpz_cmp_ui(gcd_e, 1) != 0) {
+        rand_urandomb(e, rs, nbits);
         gcd(gcd_e, e, totient);
-    } while (mpz_cmp_ui(gcd_e, 1) != 0);
+    }
 
     // Freeing of allocated memory.
     mpz_clears(rand_num_bits, range, nbits_div_four, p_min_one, q_min_one, totient, gcd_e, NULL);
     return;
 }
 
+// Initializes the extra primes of a key with "count" primes in all (2 to RSA_MAX_PRIMES).
+void rsa_primes_init(rsa_primes *x, uint64_t count) {
+    x->count = count;
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        mpz_inits(x->r[i], x->d[i], x->t[i], NULL);
+    }
+    return;
+}
+
+// Frees the memory held by the extra primes of a key.
+void rsa_primes_clear(rsa_primes *x) {
+    for (uint64_t i = 0; i < RSA_MAX_PRIMES - 2; i += 1) {
+        mpz_clears(x->r[i], x->d[i], x->t[i], NULL);
+    }
+    return;
+}
+
+// Makes a public key in the pair <e, n>
+// The primes are checked with the primality test "test", using "iters" as it describes.
+// With more than one thread, "p" and "q" are searched for concurrently.
+// If "fixed_e" isn't 0, it is used as the public exponent, and primes "p" where p - 1 shares a factor with it are thrown away.
+// Otherwise a random public exponent as large as n is picked.
+// If "x" isn't NULL and has a count above 2, n is the product of that many primes of about nbits / count bits each,
+// with the ones beyond p and q stored in x->r[]; otherwise "x" is left alone.
+void rsa_make_pub(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, prime_test test, uint64_t threads, uint64_t fixed_e) {
+    make_pub(p, q, x, n, e, nbits, iters, test, threads, fixed_e, &state);
+    return;
+}
+
+// Makes a public key like rsa_make_pub() on the calling thread, drawing random numbers from "rs" instead of
+// the global state, so that several threads can make keys at once.
+void rsa_make_pub_r(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, prime_test test, uint64_t fixed_e, rand_state *rs) {
+    make_pub(p, q, x, n, e, nbits, iters, test, 1, fixed_e, rs);
+    return;
+}
+
 // Writes the public key to pbfile in the order n, e, s, and the username, each of which have a trailing new line after.
 // n, e, and s are written as hexstrings.
 // Each element has a trailing newline after.
@@ -71,77 +223,1358 @@ void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 
 // Generates a private key "d" by computing the modular inverse of "e" mod totient(n).
 // totient(n) = (p - 1)(q - 1) where "p" and "q" are prime numbers.
-void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
-    mpz_t p_min_one, q_min_one, totient;
-    mpz_inits(p_min_one, q_min_one, totient, NULL);
+// For a multi-prime key "x", each extra prime r adds a factor of (r - 1) to the totient.
+void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_primes *x) {
+    mpz_t p_min_one, q_min_one, r_min_one, totient;
+    mpz_inits(p_min_one, q_min_one, r_min_one, totient, NULL);
 
     // Calculates the totient, totient(n) = (p - 1)(q - 1).
     mpz_sub_ui(p_min_one, p, 1);
     mpz_sub_ui(q_min_one, q, 1);
     mpz_mul(totient, p_min_one, q_min_one);
+    for (uint64_t i = 0; x != NULL && i + 2 < x->count; i += 1) {
+        mpz_sub_ui(r_min_one, x->r[i], 1);
+        mpz_mul(totient, totient, r_min_one);
+    }
 
     // Computes the inverse of e mod totient(n).
     mod_inverse(d, e, totient);
 
     // Freeing of allocated memory.
-    mpz_clears(p_min_one, q_min_one, totient, NULL);
+    mpz_clears(p_min_one, q_min_one, r_min_one, totient, NULL);
+    return;
+}
+
+// Computes the Chinese Remainder Theorem components of the private key.
+// dp = d mod (p - 1), dq = d mod (q - 1), and qinv = q^-1 mod p.
+// For a multi-prime key "x", also fills in x->d[] and x->t[] for each extra prime in x->r[].
+void rsa_make_crt(mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t p_min_one, q_min_one, r_min_one, prod;
+    mpz_inits(p_min_one, q_min_one, r_min_one, prod, NULL);
+
+    mpz_sub_ui(p_min_one, p, 1);
+    mpz_sub_ui(q_min_one, q, 1);
+
+    // Reduce the private exponent by each prime's totient.
+    mpz_mod(dp, d, p_min_one);
+    mpz_mod(dq, d, q_min_one);
+
+    // Computes the inverse of q mod p for the recombination step.
+    mod_inverse(qinv, q, p);
+
+    // Each extra prime gets its own exponent and the inverse of the product of the primes before it.
+    mpz_mul(prod, p, q);
+    for (uint64_t i = 0; x != NULL && i + 2 < x->count; i += 1) {
+        mpz_sub_ui(r_min_one, x->r[i], 1);
+        mpz_mod(x->d[i], d, r_min_one);
+        mod_inverse(x->t[i], prod, x->r[i]);
+        mpz_mul(prod, prod, x->r[i]);
+    }
+
+    // Freeing of allocated memory.
+    mpz_clears(p_min_one, q_min_one, r_min_one, prod, NULL);
     return;
 }
 
-// Writes the private key to pvfile in the order n, then d, each of which have a trailing new line after.
-// n and d are written as hexstrings.
+// Writes the private key to pvfile in the order n, d, p, q, dp, dq, then qinv.
+// A multi-prime key "x" follows these with r, d, and t for each extra prime.
+// All values are written as hexstrings.
 // Each element has a trailing newline after.
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+void rsa_write_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_primes *x, FILE *pvfile) {
     gmp_fprintf(pvfile,
+        "%Zx\n"
+        "%Zx\n"
+        "%Zx\n"
+        "%Zx\n"
+        "%Zx\n"
         "%Zx\n"
         "%Zx\n",
-        n, d);
+        n, d, p, q, dp, dq, qinv);
+    for (uint64_t i = 0; x != NULL && i + 2 < x->count; i += 1) {
+        gmp_fprintf(pvfile,
+            "%Zx\n"
+            "%Zx\n"
+            "%Zx\n",
+            x->r[i], x->d[i], x->t[i]);
+    }
     return;
 }
 
 // Reads the private key from file pointer pvfile.
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+// Older private key files only hold n and d; in that case p, q, dp, dq, and qinv are set to 0.
+// Any extra primes of a multi-prime key are read into "x", whose count is set to the number of primes;
+// with "x" NULL they are left unread, and the two-prime components alone don't make up n.
+// Returns true if the CRT components were present.
+bool rsa_read_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_primes *x, FILE *pvfile) {
     gmp_fscanf(pvfile, "%Zx\n %Zx\n", n, d);
-    return;
+    if (x != NULL) {
+        x->count = 2;
+    }
+
+    // If any of the CRT components are missing, fall back to the plain private exponent.
+    if (gmp_fscanf(pvfile, "%Zx\n %Zx\n %Zx\n %Zx\n %Zx\n", p, q, dp, dq, qinv) != 5) {
+        mpz_set_ui(p, 0);
+        mpz_set_ui(q, 0);
+        mpz_set_ui(dp, 0);
+        mpz_set_ui(dq, 0);
+        mpz_set_ui(qinv, 0);
+        return false;
+    }
+
+    // Extra primes come in complete triples.
+    while (x != NULL && x->count < RSA_MAX_PRIMES) {
+        uint64_t i = x->count - 2;
+        if (gmp_fscanf(pvfile, "%Zx\n %Zx\n %Zx\n", x->r[i], x->d[i], x->t[i]) != 3) {
+            break;
+        }
+        x->count += 1;
+    }
+    return true;
 }
 
 // Encrypts a message "m" by taking "m" to the power of public exponent "e" mod "n".
 // Stores the ciphertext in "c".
+// Public exponents that fit in a machine word, like 65537, take the short-exponent path.
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
+    if (mpz_fits_ulong_p(e)) {
+        pow_mod_ui(c, m, mpz_get_ui(e), n);
+        return;
+    }
     pow_mod(c, m, e, n);
     return;
 }
 
-// Encrypts an infile in k byte blocks.
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    uint64_t k = 0;
-    uint64_t j = 0;
-    mpz_t m, c;
+// Packs a binary ciphertext header into its RSA_HEADER_SIZE byte layout.
+static void header_pack(uint8_t buf[], rsa_header *hdr) {
+    memset(buf, 0, RSA_HEADER_SIZE);
+    memcpy(buf, RSA_HEADER_MAGIC, 4);
+    buf[4] = hdr->version;
+    buf[5] = hdr->flags;
+    for (int i = 0; i < 4; i += 1) {
+        buf[8 + i] = (uint8_t) (hdr->bits >> (24 - 8 * i));
+        buf[12 + i] = (uint8_t) (hdr->block_bytes >> (24 - 8 * i));
+    }
+    return;
+}
+
+// Unpacks a binary ciphertext header.
+// Returns false if the magic is wrong or the version is newer than this program.
+static bool header_unpack(const uint8_t buf[], rsa_header *hdr) {
+    if (memcmp(buf, RSA_HEADER_MAGIC, 4) != 0 || buf[4] == 0 || buf[4] > RSA_HEADER_VERSION) {
+        return false;
+    }
+    hdr->version = buf[4];
+    hdr->flags = buf[5];
+    hdr->bits = 0;
+    hdr->block_bytes = 0;
+    for (int i = 0; i < 4; i += 1) {
+        hdr->bits = (hdr->bits << 8) | buf[8 + i];
+        hdr->block_bytes = (hdr->block_bytes << 8) | buf[12 + i];
+    }
+    return true;
+}
+
+// Writes a binary ciphertext header to outfile.
+void rsa_write_header(FILE *outfile, rsa_header *hdr) {
+    uint8_t buf[RSA_HEADER_SIZE];
+    header_pack(buf, hdr);
+    fwrite(buf, sizeof(uint8_t), RSA_HEADER_SIZE, outfile);
+    return;
+}
+
+// Reads a binary ciphertext header from infile.
+// Returns false if the magic is wrong, the header is cut short, or the version is newer than this program.
+bool rsa_read_header(FILE *infile, rsa_header *hdr) {
+    uint8_t buf[RSA_HEADER_SIZE] = { 0 };
+    if (fread(buf, sizeof(uint8_t), RSA_HEADER_SIZE, infile) != RSA_HEADER_SIZE) {
+        return false;
+    }
+    return header_unpack(buf, hdr);
+}
+
+// Exports "c" into buf as a big-endian number exactly "width" bytes wide, padded with leading zeros.
+static void export_block(uint8_t *buf, size_t width, mpz_t c) {
+    size_t count = (mpz_sizeinbase(c, 2) + 7) / 8;
+    memset(buf, 0, width - count);
+    mpz_export(buf + width - count, NULL, 1, sizeof(uint8_t), 1, 0, c);
+    return;
+}
+
+// Stores the low "bytes" bytes of "v" in buf, big-endian.
+static void be_put(uint8_t *buf, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i += 1) {
+        buf[i] = (uint8_t) (v >> (8 * (bytes - 1 - i)));
+    }
+    return;
+}
+
+// Returns the "bytes" byte big-endian number in buf.
+static uint64_t be_get(const uint8_t *buf, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i += 1) {
+        v = (v << 8) | buf[i];
+    }
+    return v;
+}
+
+// Makes room for "len" bytes after the first "used" in a growable buffer, doubling it as needed.
+static void buf_reserve(uint8_t **buf, size_t *cap, size_t used, size_t len) {
+    if (len <= *cap - used) {
+        return;
+    }
+    while (len > *cap - used) {
+        *cap *= 2;
+    }
+    *buf = (uint8_t *) realloc(*buf, *cap);
+    return;
+}
+
+// State shared by the stages of an encryption or decryption.
+// Input comes from "infile", or from the buffer "in" when infile is NULL. Output goes to "outfile",
+// or into the buffer "out" when outfile is NULL.
+// A regular infile is memory-mapped by job_open() and read as a buffer, and a regular outfile is written
+// straight to its descriptor in OUT_CHUNK pieces; pipes and terminals keep going through stdio.
+// Worker i uses ctx->scratch[i], ctx->m[i] and ctx->c[i].
+typedef struct {
+    FILE *infile;
+    FILE *outfile;
+    const uint8_t *in; // Input buffer.
+    size_t in_len;     // Length of "in".
+    size_t in_pos;     // Bytes of "in" consumed so far.
+    bool in_eof;       // Set once a read from "in" comes up short, like feof().
+    uint8_t *out;      // Output buffer.
+    size_t out_cap;    // Size of "out".
+    size_t out_len;    // Bytes written to "out" so far.
+    bool overflow;     // Set if some output didn't fit in "out" and was dropped.
+    rsa_format format;
+    rsa_ctx *ctx;
+    rsa_stats io; // Byte counts and reader and writer times, added into ctx->stats when the job finishes.
+
+    // Memory-mapped input and direct output.
+    FILE *mapped;      // The infile whose contents were mapped to "in", or NULL.
+    uint8_t *map;      // Start of the mapping.
+    size_t map_len;    // Length of the mapping.
+    off_t map_base;    // Offset in the file that "in" starts at.
+    bool direct;       // True if output is gathered in "wbuf" and written to "out_fd".
+    int out_fd;        // Descriptor of the outfile.
+    uint8_t *wbuf;     // Output waiting to be written.
+    size_t wbuf_len;   // Bytes in "wbuf".
+    bool write_error;  // Set once a write to the outfile fails; later output is dropped.
+
+    // Indexed format. Encryption collects the index entries as it writes the blocks, and decryption
+    // of a range limits the reader to the blocks it needs and the writer to the bytes asked for.
+    uint64_t *index;      // Index entries so far, as plaintext offset and file offset pairs.
+    uint64_t entries;     // Number of entries in "index".
+    uint64_t index_cap;   // Entries "index" has room for.
+    uint64_t blocks;      // Blocks written so far.
+    uint64_t plain_pos;   // Plaintext bytes written so far.
+    uint64_t file_pos;    // Bytes of output written so far.
+    bool ranged;          // True to stop after "blocks_left" blocks, dropping "skip" bytes and keeping "limit".
+    uint64_t blocks_left; // Blocks the reader may still read.
+    uint64_t skip;        // Output bytes the writer still has to drop.
+    uint64_t limit;       // Output bytes the writer may still write.
+    uint8_t *held;        // Input read ahead of the blocks handed out for an indexed file that can't seek, or NULL.
+    size_t held_pos;      // Bytes of "held" handed out so far.
+    size_t held_len;      // Bytes in "held".
+    size_t held_cap;      // Size of "held".
+    bool held_end;        // Set once the input behind "held" has run out; "blocks_left" blocks are left.
+
+    // Records format. The reader packs whole records into a slot, each led by RECORD_SLOT_PREFIX bytes
+    // holding its length for encryption, or its number of blocks for decryption.
+    rsa_records records; // How records are delimited in the plaintext.
+    bool truncated;      // Set if the input ended inside a length-prefixed record, or a block or record unit.
+
+    // Compression. Encryption reads the input through "pack" a chunk at a time and cuts the frames into
+    // blocks; decryption writes its output through "unpack", which writes each chunk out as its frame comes in.
+    lz_stream *pack;   // Compressor of the input, or NULL.
+    bool packed;       // Set once the compressed input has run out.
+    lz_stream *unpack; // Decompressor of the output, or NULL.
+} file_job;
+
+// Returns the time in seconds if the context is timing its calls, and 0 otherwise.
+static double stats_clock(const rsa_ctx *ctx) {
+    struct timespec ts;
+    if (!ctx->timing) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Adds a job's counts and those of every worker into the context's totals.
+static void job_finish(file_job *job) {
+    rsa_ctx *ctx = job->ctx;
+    rsa_stats *st = &ctx->stats;
+    st->bytes_in += job->io.bytes_in;
+    st->bytes_out += job->io.bytes_out;
+    st->read_time += job->io.read_time;
+    st->write_time += job->io.write_time;
+    st->stream_time += job->io.stream_time;
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        st->blocks += ctx->ws[i].blocks;
+        st->cache_hits += ctx->ws[i].cache_hits;
+        st->cache_misses += ctx->ws[i].cache_misses;
+        st->parse_time += ctx->ws[i].parse_time;
+        st->exp_time += ctx->ws[i].exp_time;
+        memset(&ctx->ws[i], 0, sizeof(rsa_stats));
+    }
+    return;
+}
+
+// Reads up to "len" bytes of the job's input, like fread().
+static size_t job_read(file_job *job, uint8_t *buf, size_t len) {
+    if (job->infile != NULL) {
+        len = fread(buf, sizeof(uint8_t), len, job->infile);
+        job->io.bytes_in += len;
+        return len;
+    }
+    if (len > job->in_len - job->in_pos) {
+        len = job->in_len - job->in_pos;
+        job->in_eof = true;
+    }
+    memcpy(buf, job->in + job->in_pos, len);
+    job->in_pos += len;
+    job->io.bytes_in += len;
+    return len;
+}
+
+// Reads one byte of the job's input, like getc().
+static int job_getc(file_job *job) {
+    int ch = 0;
+    if (job->infile != NULL) {
+        ch = getc(job->infile);
+    } else if (job->in_pos == job->in_len) {
+        job->in_eof = true;
+        ch = EOF;
+    } else {
+        ch = job->in[job->in_pos];
+        job->in_pos += 1;
+    }
+    if (ch != EOF) {
+        job->io.bytes_in += 1;
+    }
+    return ch;
+}
+
+// Pushes back the byte last returned by job_getc(), like ungetc().
+static void job_ungetc(file_job *job, int ch) {
+    job->io.bytes_in -= 1;
+    if (job->infile != NULL) {
+        ungetc(ch, job->infile);
+        return;
+    }
+    job->in_pos -= 1;
+    return;
+}
 
-    mpz_inits(m, c, NULL);
+// Returns true once the job's input has run out, like feof().
+static bool job_eof(file_job *job) {
+    return job->infile != NULL ? feof(job->infile) != 0 : job->in_eof;
+}
+
+// Moves the job's input to byte "off". Returns false if the input can't seek there, as with a pipe.
+static bool job_seek(file_job *job, uint64_t off) {
+    if (job->infile != NULL) {
+        return fseeko(job->infile, (off_t) off, SEEK_SET) == 0;
+    }
+    if (off > job->in_len) {
+        return false;
+    }
+    job->in_pos = off;
+    job->in_eof = false;
+    return true;
+}
+
+// Reads exactly "len" bytes of the job's input from byte "off".
+// Returns false if the input can't seek there or is cut short.
+static bool job_read_at(file_job *job, uint64_t off, uint8_t *buf, size_t len) {
+    return job_seek(job, off) && job_read(job, buf, len) == len;
+}
+
+// Stores the size of the job's input in "size". Returns false if the input can't seek.
+static bool job_size(file_job *job, uint64_t *size) {
+    if (job->infile == NULL) {
+        *size = job->in_len;
+        return true;
+    }
+    if (fseeko(job->infile, 0, SEEK_END) != 0) {
+        return false;
+    }
+    off_t end = ftello(job->infile);
+    *size = (uint64_t) end;
+    return end >= 0;
+}
+
+// Writes the gathered output, followed by "len" more bytes at "buf", to the job's descriptor in one writev().
+static void job_flush(file_job *job, const uint8_t *buf, size_t len) {
+    struct iovec iov[2] = { { job->wbuf, job->wbuf_len }, { (void *) buf, len } };
+    struct iovec *v = iov;
+    int count = 2;
+
+    // With nothing to write, writev() would return 0, which looks like a failed write.
+    if (job->wbuf_len == 0 && len == 0) {
+        return;
+    }
+
+    // Keep going after partial writes, until everything is written or the write fails.
+    while (count > 0) {
+        ssize_t w = writev(job->out_fd, v, count);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            job->write_error = true;
+            break;
+        }
+        while (count > 0 && (size_t) w >= v->iov_len) {
+            w -= v->iov_len;
+            v += 1;
+            count -= 1;
+        }
+        if (count > 0) {
+            v->iov_base = (uint8_t *) v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    job->wbuf_len = 0;
+    return;
+}
+
+// Sets up the fast paths for a job on files: a regular infile is mapped and read as a buffer from its
+// current position, and output to a regular outfile is gathered and written in large pieces.
+// Anything else, or a file that can't be mapped, goes through stdio as before.
+static void job_open(file_job *job) {
+    struct stat st;
+    if (job->infile != NULL && fstat(fileno(job->infile), &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size > 0) {
+        off_t pos = ftello(job->infile);
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(job->infile), 0);
+        if (pos >= 0 && pos <= st.st_size && map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            job->mapped = job->infile;
+            job->map = (uint8_t *) map;
+            job->map_len = st.st_size;
+            job->map_base = pos;
+            job->in = job->map + pos;
+            job->in_len = st.st_size - pos;
+            job->infile = NULL;
+        } else if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+    if (job->outfile != NULL && fstat(fileno(job->outfile), &st) == 0 && S_ISREG(st.st_mode)) {
+        // Anything already buffered by stdio has to go out first.
+        fflush(job->outfile);
+        job->direct = true;
+        job->out_fd = fileno(job->outfile);
+        job->wbuf = (uint8_t *) malloc(OUT_CHUNK);
+    }
+    return;
+}
+
+// Writes out the rest of a job's output, and undoes job_open(). The infile is left positioned just after
+// the input that was used, as if it had been read through stdio.
+// Returns false if some of the output couldn't be written to the outfile, as on a full disk.
+static bool job_close(file_job *job) {
+    if (job->direct) {
+        job_flush(job, NULL, 0);
+        free(job->wbuf);
+    } else if (job->outfile != NULL && fflush(job->outfile) != 0) {
+        job->write_error = true;
+    }
+    if (job->mapped != NULL) {
+        fseeko(job->mapped, job->map_base + (off_t) job->in_pos, SEEK_SET);
+        munmap(job->map, job->map_len);
+    }
+    return !job->write_error;
+}
+
+// Writes "len" bytes to the job's output. Output that doesn't fit in the buffer is dropped and flagged,
+// and so is output to an outfile after a write has failed.
+static void job_write(file_job *job, const uint8_t *buf, size_t len) {
+    if (job->write_error) {
+        return;
+    }
+    if (job->direct) {
+        // Gather small writes; once they would overflow, write them together with this one.
+        if (len > OUT_CHUNK - job->wbuf_len) {
+            job_flush(job, buf, len);
+        } else {
+            memcpy(job->wbuf + job->wbuf_len, buf, len);
+            job->wbuf_len += len;
+        }
+        job->io.bytes_out += len;
+        return;
+    }
+    if (job->outfile != NULL) {
+        size_t w = fwrite(buf, sizeof(uint8_t), len, job->outfile);
+        job->io.bytes_out += w;
+        job->write_error = w < len;
+        return;
+    }
+    if (len > job->out_cap - job->out_len) {
+        job->overflow = true;
+        return;
+    }
+    memcpy(job->out + job->out_len, buf, len);
+    job->out_len += len;
+    job->io.bytes_out += len;
+    return;
+}
+
+// Reads up to "len" bytes of the job's input like job_read(), but compressed if the job compresses it.
+static size_t job_pull(file_job *job, uint8_t *buf, size_t len) {
+    lz_stream *lz = job->pack;
+    size_t got = 0;
+
+    if (lz == NULL) {
+        return job_read(job, buf, len);
+    }
+    while (got < len) {
+        if (lz->frame_pos == lz->frame_len) {
+            // Compress the next chunk, straight from where it is if the input is in memory.
+            const uint8_t *src = lz->chunk;
+            size_t j = 0;
+            if (job->infile == NULL) {
+                src = job->in + job->in_pos;
+                j = job->in_len - job->in_pos < LZ_CHUNK ? job->in_len - job->in_pos : LZ_CHUNK;
+                job->in_pos += j;
+                job->io.bytes_in += j;
+            } else {
+                j = job_read(job, lz->chunk, LZ_CHUNK);
+            }
+            if (j == 0) {
+                break;
+            }
+            lz_pack(lz, src, j);
+        }
+        size_t take = lz->frame_len - lz->frame_pos < len - got ? lz->frame_len - lz->frame_pos : len - got;
+        memcpy(buf + got, lz->frame + lz->frame_pos, take);
+        lz->frame_pos += take;
+        got += take;
+    }
+    return got;
+}
+
+// Writes "len" bytes to the job's output like job_write(), decompressing them first if the job decompresses it.
+static void job_put(file_job *job, const uint8_t *buf, size_t len) {
+    lz_stream *lz = job->unpack;
+    if (lz == NULL) {
+        job_write(job, buf, len);
+        return;
+    }
+    while (len > 0) {
+        size_t used = lz_unpack(lz, buf, len);
+        buf += used;
+        len -= used;
+        if (lz->chunk_len > 0) {
+            job_write(job, lz->chunk, lz->chunk_len);
+            lz->chunk_len = 0;
+        }
+    }
+    return;
+}
+
+// Returns a hash of the "len" bytes of a block, taken 8 bytes at a time.
+static uint64_t block_hash(const uint8_t *in, size_t len) {
+    uint64_t h = len * UINT64_C(0x9E3779B97F4A7C15);
+    uint64_t w = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, in + i, 8);
+        h = (h ^ w) * UINT64_C(0xFF51AFD7ED558CCD);
+        h ^= h >> 32;
+    }
+    for (; i < len; i += 1) {
+        h = (h ^ in[i]) * UINT64_C(0x100000001B3);
+    }
+    return h ^ (h >> 29);
+}
+
+// Initializes an empty cache of "entries" blocks of up to "key_width" bytes, with ciphertexts "width" bytes wide.
+static void cache_init(rsa_cache *cache, uint32_t entries, size_t key_width, size_t width) {
+    cache->entries = entries;
+    cache->used = 0;
+    cache->key_width = key_width;
+    cache->width = width;
+    cache->head = CACHE_NONE;
+    cache->tail = CACHE_NONE;
+
+    // Twice as many buckets as entries keeps the chains short.
+    cache->buckets = 1;
+    while (cache->buckets < 2 * (uint64_t) entries) {
+        cache->buckets *= 2;
+    }
+    cache->bucket = (uint32_t *) malloc(cache->buckets * sizeof(uint32_t));
+    memset(cache->bucket, 0xFF, cache->buckets * sizeof(uint32_t));
+    cache->chain = (uint32_t *) calloc(entries, sizeof(uint32_t));
+    cache->prev = (uint32_t *) calloc(entries, sizeof(uint32_t));
+    cache->next = (uint32_t *) calloc(entries, sizeof(uint32_t));
+    cache->hash = (uint64_t *) calloc(entries, sizeof(uint64_t));
+    cache->len = (uint32_t *) calloc(entries, sizeof(uint32_t));
+    cache->data = (uint8_t *) calloc(entries, key_width + width);
+    return;
+}
+
+// Frees the memory used by a cache.
+static void cache_clear(rsa_cache *cache) {
+    free(cache->bucket);
+    free(cache->chain);
+    free(cache->prev);
+    free(cache->next);
+    free(cache->hash);
+    free(cache->len);
+    free(cache->data);
+    return;
+}
+
+// Takes entry "i" out of the order of use.
+static void cache_unlink(rsa_cache *cache, uint32_t i) {
+    if (cache->prev[i] != CACHE_NONE) {
+        cache->next[cache->prev[i]] = cache->next[i];
+    } else {
+        cache->head = cache->next[i];
+    }
+    if (cache->next[i] != CACHE_NONE) {
+        cache->prev[cache->next[i]] = cache->prev[i];
+    } else {
+        cache->tail = cache->prev[i];
+    }
+    return;
+}
+
+// Makes entry "i" the most recently used.
+static void cache_push(rsa_cache *cache, uint32_t i) {
+    cache->prev[i] = CACHE_NONE;
+    cache->next[i] = cache->head;
+    if (cache->head != CACHE_NONE) {
+        cache->prev[cache->head] = i;
+    } else {
+        cache->tail = i;
+    }
+    cache->head = i;
+    return;
+}
+
+// Returns the cached ciphertext of the "len" bytes at "in", whose hash is "h", marking it as the most recently
+// used, or NULL if the block isn't in the cache.
+static const uint8_t *cache_find(rsa_cache *cache, uint64_t h, const uint8_t *in, size_t len) {
+    uint32_t i = cache->bucket[h & (cache->buckets - 1)];
+    while (i != CACHE_NONE) {
+        uint8_t *entry = cache->data + i * (cache->key_width + cache->width);
+        if (cache->hash[i] == h && cache->len[i] == len && memcmp(entry, in, len) == 0) {
+            if (cache->head != i) {
+                cache_unlink(cache, i);
+                cache_push(cache, i);
+            }
+            return entry + cache->key_width;
+        }
+        i = cache->chain[i];
+    }
+    return NULL;
+}
+
+// Adds the "len" bytes at "in", whose hash is "h", to the cache along with their ciphertext "out".
+// Once the cache is full, the least recently used entry makes way.
+static void cache_add(rsa_cache *cache, uint64_t h, const uint8_t *in, size_t len, const uint8_t *out) {
+    uint32_t i = cache->used;
+    if (cache->used < cache->entries) {
+        cache->used += 1;
+    } else {
+        // Take the oldest entry out of its bucket's chain, and out of the order of use.
+        i = cache->tail;
+        uint32_t *link = &cache->bucket[cache->hash[i] & (cache->buckets - 1)];
+        while (*link != i) {
+            link = &cache->chain[*link];
+        }
+        *link = cache->chain[i];
+        cache_unlink(cache, i);
+    }
+
+    uint8_t *entry = cache->data + i * (cache->key_width + cache->width);
+    memcpy(entry, in, len);
+    memcpy(entry + cache->key_width, out, cache->width);
+    cache->hash[i] = h;
+    cache->len[i] = (uint32_t) len;
+    cache->chain[i] = cache->bucket[h & (cache->buckets - 1)];
+    cache->bucket[h & (cache->buckets - 1)] = i;
+    cache_push(cache, i);
+    return;
+}
+
+// Sets up the parts of a key context shared by public and private keys.
+static void rsa_ctx_setup(rsa_ctx *ctx, mpz_t n, uint64_t threads) {
+    mpz_inits(ctx->n, ctx->e, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    rsa_primes_init(&ctx->x, 2);
+    mpz_set(ctx->n, n);
 
     // Calculate the block size k.
-    k = ((mpz_sizeinbase(n, 2) - 1) / 8);
+    ctx->k = ((mpz_sizeinbase(n, 2) - 1) / 8);
+    ctx->nbytes = mpz_sizeinbase(n, 256);
+
+    // A single thread runs the pipeline stages inline.
+    ctx->threads = threads > 1 ? threads : 0;
+    ctx->workers = threads > 1 ? threads : 1;
+
+    // Working storage for every worker. Each value is allocated large enough for any block up front.
+    ctx->scratch = (rsa_priv_scratch *) calloc(ctx->workers, sizeof(rsa_priv_scratch));
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        rsa_priv_scratch_init(&ctx->scratch[i]);
+        mont_scratch_reserve(&ctx->scratch[i].sc, 8 * ctx->nbytes);
+        mpz_realloc2(ctx->scratch[i].m1, 8 * ctx->nbytes);
+        mpz_realloc2(ctx->scratch[i].m2, 8 * ctx->nbytes);
+        mpz_realloc2(ctx->scratch[i].h, 16 * ctx->nbytes);
+    }
+    ctx->m = (mpz_t *) calloc(ctx->workers, sizeof(mpz_t));
+    ctx->c = (mpz_t *) calloc(ctx->workers, sizeof(mpz_t));
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        mpz_init2(ctx->m[i], 8 * ctx->nbytes);
+        mpz_init2(ctx->c[i], 8 * ctx->nbytes);
+    }
+
+    // Pipeline slots big enough for a hexstring line (two digits per byte of n,
+    // a newline, and the terminating null) in either direction.
+    ctx->nslots = pipeline_slot_count(ctx->threads);
+    ctx->slots = (pipeline_slot *) calloc(ctx->nslots, sizeof(pipeline_slot));
+    pipeline_slots_init(ctx->slots, ctx->nslots, 2 * ctx->nbytes + 2, 2 * ctx->nbytes + 2);
+
+    // Counters start at zero, with timing and compression off.
+    ctx->timing = false;
+    ctx->compress = false;
+    ctx->cache = NULL;
+    memset(&ctx->stats, 0, sizeof(rsa_stats));
+    ctx->ws = (rsa_stats *) calloc(ctx->workers, sizeof(rsa_stats));
+
+    ctx->mont = mpz_odd_p(n);
+    ctx->priv = false;
+    return;
+}
+
+// Loads the public key <e, n> into a key context for encryption.
+// "threads" worker threads are used for files; 1 or 0 keeps everything on the calling thread.
+void rsa_ctx_init_pub(rsa_ctx *ctx, mpz_t n, mpz_t e, uint64_t threads) {
+    rsa_ctx_setup(ctx, n, threads);
+    mpz_set(ctx->e, e);
+
+    // The public exponent is recoded once, so each block is a bare Montgomery exponentiation.
+    if (ctx->mont) {
+        mont_init(&ctx->mn, ctx->n);
+        mont_recode(&ctx->re, ctx->e);
+    }
+    return;
+}
+
+// Loads the private key into a key context for decryption.
+// If p is 0 (an older private key file), "d" is used in place of the CRT components.
+// "x" holds the extra primes of a multi-prime key, or is NULL for a two-prime key.
+// "threads" worker threads are used for files; 1 or 0 keeps everything on the calling thread.
+void rsa_ctx_init_priv(rsa_ctx *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_primes *x, uint64_t threads) {
+    rsa_ctx_setup(ctx, n, threads);
+    mpz_set(ctx->d, d);
+    mpz_set(ctx->p, p);
+    mpz_set(ctx->q, q);
+    mpz_set(ctx->dp, dp);
+    mpz_set(ctx->dq, dq);
+    mpz_set(ctx->qinv, qinv);
+    for (uint64_t i = 0; x != NULL && i + 2 < x->count; i += 1) {
+        mpz_set(ctx->x.r[i], x->r[i]);
+        mpz_set(ctx->x.d[i], x->d[i]);
+        mpz_set(ctx->x.t[i], x->t[i]);
+    }
+    ctx->x.count = x != NULL ? x->count : 2;
+    ctx->priv = true;
+
+    // The private-key state points at the context's own copies.
+    rsa_priv_init(&ctx->engine, ctx->n, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv,
+        &ctx->x);
+    return;
+}
+
+// Gives each worker of a public key context a cache of the ciphertexts of its last "entries" blocks, or
+// takes the caches away if "entries" is 0. Blocks found in the cache are written out without being encrypted
+// again, and the hits and misses are counted in the context's stats. Each cache takes "entries" x (2 x nbytes)
+// bytes or so.
+void rsa_ctx_cache(rsa_ctx *ctx, uint64_t entries) {
+    if (ctx->cache != NULL) {
+        for (uint64_t i = 0; i < ctx->workers; i += 1) {
+            cache_clear(&ctx->cache[i]);
+        }
+        free(ctx->cache);
+        ctx->cache = NULL;
+    }
+    if (entries == 0 || ctx->k < 2) {
+        return;
+    }
+    // Entries are numbered in 32 bits, with twice as many buckets.
+    if (entries > UINT32_MAX / 2) {
+        entries = UINT32_MAX / 2;
+    }
+    ctx->cache = (rsa_cache *) calloc(ctx->workers, sizeof(rsa_cache));
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        cache_init(&ctx->cache[i], (uint32_t) entries, ctx->k - 1, ctx->nbytes);
+    }
+    return;
+}
+
+// Frees the memory held by a key context.
+void rsa_ctx_clear(rsa_ctx *ctx) {
+    if (ctx->priv) {
+        rsa_priv_clear(&ctx->engine);
+    } else if (ctx->mont) {
+        mont_clear(&ctx->mn);
+        mont_recoding_clear(&ctx->re);
+    }
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        rsa_priv_scratch_clear(&ctx->scratch[i]);
+    }
+    for (uint64_t i = 0; i < ctx->workers; i += 1) {
+        mpz_clears(ctx->m[i], ctx->c[i], NULL);
+    }
+    pipeline_slots_clear(ctx->slots, ctx->nslots);
+    free(ctx->scratch);
+    free(ctx->ws);
+    free(ctx->m);
+    free(ctx->c);
+    free(ctx->slots);
+    mpz_clears(ctx->n, ctx->e, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    rsa_primes_clear(&ctx->x);
+    rsa_ctx_cache(ctx, 0);
+    return;
+}
+
+// Encrypts "m" with a public key context, using the working storage of "worker", and stores the ciphertext in "c".
+// The result is exactly that of rsa_encrypt().
+void rsa_ctx_encrypt(rsa_ctx *ctx, uint64_t worker, mpz_t c, mpz_t m) {
+    if (!ctx->mont) {
+        rsa_encrypt(c, m, ctx->e, ctx->n);
+        return;
+    }
+    mont_pow_recoded(&ctx->mn, &ctx->scratch[worker].sc, c, m, &ctx->re);
+    return;
+}
+
+// Decrypts "c" with a private key context, using the working storage of "worker", and stores the message in "m".
+// The result is exactly that of rsa_decrypt_crt() (or rsa_decrypt() without the CRT components).
+void rsa_ctx_decrypt(rsa_ctx *ctx, uint64_t worker, mpz_t m, mpz_t c) {
+    rsa_decrypt_priv(&ctx->engine, &ctx->scratch[worker], m, c);
+    return;
+}
+
+// Reader stage of file encryption: reads up to k - 1 bytes per block.
+// Mirrors the original serial loop, including its final short (possibly empty) block.
+// Input in memory isn't copied: the slot borrows the block's bytes, and the worker adds the 0xFF itself.
+static bool encrypt_read(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    size_t len = job->ctx->k - 1;
+    double t0 = stats_clock(job->ctx);
+    if (job->pack != NULL) {
+        // Compressed input is cut into blocks the same way, as it comes out of the compressor.
+        if (job->packed) {
+            return false;
+        }
+        slot->src = NULL;
+        slot->in[0] = 0xFF;
+        slot->in_len = job_pull(job, slot->in + 1, len) + 1;
+        job->packed = slot->in_len - 1 < len;
+        job->io.read_time += stats_clock(job->ctx) - t0;
+        return true;
+    }
+    if (job_eof(job)) {
+        return false;
+    }
+    if (job->infile == NULL) {
+        if (len > job->in_len - job->in_pos) {
+            len = job->in_len - job->in_pos;
+            job->in_eof = true;
+        }
+        slot->src = job->in + job->in_pos;
+        slot->in_len = len + 1;
+        job->in_pos += len;
+        job->io.bytes_in += len;
+    } else {
+        slot->src = NULL;
+        slot->in[0] = 0xFF;
+        slot->in_len = job_read(job, slot->in + 1, len) + 1;
+    }
+    job->io.read_time += stats_clock(job->ctx) - t0;
+    return true;
+}
+
+// Encrypts the block holding the "len" bytes at "in" after its leading 0xFF, with the working storage of
+// "worker", and exports the ciphertext into "out" nbytes wide. With a cache, a block the worker has
+// encrypted recently is copied from there instead.
+static void encrypt_block(rsa_ctx *ctx, uint64_t worker, const uint8_t *in, size_t len, uint8_t *out) {
+    rsa_cache *cache = ctx->cache != NULL ? &ctx->cache[worker] : NULL;
+    rsa_stats *ws = &ctx->ws[worker];
+    mpz_ptr m = ctx->m[worker];
+    mpz_ptr c = ctx->c[worker];
+    uint64_t h = 0;
+    double t0 = stats_clock(ctx);
+
+    ws->blocks += 1;
+    if (cache != NULL) {
+        h = block_hash(in, len);
+        const uint8_t *hit = cache_find(cache, h, in, len);
+        if (hit != NULL) {
+            memcpy(out, hit, ctx->nbytes);
+            ws->cache_hits += 1;
+            ws->parse_time += stats_clock(ctx) - t0;
+            return;
+        }
+        ws->cache_misses += 1;
+    }
+
+    // Import the bytes, then set the leading 0xFF byte above them.
+    mpz_import(m, len, 1, sizeof(uint8_t), 1, 0, in);
+    for (size_t b = 0; b < 8; b += 1) {
+        mpz_setbit(m, 8 * len + b);
+    }
+    double t1 = stats_clock(ctx);
+    rsa_ctx_encrypt(ctx, worker, c, m);
+    double t2 = stats_clock(ctx);
+    export_block(out, ctx->nbytes, c);
+    if (cache != NULL) {
+        cache_add(cache, h, in, len, out);
+    }
+    ws->exp_time += t2 - t1;
+    ws->parse_time += (t1 - t0) + (stats_clock(ctx) - t2);
+    return;
+}
+
+// Worker stage of file encryption: encrypts a block and formats it as a hexstring line or a binary block.
+// Borrowed bytes are encrypted from where they are; copied ones follow the 0xFF the reader put in front.
+static void encrypt_work(void *arg, uint64_t worker, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    mpz_ptr c = ctx->c[worker];
+    const uint8_t *in = slot->src != NULL ? slot->src : slot->in + 1;
+
+    encrypt_block(ctx, worker, in, slot->in_len - 1, slot->out);
+    slot->out_len = ctx->nbytes;
+    if (job->format == RSA_FORMAT_HEX) {
+        double t0 = stats_clock(ctx);
+        mpz_import(c, ctx->nbytes, 1, sizeof(uint8_t), 1, 0, slot->out);
+        mpz_get_str((char *) slot->out, 16, c);
+        slot->out_len = strlen((char *) slot->out);
+        slot->out[slot->out_len] = '\n';
+        slot->out_len += 1;
+        ctx->ws[worker].parse_time += stats_clock(ctx) - t0;
+    }
+    return;
+}
+
+// Writer stage of file encryption and decryption.
+static void file_write(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    double t0 = stats_clock(job->ctx);
+    job_put(job, slot->out, slot->out_len);
+    job->io.write_time += stats_clock(job->ctx) - t0;
+    return;
+}
+
+// Writer stage of indexed encryption: writes a block like file_write(), recording an index entry
+// for the first of every RSA_INDEX_STRIDE blocks.
+static void index_write(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    if (job->blocks % RSA_INDEX_STRIDE == 0) {
+        if (job->entries == job->index_cap) {
+            job->index_cap = job->index_cap > 0 ? 2 * job->index_cap : 1024;
+            job->index = (uint64_t *) realloc(job->index, 2 * job->index_cap * sizeof(uint64_t));
+        }
+        job->index[2 * job->entries] = job->plain_pos;
+        job->index[2 * job->entries + 1] = job->file_pos;
+        job->entries += 1;
+    }
+    job->blocks += 1;
+    job->plain_pos += slot->in_len - 1;
+    job->file_pos += slot->out_len;
+    file_write(arg, slot);
+    return;
+}
+
+// Writes the block index and trailer of the indexed format after the last block.
+static void index_finish(file_job *job) {
+    uint8_t buf[RSA_INDEX_TRAILER_SIZE];
+    for (uint64_t i = 0; i < job->entries; i += 1) {
+        be_put(buf, job->index[2 * i], 8);
+        be_put(buf + 8, job->index[2 * i + 1], 8);
+        job_write(job, buf, RSA_INDEX_ENTRY_SIZE);
+    }
+    be_put(buf, job->file_pos, 8);
+    be_put(buf + 8, job->entries, 8);
+    be_put(buf + 16, job->plain_pos, 8);
+    be_put(buf + 24, RSA_INDEX_STRIDE, 4);
+    memcpy(buf + 28, RSA_INDEX_MAGIC, 4);
+    job_write(job, buf, RSA_INDEX_TRAILER_SIZE);
+    return;
+}
+
+// Runs the rest of the job's input through ChaCha20 to its output, compressing or decompressing it on the way.
+// Between two buffers, uncompressed data is encrypted straight from one into the other.
+static void hybrid_stream(file_job *job, chacha20_ctx *cc) {
+    rsa_ctx *ctx = job->ctx;
+    double t0 = stats_clock(ctx);
+    double t1 = 0;
+    size_t j = 0;
+
+    if (job->infile == NULL && job->outfile == NULL && job->pack == NULL && job->unpack == NULL) {
+        j = job->in_len - job->in_pos;
+        if (j > job->out_cap - job->out_len) {
+            job->overflow = true;
+            return;
+        }
+        chacha20_xor(cc, job->out + job->out_len, job->in + job->in_pos, j);
+        job->in_pos += j;
+        job->out_len += j;
+        job->io.bytes_in += j;
+        job->io.bytes_out += j;
+        job->io.stream_time += stats_clock(ctx) - t0;
+        return;
+    }
+
+    // Input in memory is encrypted from where it is, rather than copied into the chunk first.
+    uint8_t *buf = (uint8_t *) malloc(HYBRID_CHUNK);
+    while (true) {
+        const uint8_t *src = buf;
+        if (job->infile == NULL && job->pack == NULL) {
+            src = job->in + job->in_pos;
+            j = job->in_len - job->in_pos < HYBRID_CHUNK ? job->in_len - job->in_pos : HYBRID_CHUNK;
+            job->in_pos += j;
+            job->io.bytes_in += j;
+        } else {
+            j = job_pull(job, buf, HYBRID_CHUNK);
+        }
+        if (j == 0) {
+            break;
+        }
+        t1 = stats_clock(ctx);
+        job->io.read_time += t1 - t0;
+        chacha20_xor(cc, buf, src, j);
+        t0 = stats_clock(ctx);
+        job->io.stream_time += t0 - t1;
+        job_put(job, buf, j);
+        t1 = stats_clock(ctx);
+        job->io.write_time += t1 - t0;
+        t0 = t1;
+    }
+
+    // Freeing of allocated memory.
+    free(buf);
+    return;
+}
+
+// Hybrid encryption: wraps a fresh ChaCha20 key and nonce with RSA, then streams the input through ChaCha20.
+// The secret is split over as many RSA blocks as it takes, k - 1 bytes per block after the usual 0xFF.
+// Returns false if the system random source fails.
+static bool encrypt_hybrid(file_job *job) {
+    rsa_ctx *ctx = job->ctx;
+    uint8_t secret[HYBRID_SECRET];
+    uint8_t head[RSA_HEADER_SIZE];
+    uint8_t *block = ctx->slots[0].in;
+    uint8_t *cblock = ctx->slots[0].out;
+    chacha20_ctx cc;
+
+    if (getrandom(secret, sizeof(secret), 0) != (ssize_t) sizeof(secret)) {
+        return false;
+    }
+
+    rsa_header hdr = { .version = job->pack != NULL ? 5 : 2,
+        .flags = RSA_FLAG_HYBRID | (job->pack != NULL ? RSA_FLAG_COMPRESSED : 0),
+        .bits = (uint32_t) mpz_sizeinbase(ctx->n, 2),
+        .block_bytes = (uint32_t) ctx->nbytes };
+    header_pack(head, &hdr);
+    job_write(job, head, RSA_HEADER_SIZE);
 
-    // Dynamically allocate an array that can hold k bytes.
-    // Set the 0th byte to 0xFF.
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
-    block[0] = 0xFF;
+    // Wrap the secret.
+    for (size_t off = 0; off < HYBRID_SECRET; off += ctx->k - 1) {
+        size_t len = HYBRID_SECRET - off < ctx->k - 1 ? HYBRID_SECRET - off : ctx->k - 1;
+        block[0] = 0xFF;
+        memcpy(block + 1, secret + off, len);
+        mpz_import(ctx->m[0], len + 1, 1, sizeof(uint8_t), 1, 0, block);
+        double t0 = stats_clock(ctx);
+        rsa_ctx_encrypt(ctx, 0, ctx->c[0], ctx->m[0]);
+        ctx->ws[0].exp_time += stats_clock(ctx) - t0;
+        ctx->ws[0].blocks += 1;
+        export_block(cblock, ctx->nbytes, ctx->c[0]);
+        job_write(job, cblock, ctx->nbytes);
+    }
+
+    // Stream the data.
+    chacha20_init(&cc, secret, secret + CHACHA20_KEY_SIZE, 0);
+    hybrid_stream(job, &cc);
+
+    // Clearing of the session key.
+    memset(secret, 0, sizeof(secret));
+    memset(&cc, 0, sizeof(cc));
+    return true;
+}
+
+// Encrypts the job's input with a public key context, in the job's format.
+// Returns false without writing anything if the key is too small to carry any bytes.
+static bool encrypt_job(file_job *job) {
+    rsa_ctx *ctx = job->ctx;
+    uint8_t head[RSA_HEADER_SIZE];
+    bool ok = true;
+
+    // A block carries k - 1 bytes after its 0xFF, so a smaller key would never get through the input.
+    if (ctx->k < 2) {
+        return false;
+    }
+
+    // The binary and hybrid formats can compress the data first; the header has to say so.
+    if (ctx->compress && (job->format == RSA_FORMAT_BIN || job->format == RSA_FORMAT_HYBRID)) {
+        job->pack = (lz_stream *) malloc(sizeof(lz_stream));
+        lz_init(job->pack);
+    }
+
+    if (job->format == RSA_FORMAT_HYBRID) {
+        ok = encrypt_hybrid(job);
+        job_finish(job);
+        free(job->pack);
+        return ok;
+    }
+
+    if (job->format == RSA_FORMAT_BIN || job->format == RSA_FORMAT_INDEXED) {
+        bool indexed = job->format == RSA_FORMAT_INDEXED;
+        rsa_header hdr = { .version = indexed ? 3 : (job->pack != NULL ? 5 : 1),
+            .flags = indexed ? RSA_FLAG_INDEXED : (job->pack != NULL ? RSA_FLAG_COMPRESSED : 0),
+            .bits = (uint32_t) mpz_sizeinbase(ctx->n, 2),
+            .block_bytes = (uint32_t) ctx->nbytes };
+        header_pack(head, &hdr);
+        job_write(job, head, RSA_HEADER_SIZE);
+    }
 
-    // While we haven't reached EOF, read in k bytes at a time, import them into an mpz_t, encrypt the mpz_t, then print to the outfile.
-    while (!feof(infile)) {
-        j = fread(block + 1, sizeof(uint8_t), k - 1, infile);
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
-        rsa_encrypt(c, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+    if (job->format == RSA_FORMAT_INDEXED) {
+        job->file_pos = RSA_HEADER_SIZE;
+        pipeline_run_slots(ctx->threads, ctx->slots, encrypt_read, encrypt_work, index_write, job);
+        index_finish(job);
+        free(job->index);
+    } else {
+        pipeline_run_slots(ctx->threads, ctx->slots, encrypt_read, encrypt_work, file_write, job);
     }
+    job_finish(job);
 
     // Freeing of allocated memory.
-    free(block);
-    mpz_clears(m, c, NULL);
+    free(job->pack);
+    return ok;
+}
+
+// Encrypts an infile in k byte blocks with a public key context.
+// In the binary format, a header is written first and every block is exactly as wide as n in bytes.
+// The indexed format is the binary format followed by a block index (see RSA_INDEX_STRIDE).
+// With more than one thread, blocks are encrypted in parallel and written out in their original order.
+// The hybrid format only uses RSA for the session key, and encrypts the data itself with ChaCha20.
+// With ctx->compress set, the binary and hybrid formats compress the data a chunk at a time before
+// encrypting it, so there are fewer blocks to encrypt; the other formats leave it as it is.
+// Returns false if the key is too small to carry any bytes, the hybrid format couldn't get a session key,
+// or the outfile couldn't be written.
+bool rsa_encrypt_file(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_format format) {
+    file_job job = { .infile = infile, .outfile = outfile, .format = format, .ctx = ctx };
+    job_open(&job);
+    bool ok = encrypt_job(&job);
+    ok = job_close(&job) && ok;
+    return ok;
+}
+
+// Reads the next line of the job's input into slot->in as a record, leaving out the newline.
+// A last line without a newline is marked with RECORD_SLOT_OPEN.
+// Returns false if the input has no more lines.
+static bool read_line_record(file_job *job, pipeline_slot *slot) {
+    size_t start = slot->in_len;
+    size_t len = 0;
+    bool open = false;
+    int ch = 0;
+
+    if (job->infile == NULL) {
+        // Input in memory: find the end of the line and copy it in one go.
+        const uint8_t *line = job->in + job->in_pos;
+        size_t rest = job->in_len - job->in_pos;
+        if (rest == 0) {
+            job->in_eof = true;
+            return false;
+        }
+        const uint8_t *nl = (const uint8_t *) memchr(line, '\n', rest);
+        len = nl != NULL ? (size_t) (nl - line) : rest;
+        open = nl == NULL;
+        buf_reserve(&slot->in, &slot->in_cap, start, RECORD_SLOT_PREFIX + len);
+        memcpy(slot->in + start + RECORD_SLOT_PREFIX, line, len);
+        job->in_pos += nl != NULL ? len + 1 : len;
+        job->io.bytes_in += nl != NULL ? len + 1 : len;
+    } else {
+        buf_reserve(&slot->in, &slot->in_cap, start, RECORD_SLOT_PREFIX);
+        slot->in_len += RECORD_SLOT_PREFIX;
+        while ((ch = job_getc(job)) != EOF && ch != '\n') {
+            buf_reserve(&slot->in, &slot->in_cap, slot->in_len, 1);
+            slot->in[slot->in_len] = (uint8_t) ch;
+            slot->in_len += 1;
+        }
+        len = slot->in_len - start - RECORD_SLOT_PREFIX;
+        if (ch == EOF && len == 0) {
+            slot->in_len = start;
+            return false;
+        }
+        open = ch == EOF;
+    }
+    be_put(slot->in + start, len | (open ? RECORD_SLOT_OPEN : 0), RECORD_SLOT_PREFIX);
+    slot->in_len = start + RECORD_SLOT_PREFIX + len;
+    return true;
+}
+
+// Reads the next length-prefixed record of the job's input into slot->in.
+// Returns false at the end of the input, setting job->truncated if it ends inside a record.
+static bool read_len_record(file_job *job, pipeline_slot *slot) {
+    uint8_t prefix[RSA_RECORD_COUNT_SIZE];
+    size_t start = slot->in_len;
+    size_t got = job_read(job, prefix, RSA_RECORD_COUNT_SIZE);
+
+    if (got != RSA_RECORD_COUNT_SIZE) {
+        job->truncated = got > 0;
+        return false;
+    }
+    uint64_t left = be_get(prefix, RSA_RECORD_COUNT_SIZE);
+    buf_reserve(&slot->in, &slot->in_cap, start, RECORD_SLOT_PREFIX);
+    be_put(slot->in + start, left, RECORD_SLOT_PREFIX);
+    slot->in_len += RECORD_SLOT_PREFIX;
+    while (left > 0) {
+        size_t want = left < RECORD_CHUNK ? left : RECORD_CHUNK;
+        buf_reserve(&slot->in, &slot->in_cap, slot->in_len, want);
+        got = job_read(job, slot->in + slot->in_len, want);
+        slot->in_len += got;
+        left -= got;
+        if (got < want) {
+            job->truncated = true;
+            slot->in_len = start;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reader stage of records encryption: packs whole records into the slot until it holds RECORD_BATCH of them,
+// or RECORD_BATCH blocks' worth of bytes.
+static bool records_encrypt_read(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    double t0 = stats_clock(ctx);
+    slot->src = NULL;
+    slot->in_len = 0;
+    slot->items = 0;
+    while (slot->items < RECORD_BATCH && slot->in_len < RECORD_BATCH * (ctx->k - 1) && !job->truncated
+           && (job->records == RSA_RECORDS_LEN ? read_len_record(job, slot)
+                                               : read_line_record(job, slot))) {
+        slot->items += 1;
+    }
+    job->io.read_time += stats_clock(ctx) - t0;
+    return slot->items > 0;
+}
+
+// Worker stage of records encryption: encrypts each record of the slot k - 1 bytes per block,
+// and formats it as its block count (marked with RSA_RECORD_OPEN for an open last line) followed by the blocks.
+static void records_encrypt_work(void *arg, uint64_t worker, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    const uint8_t *in = slot->in;
+    size_t chunk = ctx->k - 1;
+
+    slot->out_len = 0;
+    for (uint64_t r = 0; r < slot->items; r += 1) {
+        uint64_t len = be_get(in, RECORD_SLOT_PREFIX);
+        bool open = len & RECORD_SLOT_OPEN;
+        len &= ~RECORD_SLOT_OPEN;
+        uint64_t blocks = (len + chunk - 1) / chunk;
+        in += RECORD_SLOT_PREFIX;
+        buf_reserve(&slot->out, &slot->out_cap, slot->out_len,
+            RSA_RECORD_COUNT_SIZE + blocks * ctx->nbytes);
+        be_put(slot->out + slot->out_len, blocks | (open ? RSA_RECORD_OPEN : 0), RSA_RECORD_COUNT_SIZE);
+        slot->out_len += RSA_RECORD_COUNT_SIZE;
+
+        for (uint64_t b = 0; b < blocks; b += 1) {
+            size_t j = len - b * chunk < chunk ? len - b * chunk : chunk;
+            encrypt_block(ctx, worker, in, j, slot->out + slot->out_len);
+            slot->out_len += ctx->nbytes;
+            in += j;
+        }
+    }
     return;
 }
 
+// Encrypts an infile record by record with a public key context, in the records format (see RSA_RECORD_COUNT_SIZE).
+// Records are gathered into batches that are encrypted in parallel with more than one thread, and written
+// out in their original order.
+// Returns false if the key is too small to carry any bytes, length-prefixed input ends inside a record
+// (the records before it are still written), or the outfile couldn't be written.
+bool rsa_encrypt_records(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_records records) {
+    file_job job = { .infile = infile, .outfile = outfile, .format = RSA_FORMAT_BIN, .ctx = ctx,
+        .records = records };
+    uint8_t head[RSA_HEADER_SIZE];
+    rsa_header hdr = { .version = 4,
+        .flags = RSA_FLAG_RECORDS | (records == RSA_RECORDS_LEN ? RSA_FLAG_LENGTH : 0),
+        .bits = (uint32_t) mpz_sizeinbase(ctx->n, 2),
+        .block_bytes = (uint32_t) ctx->nbytes };
+
+    if (ctx->k < 2) {
+        return false;
+    }
+    job_open(&job);
+    header_pack(head, &hdr);
+    job_write(&job, head, RSA_HEADER_SIZE);
+    pipeline_run_slots(ctx->threads, ctx->slots, records_encrypt_read, records_encrypt_work, file_write, &job);
+    job_finish(&job);
+    bool ok = job_close(&job);
+    return ok && !job.truncated;
+}
+
+// Returns the number of RSA blocks the hybrid format uses to wrap its session secret.
+static size_t hybrid_blocks(const rsa_ctx *ctx) {
+    return (HYBRID_SECRET + ctx->k - 2) / (ctx->k - 1);
+}
+
+// Returns the most bytes rsa_encrypt_buffer() can write when encrypting "len" bytes in "format".
+// The size is exact for the binary and hybrid formats, unless compressed; hexstrings without leading zeros
+// can come out shorter.
+// Returns 0 if the key is too small to carry any message bytes.
+size_t rsa_encrypt_size(const rsa_ctx *ctx, size_t len, rsa_format format) {
+    // Like the file path, the input is always followed by one final short (possibly empty) block.
+    size_t blocks = 0;
+    if (ctx->k < 2) {
+        return 0;
+    }
+
+    // Compressed data can't come out longer than every chunk stored as is, in a frame of its own.
+    if (ctx->compress && (format == RSA_FORMAT_BIN || format == RSA_FORMAT_HYBRID)) {
+        len += (len + LZ_CHUNK - 1) / LZ_CHUNK * LZ_FRAME_HEADER;
+    }
+    blocks = len / (ctx->k - 1) + 1;
+
+    switch (format) {
+    case RSA_FORMAT_HEX: return blocks * (2 * ctx->nbytes + 1);
+    case RSA_FORMAT_BIN: return RSA_HEADER_SIZE + blocks * ctx->nbytes;
+    case RSA_FORMAT_HYBRID: return RSA_HEADER_SIZE + hybrid_blocks(ctx) * ctx->nbytes + len;
+    case RSA_FORMAT_INDEXED:
+        return RSA_HEADER_SIZE + blocks * ctx->nbytes
+            + (blocks + RSA_INDEX_STRIDE - 1) / RSA_INDEX_STRIDE * RSA_INDEX_ENTRY_SIZE
+            + RSA_INDEX_TRAILER_SIZE;
+    }
+    return 0;
+}
+
+// Encrypts the "len" bytes at "in" into the caller's buffer "out" of "cap" bytes, and stores the number
+// of bytes written in "out_len". The output is byte for byte what rsa_encrypt_file() writes.
+// Nothing touches the global random state; a context serves one call at a time, and separate contexts
+// can be used from separate threads at once.
+// Returns false if the output didn't fit (see rsa_encrypt_size()), the key is too small to carry any bytes,
+// or the hybrid format couldn't get a session key.
+bool rsa_encrypt_buffer(rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap,
+    size_t *out_len, rsa_format format) {
+    file_job job = { .in = in, .in_len = len, .out = out, .out_cap = cap, .format = format, .ctx = ctx };
+    bool ok = encrypt_job(&job);
+    *out_len = job.out_len;
+    return ok && !job.overflow;
+}
+
 // Decrypts a ciphertext "c" by taking "c" to the power of private exponent "d" mod "n".
 // Stores the message in "m".
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
@@ -149,31 +1582,878 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     return;
 }
 
-// Decrypts an infile in k byte blocks.
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    uint64_t k = 0;
-    uint64_t j = 0;
-    mpz_t m, c;
+// Decrypts a ciphertext "c" using the Chinese Remainder Theorem.
+// Two half-size exponentiations mod "p" and "q" are recombined with Garner's formula:
+// m = m2 + q * (qinv * (m1 - m2) mod p).
+// For a multi-prime key "x", each extra prime r with exponent d and coefficient t is then folded in the same way:
+// m = m + R * (t * (c^d mod r - m) mod r), where R is the product of the primes before r.
+// Stores the message in "m".
+void rsa_decrypt_crt(
+    mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x) {
+    mpz_t m1, m2, h, prod;
+    mpz_inits(m1, m2, h, prod, NULL);
+
+    // m1 = c^dp mod p
+    mpz_mod(m1, c, p);
+    pow_mod(m1, m1, dp, p);
 
-    mpz_inits(m, c, NULL);
+    // m2 = c^dq mod q
+    mpz_mod(m2, c, q);
+    pow_mod(m2, m2, dq, q);
 
-    // Calculate the block size k.
-    k = ((mpz_sizeinbase(n, 2) - 1) / 8);
+    // h = qinv x (m1 - m2) mod p
+    mpz_sub(h, m1, m2);
+    mpz_mul(h, h, qinv);
+    mpz_mod(h, h, p);
 
-    // Dynamically allocate an array that can hold k bytes.
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    // m = m2 + h x q
+    mpz_mul(h, h, q);
+    mpz_add(m2, m2, h);
 
-    // While we haven't reached EOF, scan in hexstrings from infile, decrypt them, export them as bytes into block, then write them to the outfile.
-    while (!feof(infile)) {
-        gmp_fscanf(infile, "%Zx\n", c);
-        rsa_decrypt(m, c, d, n);
-        mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, m);
-        fwrite(block + 1, sizeof(uint8_t), j - 1, outfile);
+    // Fold in the extra primes one at a time.
+    mpz_mul(prod, p, q);
+    for (uint64_t i = 0; x != NULL && i + 2 < x->count; i += 1) {
+        mpz_mod(m1, c, x->r[i]);
+        pow_mod(m1, m1, x->d[i], x->r[i]);
+        mpz_sub(h, m1, m2);
+        mpz_mul(h, h, x->t[i]);
+        mpz_mod(h, h, x->r[i]);
+        mpz_mul(h, h, prod);
+        mpz_add(m2, m2, h);
+        mpz_mul(prod, prod, x->r[i]);
     }
+    mpz_set(m, m2);
 
     // Freeing of allocated memory.
-    free(block);
-    mpz_clears(m, c, NULL);
+    mpz_clears(m1, m2, h, prod, NULL);
+    return;
+}
+
+// Sets up the private-key state shared by every decryption with a key.
+// Montgomery contexts for the moduli and the recoded private exponents are computed once here
+// instead of once per block.
+// "x" holds the extra primes of a multi-prime key, or is NULL. The CRT components are only used if the
+// primes multiply out to n, so a multi-prime key loaded without its extra primes still decrypts with "d".
+void rsa_priv_init(rsa_priv *pk, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_primes *x) {
+    pk->crt = mpz_sgn(p) != 0;
+    pk->n = n;
+    pk->d = d;
+    pk->p = p;
+    pk->q = q;
+    pk->dp = dp;
+    pk->dq = dq;
+    pk->qinv = qinv;
+    pk->x = x != NULL && x->count > 2 ? x : NULL;
+
+    // prod[i] is the product of the primes before extra prime i; the last product has to be n.
+    uint64_t extra = pk->x != NULL ? pk->x->count - 2 : 0;
+    mpz_t all;
+    mpz_init(all);
+    mpz_mul(all, p, q);
+    for (uint64_t i = 0; i < extra; i += 1) {
+        mpz_init_set(pk->prod[i], all);
+        mpz_mul(all, all, pk->x->r[i]);
+    }
+    pk->crt = pk->crt && mpz_cmp(all, n) == 0;
+    mpz_clear(all);
+
+    // Montgomery reduction needs odd moduli; anything else falls back to the per-block routines.
+    pk->odd = pk->crt ? (mpz_odd_p(p) && mpz_odd_p(q)) : mpz_odd_p(n);
+    for (uint64_t i = 0; pk->crt && i < extra; i += 1) {
+        pk->odd = pk->odd && mpz_odd_p(pk->x->r[i]);
+    }
+    if (!pk->odd) {
+        return;
+    }
+
+    if (pk->crt) {
+        mont_init(&pk->mp, p);
+        mont_init(&pk->mq, q);
+        mont_recode(&pk->rp, dp);
+        mont_recode(&pk->rq, dq);
+        for (uint64_t i = 0; i < extra; i += 1) {
+            mont_init(&pk->mr[i], pk->x->r[i]);
+            mont_recode(&pk->rr[i], pk->x->d[i]);
+        }
+    } else {
+        mont_init(&pk->mn, n);
+        mont_recode(&pk->rd, d);
+    }
+    return;
+}
+
+// Frees the memory held by private-key state.
+void rsa_priv_clear(rsa_priv *pk) {
+    uint64_t extra = pk->x != NULL ? pk->x->count - 2 : 0;
+    for (uint64_t i = 0; i < extra; i += 1) {
+        mpz_clear(pk->prod[i]);
+    }
+    if (!pk->odd) {
+        return;
+    }
+    if (pk->crt) {
+        mont_clear(&pk->mp);
+        mont_clear(&pk->mq);
+        mont_recoding_clear(&pk->rp);
+        mont_recoding_clear(&pk->rq);
+        for (uint64_t i = 0; i < extra; i += 1) {
+            mont_clear(&pk->mr[i]);
+            mont_recoding_clear(&pk->rr[i]);
+        }
+    } else {
+        mont_clear(&pk->mn);
+        mont_recoding_clear(&pk->rd);
+    }
+    return;
+}
+
+// Initializes per-thread working storage for private-key decryption.
+void rsa_priv_scratch_init(rsa_priv_scratch *ps) {
+    mont_scratch_init(&ps->sc);
+    mpz_inits(ps->m1, ps->m2, ps->h, NULL);
+    return;
+}
+
+// Frees per-thread working storage for private-key decryption.
+void rsa_priv_scratch_clear(rsa_priv_scratch *ps) {
+    mont_scratch_clear(&ps->sc);
+    mpz_clears(ps->m1, ps->m2, ps->h, NULL);
+    return;
+}
+
+// Decrypts "c" into "m" with private-key state "pk" and the working storage "ps".
+// The result is exactly that of rsa_decrypt_crt() (or rsa_decrypt() for keys without CRT components).
+void rsa_decrypt_priv(rsa_priv *pk, rsa_priv_scratch *ps, mpz_t m, mpz_t c) {
+    uint64_t extra = pk->x != NULL ? pk->x->count - 2 : 0;
+    if (!pk->odd) {
+        if (pk->crt) {
+            rsa_decrypt_crt(m, c, pk->p, pk->q, pk->dp, pk->dq, pk->qinv, pk->x);
+        } else {
+            rsa_decrypt(m, c, pk->d, pk->n);
+        }
+        return;
+    }
+
+    if (!pk->crt) {
+        mont_pow_recoded(&pk->mn, &ps->sc, m, c, &pk->rd);
+        return;
+    }
+
+    // m1 = c^dp mod p, m2 = c^dq mod q
+    mont_pow_recoded(&pk->mp, &ps->sc, ps->m1, c, &pk->rp);
+    mont_pow_recoded(&pk->mq, &ps->sc, ps->m2, c, &pk->rq);
+
+    // m = m2 + q x (qinv x (m1 - m2) mod p)
+    mpz_sub(ps->h, ps->m1, ps->m2);
+    mpz_mul(ps->h, ps->h, pk->qinv);
+    mpz_mod(ps->h, ps->h, pk->p);
+    mpz_mul(ps->h, ps->h, pk->q);
+    if (extra == 0) {
+        mpz_add(m, ps->m2, ps->h);
+        return;
+    }
+
+    // A multi-prime key keeps the partial result in m2 while each extra prime is folded in:
+    // m = m + prod x (t x (c^d mod r - m) mod r)
+    mpz_add(ps->m2, ps->m2, ps->h);
+    for (uint64_t j = 0; j < extra; j += 1) {
+        mont_pow_recoded(&pk->mr[j], &ps->sc, ps->m1, c, &pk->rr[j]);
+        mpz_sub(ps->h, ps->m1, ps->m2);
+        mpz_mul(ps->h, ps->h, pk->x->t[j]);
+        mpz_mod(ps->h, ps->h, pk->x->r[j]);
+        mpz_mul(ps->h, ps->h, pk->prod[j]);
+        mpz_add(ps->m2, ps->m2, ps->h);
+    }
+    mpz_set(m, ps->m2);
+    return;
+}
+
+// Reads the next hexstring from the job's input, matching gmp_fscanf(infile, "%Zx\n").
+// The digits are appended to slot->in along with a terminating null.
+// Returns false if there were no digits to read.
+static bool read_hex(file_job *job, pipeline_slot *slot) {
+    size_t start = slot->in_len;
+    int ch = 0;
+
+    // Skip leading whitespace, then collect hex digits.
+    while ((ch = job_getc(job)) != EOF && isspace(ch)) {
+    }
+    while (ch != EOF && isxdigit(ch)) {
+        // Leave room for the terminating null.
+        if (slot->in_len + 1 >= slot->in_cap) {
+            slot->in_cap *= 2;
+            slot->in = (uint8_t *) realloc(slot->in, slot->in_cap);
+        }
+        slot->in[slot->in_len] = (uint8_t) ch;
+        slot->in_len += 1;
+        ch = job_getc(job);
+    }
+
+    // Consume trailing whitespace so that EOF is noticed right after the last line.
+    while (ch != EOF && isspace(ch)) {
+        ch = job_getc(job);
+    }
+    if (ch != EOF) {
+        job_ungetc(job, ch);
+    }
+
+    if (slot->in_len == start) {
+        return false;
+    }
+    if (slot->in_len + 1 >= slot->in_cap) {
+        slot->in_cap *= 2;
+        slot->in = (uint8_t *) realloc(slot->in, slot->in_cap);
+    }
+    slot->in[slot->in_len] = '\0';
+    slot->in_len += 1;
+    return true;
+}
+
+// Reader stage of file decryption: reads the next hexstring.
+static bool decrypt_read(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    double t0 = stats_clock(job->ctx);
+    slot->src = NULL;
+    slot->in_len = 0;
+    bool ok = !job_eof(job) && read_hex(job, slot);
+    job->io.read_time += stats_clock(job->ctx) - t0;
+    return ok;
+}
+
+// Reads the next block of an indexed file that can't seek into "buf", for decrypt_read_bin().
+// The index at the end can't be told apart from the blocks until the input runs out, so the input is read
+// ahead and a block is only handed out once enough comes after it to hold the index of a file that long.
+// At the end, the trailer says how many blocks there are, and the read-ahead has to be exactly the blocks
+// left and the index.
+// Returns the bytes read: "nbytes", or 0 at the index. A damaged index or trailer sets job->truncated.
+static size_t held_read(file_job *job, uint8_t *buf, size_t nbytes) {
+    // The blocks so far and the next one, with the index and trailer they need, have to fit in what has been read.
+    uint64_t next = job->blocks + 1;
+    uint64_t need = next * nbytes + (next + RSA_INDEX_STRIDE - 1) / RSA_INDEX_STRIDE * RSA_INDEX_ENTRY_SIZE
+                    + RSA_INDEX_TRAILER_SIZE;
+    while (!job->held_end && job->blocks * nbytes + (job->held_len - job->held_pos) < need) {
+        // Bytes handed out are dropped once there are at least as many of them as are left.
+        if (job->held_pos > 0 && job->held_pos >= job->held_len - job->held_pos) {
+            memmove(job->held, job->held + job->held_pos, job->held_len - job->held_pos);
+            job->held_len -= job->held_pos;
+            job->held_pos = 0;
+        }
+        if (job->held_cap - job->held_len < HELD_CHUNK) {
+            job->held_cap = 2 * job->held_cap + HELD_CHUNK;
+            job->held = (uint8_t *) realloc(job->held, job->held_cap);
+        }
+        size_t got = job_read(job, job->held + job->held_len, HELD_CHUNK);
+        job->held_len += got;
+        if (got > 0) {
+            continue;
+        }
+
+        // The input has run out: the trailer gives the number of blocks and index entries.
+        uint64_t rest = job->held_len - job->held_pos;
+        job->held_end = true;
+        job->blocks_left = 0;
+        if (rest < RSA_INDEX_TRAILER_SIZE
+            || memcmp(job->held + job->held_len - RSA_INDEX_TRAILER_SIZE + 28, RSA_INDEX_MAGIC, 4) != 0) {
+            job->truncated = true;
+            return 0;
+        }
+        const uint8_t *trailer = job->held + job->held_len - RSA_INDEX_TRAILER_SIZE;
+        uint64_t index_off = be_get(trailer, 8);
+        uint64_t entries = be_get(trailer + 8, 8);
+        uint64_t blocks = index_off >= RSA_HEADER_SIZE ? (index_off - RSA_HEADER_SIZE) / nbytes : 0;
+        if (index_off < RSA_HEADER_SIZE || (index_off - RSA_HEADER_SIZE) % nbytes != 0 || blocks < job->blocks
+            || entries > rest / RSA_INDEX_ENTRY_SIZE
+            || rest != (blocks - job->blocks) * nbytes + entries * RSA_INDEX_ENTRY_SIZE + RSA_INDEX_TRAILER_SIZE) {
+            job->truncated = true;
+            return 0;
+        }
+        job->blocks_left = blocks - job->blocks;
+    }
+    if (job->held_end) {
+        if (job->blocks_left == 0) {
+            return 0;
+        }
+        job->blocks_left -= 1;
+    }
+    memcpy(buf, job->held + job->held_pos, nbytes);
+    job->held_pos += nbytes;
+    job->blocks += 1;
+    return nbytes;
+}
+
+// Reader stage of file decryption for the binary format: reads the next fixed-width block.
+// Input that ends partway through a block sets job->truncated.
+static bool decrypt_read_bin(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    size_t nbytes = job->ctx->nbytes;
+    double t0 = stats_clock(job->ctx);
+    slot->in_len = 0;
+    if (job->ranged && job->blocks_left == 0) {
+        return false;
+    }
+
+    // Input in memory isn't copied: the slot borrows the block.
+    size_t got = 0;
+    if (job->infile == NULL) {
+        got = job->in_len - job->in_pos < nbytes ? job->in_len - job->in_pos : nbytes;
+        slot->src = job->in + job->in_pos;
+        job->in_pos += got;
+        job->io.bytes_in += got;
+    } else if (job->held != NULL) {
+        slot->src = NULL;
+        got = held_read(job, slot->in, nbytes);
+    } else {
+        slot->src = NULL;
+        got = job_read(job, slot->in, nbytes);
+    }
+    if (got > 0 && got < nbytes) {
+        job->truncated = true;
+    }
+    if (got == nbytes) {
+        slot->in_len = nbytes;
+        job->blocks_left -= job->ranged ? 1 : 0;
+    }
+    job->io.read_time += stats_clock(job->ctx) - t0;
+    return slot->in_len > 0;
+}
+
+// Worker stage of file decryption: parses and decrypts a block, then exports the message bytes.
+static void decrypt_work(void *arg, uint64_t worker, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    mpz_ptr m = ctx->m[worker];
+    mpz_ptr c = ctx->c[worker];
+    rsa_stats *ws = &ctx->ws[worker];
+    const uint8_t *in = slot->src != NULL ? slot->src : slot->in;
+    size_t j = 0;
+    double t0 = stats_clock(ctx);
+    double t1 = 0;
+    double t2 = 0;
+
+    if (job->format != RSA_FORMAT_HEX) {
+        mpz_import(c, ctx->nbytes, 1, sizeof(uint8_t), 1, 0, in);
+    } else {
+        mpz_set_str(c, (const char *) in, 16);
+    }
+
+    t1 = stats_clock(ctx);
+    rsa_ctx_decrypt(ctx, worker, m, c);
+    t2 = stats_clock(ctx);
+
+    // Drop the leading 0xFF byte that was prepended to the block during encryption.
+    slot->out_len = 0;
+    mpz_export(slot->out, &j, 1, sizeof(uint8_t), 1, 0, m);
+    if (j > 0) {
+        memmove(slot->out, slot->out + 1, j - 1);
+        slot->out_len = j - 1;
+    }
+    ws->blocks += 1;
+    ws->exp_time += t2 - t1;
+    ws->parse_time += (t1 - t0) + (stats_clock(ctx) - t2);
+    return;
+}
+
+// Writer stage of ranged decryption: drops the first "skip" bytes of output, then writes at most "limit" bytes.
+static void range_write(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    double t0 = stats_clock(job->ctx);
+    size_t off = slot->out_len < job->skip ? slot->out_len : job->skip;
+    size_t len = slot->out_len - off;
+    if (len > job->limit) {
+        len = job->limit;
+    }
+    job->skip -= off;
+    job->limit -= len;
+    job_write(job, slot->out + off, len);
+    job->io.write_time += stats_clock(job->ctx) - t0;
+    return;
+}
+
+// Reads entry "i" of the block index that starts at file offset "index_off" into "plain" and "pos".
+// Returns false if it can't be read.
+static bool index_entry(file_job *job, uint64_t index_off, uint64_t i, uint64_t *plain, uint64_t *pos) {
+    uint8_t buf[RSA_INDEX_ENTRY_SIZE];
+    if (!job_read_at(job, index_off + i * RSA_INDEX_ENTRY_SIZE, buf, RSA_INDEX_ENTRY_SIZE)) {
+        return false;
+    }
+    *plain = be_get(buf, 8);
+    *pos = be_get(buf + 8, 8);
+    return true;
+}
+
+// Binary searches the "entries" entries of the block index for the last one whose plaintext offset is
+// at most "target", and stores its number in "found". Entry 0 always starts at plaintext offset 0.
+// Returns false if the index can't be read.
+static bool index_find(
+    file_job *job, uint64_t index_off, uint64_t entries, uint64_t target, uint64_t *found) {
+    uint64_t lo = 0;
+    uint64_t hi = entries;
+    uint64_t plain = 0;
+    uint64_t pos = 0;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (!index_entry(job, index_off, mid, &plain, &pos)) {
+            return false;
+        }
+        if (plain <= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo;
+    return true;
+}
+
+// Decrypts "len" bytes of the plaintext of an indexed file from offset "start", or up to its end.
+// The header and trailer are checked, the index is searched for the blocks that hold the range,
+// and only those blocks are read and decrypted, on the usual pipeline.
+// Returns false if the input can't seek, isn't an indexed file for this key, or its index is damaged.
+static bool decrypt_indexed(file_job *job, uint64_t start, uint64_t len) {
+    rsa_ctx *ctx = job->ctx;
+    uint8_t buf[RSA_INDEX_TRAILER_SIZE];
+    rsa_header hdr;
+    uint64_t size = 0;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t plain = 0;
+    uint64_t next = 0;
+    uint64_t from = 0;
+    uint64_t to = 0;
+
+    if (!job_read_at(job, 0, buf, RSA_HEADER_SIZE) || !header_unpack(buf, &hdr)
+        || !(hdr.flags & RSA_FLAG_INDEXED) || hdr.block_bytes != ctx->nbytes
+        || !job_size(job, &size) || size < RSA_HEADER_SIZE + RSA_INDEX_TRAILER_SIZE
+        || !job_read_at(job, size - RSA_INDEX_TRAILER_SIZE, buf, RSA_INDEX_TRAILER_SIZE)
+        || memcmp(buf + 28, RSA_INDEX_MAGIC, 4) != 0) {
+        return false;
+    }
+    uint64_t index_off = be_get(buf, 8);
+    uint64_t entries = be_get(buf + 8, 8);
+    uint64_t total = be_get(buf + 16, 8);
+    if (entries == 0 || index_off < RSA_HEADER_SIZE || index_off > size - RSA_INDEX_TRAILER_SIZE
+        || entries > (size - RSA_INDEX_TRAILER_SIZE - index_off) / RSA_INDEX_ENTRY_SIZE) {
+        return false;
+    }
+
+    // Clamp the range to the plaintext.
+    if (start >= total || len == 0) {
+        return true;
+    }
+    if (len > total - start) {
+        len = total - start;
+    }
+
+    // The blocks run from the entry holding the first byte up to the entry after the one holding the last byte.
+    if (!index_find(job, index_off, entries, start, &first)
+        || !index_find(job, index_off, entries, start + len - 1, &last)
+        || !index_entry(job, index_off, first, &plain, &from)) {
+        return false;
+    }
+    to = index_off;
+    if (last + 1 < entries && !index_entry(job, index_off, last + 1, &next, &to)) {
+        return false;
+    }
+    if (plain > start || from < RSA_HEADER_SIZE || to < from || (to - from) % ctx->nbytes != 0
+        || !job_seek(job, from)) {
+        return false;
+    }
+
+    job->format = RSA_FORMAT_INDEXED;
+    job->ranged = true;
+    job->blocks_left = (to - from) / ctx->nbytes;
+    job->skip = start - plain;
+    job->limit = len;
+    pipeline_run_slots(ctx->threads, ctx->slots, decrypt_read_bin, decrypt_work, range_write, job);
+    return true;
+}
+
+// Decrypts the whole of an indexed file whose header has been read. A file that can seek goes through
+// decrypt_indexed(), which checks the index first; one that can't, such as a pipe, is read straight through
+// by held_read(), which stops at the index.
+// Returns false if the index or trailer is damaged or cut short.
+static bool decrypt_indexed_stream(file_job *job) {
+    if (job->infile == NULL || fseeko(job->infile, 0, SEEK_CUR) == 0) {
+        return decrypt_indexed(job, 0, UINT64_MAX);
+    }
+    job->format = RSA_FORMAT_INDEXED;
+    job->held_cap = 2 * HELD_CHUNK;
+    job->held = (uint8_t *) malloc(job->held_cap);
+    pipeline_run_slots(job->ctx->threads, job->ctx->slots, decrypt_read_bin, decrypt_work, file_write, job);
+    free(job->held);
+    return !job->truncated;
+}
+
+// Hybrid decryption: unwraps the ChaCha20 key and nonce from the RSA blocks after the header,
+// then streams the rest of the input through ChaCha20.
+// Returns false if the wrapped secret is cut short or doesn't decrypt to the expected layout, as with the wrong key.
+static bool decrypt_hybrid(file_job *job) {
+    rsa_ctx *ctx = job->ctx;
+    uint8_t secret[HYBRID_SECRET];
+    uint8_t *cblock = ctx->slots[0].in;
+    uint8_t *block = ctx->slots[0].out;
+    chacha20_ctx cc;
+    size_t j = 0;
+    bool ok = ctx->k >= 2;
+
+    // Unwrap the secret. Each block has to come back as 0xFF followed by exactly the bytes that were wrapped.
+    for (size_t off = 0; ok && off < HYBRID_SECRET; off += ctx->k - 1) {
+        size_t len = HYBRID_SECRET - off < ctx->k - 1 ? HYBRID_SECRET - off : ctx->k - 1;
+        if (job_read(job, cblock, ctx->nbytes) != ctx->nbytes) {
+            ok = false;
+            break;
+        }
+        mpz_import(ctx->c[0], ctx->nbytes, 1, sizeof(uint8_t), 1, 0, cblock);
+        double t0 = stats_clock(ctx);
+        rsa_ctx_decrypt(ctx, 0, ctx->m[0], ctx->c[0]);
+        ctx->ws[0].exp_time += stats_clock(ctx) - t0;
+        ctx->ws[0].blocks += 1;
+        if (mpz_sizeinbase(ctx->m[0], 256) != len + 1) {
+            ok = false;
+            break;
+        }
+        mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, ctx->m[0]);
+        ok = block[0] == 0xFF;
+        memcpy(secret + off, block + 1, len);
+    }
+    if (!ok) {
+        memset(secret, 0, sizeof(secret));
+        return false;
+    }
+
+    // Stream the data.
+    chacha20_init(&cc, secret, secret + CHACHA20_KEY_SIZE, 0);
+    hybrid_stream(job, &cc);
+
+    // Clearing of the session key.
+    memset(secret, 0, sizeof(secret));
+    memset(&cc, 0, sizeof(cc));
+    return true;
+}
+
+// Decrypts the "count" blocks of a record at "in" with the working storage of "worker", and stores the
+// record's bytes at "out", which needs room for count x nbytes bytes.
+// Returns the length of the record.
+static size_t record_decrypt(rsa_ctx *ctx, uint64_t worker, const uint8_t *in, uint64_t count, uint8_t *out) {
+    mpz_ptr m = ctx->m[worker];
+    mpz_ptr c = ctx->c[worker];
+    rsa_stats *ws = &ctx->ws[worker];
+    size_t len = 0;
+    size_t j = 0;
+
+    for (uint64_t i = 0; i < count; i += 1) {
+        double t0 = stats_clock(ctx);
+        mpz_import(c, ctx->nbytes, 1, sizeof(uint8_t), 1, 0, in);
+        in += ctx->nbytes;
+        double t1 = stats_clock(ctx);
+        rsa_ctx_decrypt(ctx, worker, m, c);
+        double t2 = stats_clock(ctx);
+
+        // Drop the leading 0xFF byte of the block.
+        mpz_export(out + len, &j, 1, sizeof(uint8_t), 1, 0, m);
+        if (j > 0) {
+            memmove(out + len, out + len + 1, j - 1);
+            len += j - 1;
+        }
+        ws->exp_time += t2 - t1;
+        ws->parse_time += (t1 - t0) + (stats_clock(ctx) - t2);
+    }
+    ws->blocks += count;
+    return len;
+}
+
+// Reader stage of records decryption: packs whole records into the slot, each as its block count followed by
+// its blocks, until it holds RECORD_BATCH records or blocks. A record cut short at the end of the input is
+// dropped and sets job->truncated, as a short block does in the binary format.
+static bool records_decrypt_read(void *arg, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    uint8_t prefix[RSA_RECORD_COUNT_SIZE];
+    uint64_t blocks = 0;
+    size_t got = 0;
+    double t0 = stats_clock(ctx);
+
+    slot->src = NULL;
+    slot->in_len = 0;
+    slot->items = 0;
+    while (slot->items < RECORD_BATCH && blocks < RECORD_BATCH
+           && (got = job_read(job, prefix, RSA_RECORD_COUNT_SIZE)) == RSA_RECORD_COUNT_SIZE) {
+        uint64_t count = be_get(prefix, RSA_RECORD_COUNT_SIZE);
+        bool open = count & RSA_RECORD_OPEN;
+        size_t start = slot->in_len;
+        uint64_t i = 0;
+        count &= ~(uint64_t) RSA_RECORD_OPEN;
+        buf_reserve(&slot->in, &slot->in_cap, start, RECORD_SLOT_PREFIX);
+        be_put(slot->in + start, count | (open ? RECORD_SLOT_OPEN : 0), RECORD_SLOT_PREFIX);
+        slot->in_len += RECORD_SLOT_PREFIX;
+
+        // One block at a time, so a damaged count can't allocate past the input.
+        while (i < count) {
+            buf_reserve(&slot->in, &slot->in_cap, slot->in_len, ctx->nbytes);
+            if (job_read(job, slot->in + slot->in_len, ctx->nbytes) != ctx->nbytes) {
+                break;
+            }
+            slot->in_len += ctx->nbytes;
+            i += 1;
+        }
+        if (i < count) {
+            slot->in_len = start;
+            job->truncated = true;
+            break;
+        }
+        slot->items += 1;
+        blocks += count;
+    }
+    if (got > 0 && got < RSA_RECORD_COUNT_SIZE) {
+        job->truncated = true;
+    }
+    job->io.read_time += stats_clock(ctx) - t0;
+    return slot->items > 0;
+}
+
+// Worker stage of records decryption: decrypts each record of the slot and writes it out as a line,
+// or after its length, as job->records asks. A line that had no newline gets none.
+static void records_decrypt_work(void *arg, uint64_t worker, pipeline_slot *slot) {
+    file_job *job = (file_job *) arg;
+    rsa_ctx *ctx = job->ctx;
+    size_t prefix = job->records == RSA_RECORDS_LEN ? RSA_RECORD_COUNT_SIZE : 0;
+    const uint8_t *in = slot->in;
+
+    slot->out_len = 0;
+    for (uint64_t r = 0; r < slot->items; r += 1) {
+        uint64_t count = be_get(in, RECORD_SLOT_PREFIX);
+        bool open = count & RECORD_SLOT_OPEN;
+        count &= ~RECORD_SLOT_OPEN;
+        in += RECORD_SLOT_PREFIX;
+        buf_reserve(&slot->out, &slot->out_cap, slot->out_len, prefix + count * ctx->nbytes + 1);
+        size_t len = record_decrypt(ctx, worker, in, count, slot->out + slot->out_len + prefix);
+        in += count * ctx->nbytes;
+        if (job->records == RSA_RECORDS_LEN) {
+            be_put(slot->out + slot->out_len, len, RSA_RECORD_COUNT_SIZE);
+        } else if (!open) {
+            slot->out[slot->out_len + len] = '\n';
+            len += 1;
+        }
+        slot->out_len += prefix + len;
+    }
+    return;
+}
+
+// Decrypts the records after the header, writing each one out in the job's framing.
+// Returns false if the input ends partway through a record.
+static bool decrypt_records(file_job *job) {
+    pipeline_run_slots(job->ctx->threads, job->ctx->slots, records_decrypt_read, records_decrypt_work,
+        file_write, job);
+    return !job->truncated;
+}
+
+// Decrypts the job's input with a private key context, detecting its format.
+static bool decrypt_job(file_job *job) {
+    rsa_ctx *ctx = job->ctx;
+    uint8_t head[RSA_HEADER_SIZE];
+    bool ok = true;
+    int first = 0;
+
+    // Detect the ciphertext format.
+    first = job_getc(job);
+    if (first != EOF) {
+        job_ungetc(job, first);
+    }
+    job->format = RSA_FORMAT_HEX;
+    if (first == RSA_HEADER_MAGIC[0]) {
+        rsa_header hdr;
+        if (job_read(job, head, RSA_HEADER_SIZE) != RSA_HEADER_SIZE || !header_unpack(head, &hdr)
+            || hdr.block_bytes != ctx->nbytes) {
+            job_finish(job);
+            return false;
+        }
+        if (hdr.flags & RSA_FLAG_COMPRESSED) {
+            job->unpack = (lz_stream *) malloc(sizeof(lz_stream));
+            lz_init(job->unpack);
+        }
+        if (hdr.flags & RSA_FLAG_HYBRID) {
+            ok = decrypt_hybrid(job) && (job->unpack == NULL || lz_finish(job->unpack));
+            job_finish(job);
+            free(job->unpack);
+            return ok;
+        }
+        if (hdr.flags & RSA_FLAG_INDEXED) {
+            ok = decrypt_indexed_stream(job);
+            job_finish(job);
+            return ok;
+        }
+        if (hdr.flags & RSA_FLAG_RECORDS) {
+            job->records = hdr.flags & RSA_FLAG_LENGTH ? RSA_RECORDS_LEN : RSA_RECORDS_LINE;
+            ok = decrypt_records(job);
+            job_finish(job);
+            return ok;
+        }
+        job->format = RSA_FORMAT_BIN;
+    }
+
+    pipeline_run_slots(ctx->threads, ctx->slots,
+        job->format == RSA_FORMAT_BIN ? decrypt_read_bin : decrypt_read, decrypt_work, file_write,
+        job);
+    if (job->unpack != NULL) {
+        ok = lz_finish(job->unpack);
+        free(job->unpack);
+    }
+    job_finish(job);
+    return ok && !job->truncated;
+}
+
+// Decrypts an infile in k byte blocks with a private key context.
+// The ciphertext format is detected from the first byte: binary ciphertext starts with the header magic,
+// which can never begin a hexstring.
+// Blocks are decrypted against the context's precomputed key state. With more than one thread, blocks
+// are decrypted in parallel and written out in their original order.
+// Hybrid, indexed, and records files are recognized by their header flags. Indexed files that can't seek
+// are read to the end before their last blocks come out, and records come out delimited the way they went in. Compressed data is decompressed as it is
+// decrypted, a chunk at a time.
+// Returns false if the binary header is invalid, was written for a different key size,
+// (for the hybrid format) the session key can't be unwrapped, the blocks or compressed data are damaged
+// or cut short, or the outfile couldn't be written.
+bool rsa_decrypt_file(rsa_ctx *ctx, FILE *infile, FILE *outfile) {
+    file_job job = { .infile = infile, .outfile = outfile, .ctx = ctx };
+    job_open(&job);
+    bool ok = decrypt_job(&job);
+    ok = job_close(&job) && ok;
+    return ok;
+}
+
+// Decrypts "len" bytes of the plaintext from offset "start" out of an indexed infile, decrypting only
+// the blocks that hold them. A range that runs past the end of the plaintext stops there, so separate
+// calls (or separate processes) can each take a slice of one file.
+// Returns false if the infile can't seek, isn't in the indexed format for this key, has a damaged index,
+// or the outfile couldn't be written.
+bool rsa_decrypt_range(rsa_ctx *ctx, FILE *infile, FILE *outfile, uint64_t start, uint64_t len) {
+    file_job job = { .infile = infile, .outfile = outfile, .ctx = ctx };
+    job_open(&job);
+    bool ok = decrypt_indexed(&job, start, len);
+    job_finish(&job);
+    ok = job_close(&job) && ok;
+    return ok;
+}
+
+// Decrypts a records infile like rsa_decrypt_file(), but writes the records out as "records" asks
+// whichever way they were delimited when encrypted. Records can be read back one at a time, as each
+// one is written out as soon as it and those before it are decrypted.
+// Returns false if the infile isn't in the records format for this key, is cut short, or the outfile
+// couldn't be written.
+bool rsa_decrypt_records(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_records records) {
+    file_job job = { .infile = infile, .outfile = outfile, .format = RSA_FORMAT_BIN, .ctx = ctx,
+        .records = records };
+    uint8_t head[RSA_HEADER_SIZE];
+    rsa_header hdr;
+
+    job_open(&job);
+    bool ok = job_read(&job, head, RSA_HEADER_SIZE) == RSA_HEADER_SIZE && header_unpack(head, &hdr)
+              && hdr.block_bytes == ctx->nbytes && (hdr.flags & RSA_FLAG_RECORDS);
+    if (ok) {
+        ok = decrypt_records(&job);
+    }
+    job_finish(&job);
+    ok = job_close(&job) && ok;
+    return ok;
+}
+
+// Returns the most bytes rsa_decrypt_buffer() can write when decrypting the "len" bytes at "in".
+// Each block yields fewer bytes than n is wide, even under the wrong key; hybrid data decrypts to its own length.
+// Returns 0 for a binary header that can't be read.
+size_t rsa_decrypt_size(const rsa_ctx *ctx, const uint8_t *in, size_t len) {
+    rsa_header hdr;
+    size_t blocks = 0;
+    size_t ratio = 1;
+
+    if (len > 0 && in[0] == (uint8_t) RSA_HEADER_MAGIC[0]) {
+        if (len < RSA_HEADER_SIZE || !header_unpack(in, &hdr)) {
+            return 0;
+        }
+        len -= RSA_HEADER_SIZE;
+        // Compressed data can decompress to many times its length, up to the codec's limit.
+        ratio = hdr.flags & RSA_FLAG_COMPRESSED ? LZ_RATIO_MAX : 1;
+        if (hdr.flags & RSA_FLAG_HYBRID) {
+            size_t wrapped = ctx->k < 2 ? 0 : hybrid_blocks(ctx) * ctx->nbytes;
+            return len > wrapped ? (len - wrapped) * ratio : 0;
+        }
+        if (hdr.flags & RSA_FLAG_RECORDS) {
+            // A record never comes out longer than its unit, newline or length included.
+            return len;
+        }
+        return len / ctx->nbytes * (ctx->nbytes - 1) * ratio;
+    }
+
+    // Count the hexstrings.
+    for (size_t i = 0; i < len; i += 1) {
+        if (isxdigit(in[i]) && (i == 0 || !isxdigit(in[i - 1]))) {
+            blocks += 1;
+        }
+    }
+    return blocks * (ctx->nbytes - 1);
+}
+
+// Decrypts the "len" bytes at "in" into the caller's buffer "out" of "cap" bytes, and stores the number
+// of bytes written in "out_len". The format is detected as in rsa_decrypt_file(), and the output is the same.
+// Like rsa_encrypt_buffer(), it never touches the global random state and needs one context per concurrent call.
+// Returns false if the output didn't fit (see rsa_decrypt_size()), or for the same errors as rsa_decrypt_file().
+bool rsa_decrypt_buffer(
+    rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len) {
+    file_job job = { .in = in, .in_len = len, .out = out, .out_cap = cap, .ctx = ctx };
+    bool ok = decrypt_job(&job);
+    *out_len = job.out_len;
+    return ok && !job.overflow;
+}
+
+// Decrypts the record unit at the start of the "len" bytes at "in", such as the next record of a records
+// file after its header, into the caller's buffer "out" of "cap" bytes, and stores the record's length in
+// "out_len". Only the record itself is written, with no newline or length. A buffer as long as the unit
+// is always big enough.
+// Returns the number of bytes of "in" the unit takes up, so the caller can move on to the next one,
+// or 0 if the unit is cut short or the record didn't fit.
+size_t rsa_decrypt_record(
+    rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len) {
+    file_job job = { .ctx = ctx };
+    pipeline_slot *slot = &ctx->slots[0];
+
+    if (len < RSA_RECORD_COUNT_SIZE) {
+        return 0;
+    }
+    uint64_t count = be_get(in, RSA_RECORD_COUNT_SIZE) & ~(uint64_t) RSA_RECORD_OPEN;
+    if (count > (len - RSA_RECORD_COUNT_SIZE) / ctx->nbytes) {
+        return 0;
+    }
+
+    // The record is decrypted into the first pipeline slot, and copied over once its length is known.
+    buf_reserve(&slot->out, &slot->out_cap, 0, count * ctx->nbytes);
+    *out_len = record_decrypt(ctx, 0, in + RSA_RECORD_COUNT_SIZE, count, slot->out);
+    job.io.bytes_in = RSA_RECORD_COUNT_SIZE + count * ctx->nbytes;
+    job_finish(&job);
+    if (*out_len > cap) {
+        return 0;
+    }
+    memcpy(out, slot->out, *out_len);
+    ctx->stats.bytes_out += *out_len;
+    return RSA_RECORD_COUNT_SIZE + count * ctx->nbytes;
+}
+
+// Writes a context's counters to "f" as a single line of JSON, for scripts to collect.
+// "wall" is the elapsed time of the whole run in seconds. The throughput is worked out on the plaintext:
+// the bytes read by an encryption, or the bytes written by a decryption.
+void rsa_write_stats(FILE *f, const char *program, rsa_ctx *ctx, double wall) {
+    rsa_stats *st = &ctx->stats;
+    uint64_t plain = ctx->priv ? st->bytes_out : st->bytes_in;
+    uint64_t lookups = st->cache_hits + st->cache_misses;
+    fprintf(f,
+        "{\"program\":\"%s\",\"bits\":%zu,\"threads\":%" PRIu64 ",\"blocks\":%" PRIu64
+        ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+        ",\"wall_s\":%.6f,\"read_s\":%.6f,\"write_s\":%.6f,\"parse_s\":%.6f,\"exp_s\":%.6f"
+        ",\"stream_s\":%.6f,\"cache_hits\":%" PRIu64 ",\"cache_misses\":%" PRIu64
+        ",\"cache_hit_rate\":%.4f,\"mb_per_s\":%.3f}\n",
+        program, mpz_sizeinbase(ctx->n, 2), ctx->workers, st->blocks, st->bytes_in,
+        st->bytes_out, wall, st->read_time, st->write_time, st->parse_time, st->exp_time,
+        st->stream_time, st->cache_hits, st->cache_misses,
+        lookups > 0 ? (double) st->cache_hits / lookups : 0.0, wall > 0 ? plain / wall / 1e6 : 0.0);
     return;
 }
 
@@ -183,11 +2463,19 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     return;
 }
 
+// Performs RSA signing using the Chinese Remainder Theorem components of the private key,
+// including the extra primes of a multi-prime key "x" (NULL for a two-prime key).
+void rsa_sign_crt(
+    mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x) {
+    rsa_decrypt_crt(s, m, p, q, dp, dq, qinv, x);
+    return;
+}
+
 // Performs RSA verification.
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
     mpz_t t;
     mpz_init(t);
-    pow_mod(t, s, e, n);
+    rsa_encrypt(t, s, e, n);
     // If t isn't the same as the expected message m, return false.
     if (mpz_cmp(m, t) != 0) {
         mpz_clear(t);
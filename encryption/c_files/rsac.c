@@ -0,0 +1,219 @@
+#include "rsa.h"
+#include "lz.h"
+#include "proto.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "s:m:i:o:h"
+
+void help_func(void);
+
+// Sends one request and reads its response into "resp".
+// Returns false if the connection failed or the daemon rejected the request.
+static bool call(int fd, uint8_t op, const uint8_t *payload, uint32_t len, uint8_t **resp,
+    uint32_t *resp_len, uint32_t *resp_cap) {
+    uint8_t status = 0;
+    if (!proto_send(fd, op, payload, len) || !proto_recv(fd, &status, resp, resp_len, resp_cap)) {
+        fprintf(stderr, "Error: lost connection to the daemon.\n");
+        return false;
+    }
+    if (status != RSAD_OK) {
+        fprintf(stderr, "Error: the daemon rejected the request.\n");
+        return false;
+    }
+    return true;
+}
+
+// Writes the "len" bytes of a decrypted block to outfile, through the decompressor "lz" if there is one.
+static void put_plain(lz_stream *lz, const uint8_t *buf, size_t len, FILE *outfile) {
+    if (lz == NULL) {
+        fwrite(buf, sizeof(uint8_t), len, outfile);
+        return;
+    }
+    while (len > 0) {
+        size_t used = lz_unpack(lz, buf, len);
+        buf += used;
+        len -= used;
+        if (lz->chunk_len > 0) {
+            fwrite(lz->chunk, sizeof(uint8_t), lz->chunk_len, outfile);
+            lz->chunk_len = 0;
+        }
+    }
+    return;
+}
+
+// Decrypts a hex or binary ciphertext file block by block through the daemon.
+// Compressed binary files are decompressed as the blocks come back, as decrypt does.
+static bool remote_decrypt(int fd, FILE *infile, FILE *outfile) {
+    uint8_t *block = NULL;
+    size_t block_cap = 0;
+    uint8_t *resp = NULL;
+    uint32_t resp_len = 0;
+    uint32_t resp_cap = 0;
+    lz_stream *lz = NULL;
+    bool ok = true;
+    int first = getc(infile);
+    mpz_t c;
+    mpz_init(c);
+
+    if (first != EOF) {
+        ungetc(first, infile);
+    }
+
+    if (first == RSA_HEADER_MAGIC[0]) {
+        // Binary ciphertext: fixed-width blocks after the header, possibly of compressed data. Hybrid,
+        // indexed, and records files hold more than blocks, so they are turned away before any of them is sent.
+        rsa_header hdr;
+        if (!rsa_read_header(infile, &hdr) || (hdr.flags & ~RSA_FLAG_COMPRESSED) != 0) {
+            fprintf(stderr, "Error: invalid or unsupported ciphertext header.\n");
+            mpz_clear(c);
+            return false;
+        }
+        if (hdr.flags & RSA_FLAG_COMPRESSED) {
+            lz = (lz_stream *) malloc(sizeof(lz_stream));
+            lz_init(lz);
+        }
+        block = (uint8_t *) calloc(hdr.block_bytes, sizeof(uint8_t));
+        while (ok && fread(block, sizeof(uint8_t), hdr.block_bytes, infile) == hdr.block_bytes) {
+            ok = call(fd, RSAD_DECRYPT, block, hdr.block_bytes, &resp, &resp_len, &resp_cap);
+            if (ok) {
+                put_plain(lz, resp, resp_len, outfile);
+            }
+        }
+        if (ok && lz != NULL && !lz_finish(lz)) {
+            fprintf(stderr, "Error: damaged compressed data.\n");
+            ok = false;
+        }
+    } else {
+        // Hex ciphertext: one hexstring per line.
+        while (ok && gmp_fscanf(infile, "%Zx\n", c) == 1) {
+            size_t j = mpz_sizeinbase(c, 256);
+            if (j > block_cap) {
+                block_cap = j;
+                block = (uint8_t *) realloc(block, block_cap);
+            }
+            mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, c);
+            ok = call(fd, RSAD_DECRYPT, block, (uint32_t) j, &resp, &resp_len, &resp_cap);
+            if (ok) {
+                put_plain(NULL, resp, resp_len, outfile);
+            }
+        }
+    }
+
+    // Freeing of allocated memory.
+    free(block);
+    free(resp);
+    free(lz);
+    mpz_clear(c);
+    return ok;
+}
+
+// Signs the contents of infile, read as one big-endian number, and writes the signature as a hexstring.
+static bool remote_sign(int fd, FILE *infile, FILE *outfile) {
+    static uint8_t buf[RSAD_MAX_FRAME - 1];
+    uint8_t *resp = NULL;
+    uint32_t resp_len = 0;
+    uint32_t resp_cap = 0;
+    size_t len = fread(buf, sizeof(uint8_t), sizeof(buf), infile);
+    mpz_t s;
+
+    if (!call(fd, RSAD_SIGN, buf, (uint32_t) len, &resp, &resp_len, &resp_cap)) {
+        free(resp);
+        return false;
+    }
+    mpz_init(s);
+    mpz_import(s, resp_len, 1, sizeof(uint8_t), 1, 0, resp);
+    gmp_fprintf(outfile, "%Zx\n", s);
+
+    // Freeing of allocated memory.
+    mpz_clear(s);
+    free(resp);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    char *socket_name = RSAD_SOCKET;
+    char *infile_name = NULL;
+    char *outfile_name = NULL;
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+    uint8_t op = RSAD_DECRYPT;
+    bool ok = false;
+
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        if (opt == '?') {
+            help_func();
+            return 1;
+        }
+        switch (opt) {
+        case 's': socket_name = optarg; break;
+        case 'm':
+            if (strcmp(optarg, "decrypt") == 0) {
+                op = RSAD_DECRYPT;
+            } else if (strcmp(optarg, "sign") == 0) {
+                op = RSAD_SIGN;
+            } else {
+                fprintf(stderr, "Error: unknown mode '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i': infile_name = optarg; break;
+        case 'o': outfile_name = optarg; break;
+        case 'h': help_func(); return 1;
+        }
+    }
+
+    int fd = proto_connect(socket_name);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to connect to the daemon.\n");
+        return 1;
+    }
+
+    if (infile_name != NULL) {
+        infile = fopen(infile_name, "r");
+        if (!infile) {
+            fprintf(stderr, "Error: failed to open infile.\n");
+            close(fd);
+            return 1;
+        }
+    }
+
+    if (outfile_name != NULL) {
+        outfile = fopen(outfile_name, "w");
+        if (!outfile) {
+            fprintf(stderr, "Error: failed to open outfile.\n");
+            fclose(infile);
+            close(fd);
+            return 1;
+        }
+    }
+
+    ok = op == RSAD_SIGN ? remote_sign(fd, infile, outfile) : remote_decrypt(fd, infile, outfile);
+
+    // Closing of files.
+    close(fd);
+    fclose(infile);
+    fclose(outfile);
+    return ok ? 0 : 1;
+}
+
+// Helper function to print out manual page.
+void help_func(void) {
+    printf("SYNOPSIS\n"
+           "  Sends decryption or signing requests to a running rsad.\n\n"
+           "USAGE\n"
+           "  ./rsac [-h] [-s socket] [-m decrypt|sign] [-i infile] [-o outfile]\n\n"
+           "OPTIONS\n"
+           "  -h             Display program help and usage.\n"
+           "  -s socket      Path of the daemon's socket (default: rsad.sock).\n"
+           "  -m mode        decrypt a hex or bin (-z too) ciphertext file, or sign the input (default: decrypt).\n"
+           "  -i infile      Input file (default: stdin).\n"
+           "  -o outfile     Output file (default: stdout).\n");
+    return;
+}
@@ -0,0 +1,373 @@
+#include "rsa.h"
+#include "keyring.h"
+#include "proto.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define OPTIONS "n:K:u:s:t:vh"
+
+// One request waiting for, or being handled by, a worker.
+typedef struct request {
+    uint8_t op;
+    uint8_t status;
+    const uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;      // At least as wide as n.
+    uint32_t out_len;
+    bool done;
+    pthread_cond_t cv; // Signalled when "done" is set.
+    struct request *next;
+} request;
+
+// State shared by the connection threads and the workers.
+typedef struct {
+    rsa_ctx ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // Signalled when a request is queued or the daemon stops.
+    request *head;
+    request *tail;
+    bool stopping;
+} daemon_state;
+
+// Arguments handed to each worker thread.
+typedef struct {
+    daemon_state *ds;
+    uint64_t id;
+} worker_arg;
+
+// Arguments handed to each connection thread.
+typedef struct {
+    daemon_state *ds;
+    int fd;
+} conn_arg;
+
+// Set by the signal handler to shut the daemon down.
+static volatile sig_atomic_t stop_signal = 0;
+
+void help_func(void);
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop_signal = 1;
+}
+
+// Worker: takes the request at the head of the queue and decrypts it with this worker's scratch.
+// Decryption and signing are both c^d mod n; they only differ in how the result is returned.
+static void *worker_main(void *varg) {
+    worker_arg *wa = (worker_arg *) varg;
+    daemon_state *ds = wa->ds;
+    rsa_ctx *ctx = &ds->ctx;
+    mpz_ptr m = ctx->m[wa->id];
+    mpz_ptr c = ctx->c[wa->id];
+
+    for (;;) {
+        pthread_mutex_lock(&ds->lock);
+        while (ds->head == NULL && !ds->stopping) {
+            pthread_cond_wait(&ds->queued, &ds->lock);
+        }
+        request *r = ds->head;
+        if (r == NULL) {
+            pthread_mutex_unlock(&ds->lock);
+            break;
+        }
+        ds->head = r->next;
+        if (ds->head == NULL) {
+            ds->tail = NULL;
+        }
+        pthread_mutex_unlock(&ds->lock);
+
+        // Anything that isn't a number below n is rejected.
+        size_t j = 0;
+        r->status = RSAD_OK;
+        r->out_len = 0;
+        if (r->in_len <= ctx->nbytes && (r->op == RSAD_DECRYPT || r->op == RSAD_SIGN)) {
+            mpz_import(c, r->in_len, 1, sizeof(uint8_t), 1, 0, r->in);
+        }
+        if (r->in_len > ctx->nbytes || (r->op != RSAD_DECRYPT && r->op != RSAD_SIGN)
+            || mpz_cmp(c, ctx->n) >= 0) {
+            r->status = RSAD_BAD_REQUEST;
+        } else if (r->op == RSAD_SIGN) {
+            // The signature is as wide as n, padded with leading zeros.
+            rsa_ctx_decrypt(ctx, wa->id, m, c);
+            size_t width = mpz_sgn(m) ? mpz_sizeinbase(m, 256) : 0;
+            memset(r->out, 0, ctx->nbytes - width);
+            mpz_export(r->out + ctx->nbytes - width, NULL, 1, sizeof(uint8_t), 1, 0, m);
+            r->out_len = (uint32_t) ctx->nbytes;
+        } else {
+            // Drop the leading 0xFF byte that was prepended to the block during encryption.
+            rsa_ctx_decrypt(ctx, wa->id, m, c);
+            mpz_export(r->out, &j, 1, sizeof(uint8_t), 1, 0, m);
+            if (j > 0) {
+                memmove(r->out, r->out + 1, j - 1);
+                r->out_len = (uint32_t) (j - 1);
+            }
+        }
+
+        pthread_mutex_lock(&ds->lock);
+        r->done = true;
+        pthread_cond_signal(&r->cv);
+        pthread_mutex_unlock(&ds->lock);
+    }
+
+    return NULL;
+}
+
+// Connection thread: reads requests off one connection, queues each for the workers, and writes back the response.
+static void *conn_main(void *varg) {
+    conn_arg *ca = (conn_arg *) varg;
+    daemon_state *ds = ca->ds;
+    int fd = ca->fd;
+    uint8_t *payload = NULL;
+    uint32_t len = 0;
+    uint32_t cap = 0;
+    request r = { 0 };
+
+    free(ca);
+    r.out = (uint8_t *) calloc(ds->ctx.nbytes, sizeof(uint8_t));
+    pthread_cond_init(&r.cv, NULL);
+
+    while (proto_recv(fd, &r.op, &payload, &len, &cap)) {
+        r.in = payload;
+        r.in_len = len;
+        r.done = false;
+        r.next = NULL;
+
+        // Queue the request and wait for a worker to finish it.
+        pthread_mutex_lock(&ds->lock);
+        if (ds->stopping) {
+            pthread_mutex_unlock(&ds->lock);
+            break;
+        }
+        if (ds->tail) {
+            ds->tail->next = &r;
+        } else {
+            ds->head = &r;
+        }
+        ds->tail = &r;
+        pthread_cond_signal(&ds->queued);
+        while (!r.done) {
+            pthread_cond_wait(&r.cv, &ds->lock);
+        }
+        pthread_mutex_unlock(&ds->lock);
+
+        if (!proto_send(fd, r.status, r.out, r.out_len)) {
+            break;
+        }
+    }
+
+    // Freeing of allocated memory.
+    close(fd);
+    pthread_cond_destroy(&r.cv);
+    free(r.out);
+    free(payload);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    uint64_t threads = 1;
+    char *privkey_name = "rsa.priv";
+    char *keyring_name = NULL;
+    char *key_name = getenv("USER");
+    char *socket_name = RSAD_SOCKET;
+    FILE *privkey = NULL;
+
+    // The private key, as in decrypt.
+    mpz_t n, d, p, q, dp, dq, qinv;
+    rsa_primes x;
+    mpz_inits(n, d, p, q, dp, dq, qinv, NULL);
+    rsa_primes_init(&x, 2);
+
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        if (opt == '?') {
+            help_func();
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+        switch (opt) {
+        case 'n': privkey_name = optarg; break;
+        case 'K': keyring_name = optarg; break;
+        case 'u': key_name = optarg; break;
+        case 's': socket_name = optarg; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'v': verbose = true; break;
+        case 'h':
+            help_func();
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // Load the private key once, from the keyring or the private key file.
+    if (keyring_name != NULL) {
+        if (key_name == NULL
+            || !keyring_load_priv(keyring_name, key_name, n, d, p, q, dp, dq, qinv)) {
+            fprintf(stderr, "Error: private key not found in keyring.\n");
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+    } else {
+        privkey = fopen(privkey_name, "r");
+        if (!privkey) {
+            fprintf(stderr, "Error: failed to open file.\n");
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+        rsa_read_priv(n, d, p, q, dp, dq, qinv, &x, privkey);
+        fclose(privkey);
+    }
+
+    // Set up the listening socket.
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long.\n");
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_name);
+
+    // A socket left behind by an earlier run is removed, but anything else at the path is left alone.
+    struct stat st;
+    if (lstat(socket_name, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket.\n", socket_name);
+            mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+            rsa_primes_clear(&x);
+            return 1;
+        }
+        unlink(socket_name);
+    } else if (errno != ENOENT) {
+        fprintf(stderr, "Error: failed to check socket path.\n");
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        return 1;
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    // The private key is served, so only the owner may connect. The socket is created without access for
+    // anyone else, rather than changed after the fact, so nobody can connect in between.
+    mode_t old_mask = umask(077);
+    bool bound = lfd >= 0 && bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || chmod(socket_name, 0600) != 0 || listen(lfd, 128) != 0) {
+        fprintf(stderr, "Error: failed to listen on socket.\n");
+        if (lfd >= 0) {
+            close(lfd);
+        }
+        if (bound) {
+            unlink(socket_name);
+        }
+        mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+        rsa_primes_clear(&x);
+        return 1;
+    }
+
+    // Stop on SIGINT or SIGTERM. accept() is interrupted rather than restarted, so the loop notices.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon_state ds = { .head = NULL, .tail = NULL, .stopping = false };
+    rsa_ctx_init_priv(&ds.ctx, n, d, p, q, dp, dq, qinv, &x, threads);
+    pthread_mutex_init(&ds.lock, NULL);
+    pthread_cond_init(&ds.queued, NULL);
+
+    // The context has scratch for one worker when given a single thread.
+    pthread_t *workers = (pthread_t *) calloc(ds.ctx.workers, sizeof(pthread_t));
+    worker_arg *wargs = (worker_arg *) calloc(ds.ctx.workers, sizeof(worker_arg));
+    for (uint64_t i = 0; i < ds.ctx.workers; i += 1) {
+        wargs[i].ds = &ds;
+        wargs[i].id = i;
+        pthread_create(&workers[i], NULL, worker_main, &wargs[i]);
+    }
+
+    if (verbose) {
+        fprintf(stderr, "rsad: listening on %s (%zu bit key, %" PRIu64 " workers)\n", socket_name,
+            mpz_sizeinbase(n, 2), ds.ctx.workers);
+    }
+
+    // Accept connections until told to stop; each gets its own thread.
+    while (!stop_signal) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        conn_arg *ca = (conn_arg *) malloc(sizeof(conn_arg));
+        ca->ds = &ds;
+        ca->fd = fd;
+        pthread_t t;
+        if (pthread_create(&t, NULL, conn_main, ca) != 0) {
+            close(fd);
+            free(ca);
+            continue;
+        }
+        pthread_detach(t);
+    }
+
+    // Stop the workers once the queue drains.
+    pthread_mutex_lock(&ds.lock);
+    ds.stopping = true;
+    pthread_cond_broadcast(&ds.queued);
+    pthread_mutex_unlock(&ds.lock);
+    for (uint64_t i = 0; i < ds.ctx.workers; i += 1) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Freeing of allocated memory.
+    // Connection threads may still be blocked reading, so the shared state is left for the process exit.
+    close(lfd);
+    unlink(socket_name);
+    free(workers);
+    free(wargs);
+    mpz_clears(n, d, p, q, dp, dq, qinv, NULL);
+    rsa_primes_clear(&x);
+    return 0;
+}
+
+// Helper function to print out manual page.
+void help_func(void) {
+    printf("SYNOPSIS\n"
+           "  Serves RSA decryption and signing requests over a Unix domain socket.\n"
+           "  The private key is loaded once and shared by a pool of worker threads.\n\n"
+           "USAGE\n"
+           "  ./rsad [-hv] [-s socket] [-t threads] -n privkey | -K keyring [-u name]\n\n"
+           "OPTIONS\n"
+           "  -h             Display program help and usage.\n"
+           "  -v             Display verbose program output.\n"
+           "  -n pvfile      Private key file (default: rsa.priv).\n"
+           "  -K keyring     Look the private key up in a binary keyring instead of a key file.\n"
+           "  -u name        Name of the key in the keyring (default: $USER).\n"
+           "  -s socket      Path of the socket to listen on (default: rsad.sock). A socket already there is\n"
+           "                 replaced; rsad won't start if anything else is.\n"
+           "  -t threads     Worker threads (default: 1).\n");
+    return;
+}
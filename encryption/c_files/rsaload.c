@@ -0,0 +1,230 @@
+#include "rsa.h"
+#include "randstate.h"
+#include "proto.h"
+
+#include <stdio.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define OPTIONS "s:n:c:r:m:h"
+
+// Distinct requests prepared up front and sent round robin.
+#define LOAD_POOL 64
+
+// Requests prepared for the run, with the responses expected for decryption.
+typedef struct {
+    uint8_t op;
+    size_t nbytes;
+    uint8_t *payload[LOAD_POOL]; // nbytes wide.
+    uint8_t *expect[LOAD_POOL];  // The k - 1 message bytes behind each ciphertext.
+    size_t expect_len;
+} load_plan;
+
+// Per-connection results.
+typedef struct {
+    load_plan *plan;
+    const char *socket_name;
+    uint64_t requests;
+    double *lat;
+    uint64_t done;
+    uint64_t errors;
+} load_arg;
+
+void help_func(void);
+
+// Returns the current time in seconds.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Orders latencies for the percentile calculation.
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// One client connection: sends its requests one after another and times each round trip.
+static void *load_main(void *varg) {
+    load_arg *la = (load_arg *) varg;
+    load_plan *plan = la->plan;
+    uint8_t *resp = NULL;
+    uint32_t resp_len = 0;
+    uint32_t resp_cap = 0;
+    uint8_t status = 0;
+
+    int fd = proto_connect(la->socket_name);
+    if (fd < 0) {
+        la->errors = la->requests;
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < la->requests; i += 1) {
+        uint64_t pick = i % LOAD_POOL;
+        double t0 = now();
+        if (!proto_send(fd, plan->op, plan->payload[pick], (uint32_t) plan->nbytes)
+            || !proto_recv(fd, &status, &resp, &resp_len, &resp_cap)) {
+            la->errors += la->requests - i;
+            break;
+        }
+        la->lat[la->done] = now() - t0;
+        la->done += 1;
+
+        // Decryptions are checked against the messages that were encrypted.
+        if (status != RSAD_OK
+            || (plan->op == RSAD_DECRYPT
+                && (resp_len != plan->expect_len
+                    || memcmp(resp, plan->expect[pick], resp_len) != 0))) {
+            la->errors += 1;
+        }
+    }
+
+    // Freeing of allocated memory.
+    close(fd);
+    free(resp);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char *socket_name = RSAD_SOCKET;
+    char *pubkey_name = "rsa.pub";
+    char username[1024];
+    uint64_t conns = 4;
+    uint64_t requests = 1000;
+    load_plan plan = { .op = RSAD_DECRYPT };
+    FILE *pubkey = NULL;
+
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        if (opt == '?') {
+            help_func();
+            return 1;
+        }
+        switch (opt) {
+        case 's': socket_name = optarg; break;
+        case 'n': pubkey_name = optarg; break;
+        case 'c': conns = strtoul(optarg, NULL, 10); break;
+        case 'r': requests = strtoul(optarg, NULL, 10); break;
+        case 'm':
+            if (strcmp(optarg, "decrypt") == 0) {
+                plan.op = RSAD_DECRYPT;
+            } else if (strcmp(optarg, "sign") == 0) {
+                plan.op = RSAD_SIGN;
+            } else {
+                fprintf(stderr, "Error: unknown mode '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h': help_func(); return 1;
+        }
+    }
+    if (conns < 1) {
+        conns = 1;
+    }
+
+    // The public key is only needed to make valid requests.
+    pubkey = fopen(pubkey_name, "r");
+    if (!pubkey) {
+        fprintf(stderr, "Error: failed to open file.\n");
+        return 1;
+    }
+
+    mpz_t n, e, s, m, c;
+    mpz_inits(n, e, s, m, c, NULL);
+    rsa_read_pub(n, e, s, username, pubkey);
+    fclose(pubkey);
+
+    // Prepare full-size blocks the way encrypt does: 0xFF followed by k - 1 random bytes.
+    // Signing requests reuse the same numbers, which are all below n.
+    uint64_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    plan.nbytes = mpz_sizeinbase(n, 256);
+    plan.expect_len = k - 1;
+    randstate_init(RAND_MT, 2022);
+    for (int i = 0; i < LOAD_POOL; i += 1) {
+        uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+        size_t count = 0;
+        block[0] = 0xFF;
+        rand_bytes(&state, block + 1, k - 1);
+        mpz_import(m, k, 1, sizeof(uint8_t), 1, 0, block);
+        rsa_encrypt(c, m, e, n);
+
+        plan.expect[i] = (uint8_t *) calloc(k, sizeof(uint8_t));
+        memcpy(plan.expect[i], block + 1, k - 1);
+        plan.payload[i] = (uint8_t *) calloc(plan.nbytes, sizeof(uint8_t));
+        count = (mpz_sizeinbase(c, 2) + 7) / 8;
+        mpz_export(plan.payload[i] + plan.nbytes - count, NULL, 1, sizeof(uint8_t), 1, 0, c);
+        free(block);
+    }
+    randstate_clear();
+
+    // Run every connection at once.
+    pthread_t *threads = (pthread_t *) calloc(conns, sizeof(pthread_t));
+    load_arg *args = (load_arg *) calloc(conns, sizeof(load_arg));
+    double start = now();
+    for (uint64_t i = 0; i < conns; i += 1) {
+        args[i].plan = &plan;
+        args[i].socket_name = socket_name;
+        args[i].requests = requests;
+        args[i].lat = (double *) calloc(requests, sizeof(double));
+        pthread_create(&threads[i], NULL, load_main, &args[i]);
+    }
+    for (uint64_t i = 0; i < conns; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Merge the latencies and report.
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    double *lat = (double *) calloc(conns * requests + 1, sizeof(double));
+    for (uint64_t i = 0; i < conns; i += 1) {
+        memcpy(lat + total, args[i].lat, args[i].done * sizeof(double));
+        total += args[i].done;
+        errors += args[i].errors;
+    }
+    qsort(lat, total, sizeof(double), cmp_double);
+    printf("requests %" PRIu64 ", errors %" PRIu64 ", %.3f s, %.1f requests/sec\n", total, errors,
+        elapsed, total / elapsed);
+    if (total > 0) {
+        printf("latency (us): p50 %.1f, p90 %.1f, p99 %.1f\n", lat[(total - 1) * 50 / 100] * 1e6,
+            lat[(total - 1) * 90 / 100] * 1e6, lat[(total - 1) * 99 / 100] * 1e6);
+    }
+
+    // Freeing of allocated memory.
+    for (uint64_t i = 0; i < conns; i += 1) {
+        free(args[i].lat);
+    }
+    for (int i = 0; i < LOAD_POOL; i += 1) {
+        free(plan.payload[i]);
+        free(plan.expect[i]);
+    }
+    free(lat);
+    free(args);
+    free(threads);
+    mpz_clears(n, e, s, m, c, NULL);
+    return errors == 0 ? 0 : 1;
+}
+
+// Helper function to print out manual page.
+void help_func(void) {
+    printf("SYNOPSIS\n"
+           "  Measures the request rate and latency of a running rsad.\n\n"
+           "USAGE\n"
+           "  ./rsaload [-h] [-s socket] [-c connections] [-r requests] [-m decrypt|sign] -n pubkey\n\n"
+           "OPTIONS\n"
+           "  -h             Display program help and usage.\n"
+           "  -s socket      Path of the daemon's socket (default: rsad.sock).\n"
+           "  -n pbfile      Public key matching the daemon's private key (default: rsa.pub).\n"
+           "  -c count       Concurrent connections (default: 4).\n"
+           "  -r count       Requests sent on each connection (default: 1000).\n"
+           "  -m mode        Request type, decrypt or sign (default: decrypt).\n");
+    return;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE   32
+#define CHACHA20_NONCE_SIZE 12
+#define CHACHA20_BLOCK_SIZE 64
+
+// State of a ChaCha20 keystream (RFC 8439): a 256 bit key, a 96 bit nonce, and a 32 bit block counter.
+typedef struct {
+    uint32_t input[16];                      // Constants, key, counter, and nonce.
+    uint8_t stream[CHACHA20_BLOCK_SIZE];     // Keystream of the current block.
+    size_t used;                             // Bytes of "stream" already used.
+} chacha20_ctx;
+
+void chacha20_init(chacha20_ctx *cc, const uint8_t key[CHACHA20_KEY_SIZE],
+    const uint8_t nonce[CHACHA20_NONCE_SIZE], uint32_t counter);
+
+void chacha20_xor(chacha20_ctx *cc, uint8_t *out, const uint8_t *in, size_t len);
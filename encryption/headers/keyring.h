@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// Binary keyring layout. Multi-byte fields are big-endian.
+//   Header (32 bytes): magic "RSAK" (4), version (1), reserved (3), key count (4),
+//   bucket count (4), reserved (16).
+//   Index: one 4 byte slot per bucket holding entry number + 1, or 0 for an empty bucket.
+//   Entries (KEYRING_ENTRY_SIZE bytes each): name (64, null-padded), name hash (8), flags (4),
+//   bits of n (4), bytes of n (4), block size k (4), data offset (8), and the byte length of each field (4 each).
+//   Data: each entry's fields back to back as big-endian numbers, in keyring_field order.
+#define KEYRING_MAGIC      "RSAK"
+#define KEYRING_VERSION    1
+#define KEYRING_HEADER     32
+#define KEYRING_NAME_MAX   64
+#define KEYRING_ENTRY_SIZE 144
+
+// Entry flags.
+#define KEYRING_VERIFIED 0x1 // The signature "s" was checked against the name when the key was added.
+#define KEYRING_PRIVATE  0x2 // The private fields are present.
+
+// Fields stored for every key. Private fields are empty for public-only entries.
+typedef enum {
+    KEYRING_N,
+    KEYRING_E,
+    KEYRING_S,
+    KEYRING_D,
+    KEYRING_P,
+    KEYRING_Q,
+    KEYRING_DP,
+    KEYRING_DQ,
+    KEYRING_QINV,
+    KEYRING_FIELDS
+} keyring_field;
+
+// A keyring mapped read-only into memory.
+typedef struct {
+    const uint8_t *map;
+    size_t size;
+    uint32_t count;
+    uint32_t buckets;
+} keyring;
+
+// A key found in a keyring. "data" points into the mapping, so it is only valid while the keyring is open.
+typedef struct {
+    char name[KEYRING_NAME_MAX];
+    uint32_t flags;
+    uint32_t bits;   // Bits in n.
+    uint32_t nbytes; // Bytes in n.
+    uint32_t k;      // Block size in bytes.
+    const uint8_t *data[KEYRING_FIELDS];
+    uint32_t len[KEYRING_FIELDS];
+} keyring_entry;
+
+bool keyring_open(keyring *kr, const char *path);
+
+void keyring_close(keyring *kr);
+
+bool keyring_find(keyring *kr, const char *name, keyring_entry *ke);
+
+void keyring_get(keyring_entry *ke, keyring_field field, mpz_t v);
+
+bool keyring_add(const char *path, const char *name, uint32_t flags, mpz_t n, mpz_t e, mpz_t s,
+    mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv);
+
+bool keyring_load_pub(const char *path, const char *name, mpz_t n, mpz_t e, mpz_t s,
+    bool *verified);
+
+bool keyring_load_priv(const char *path, const char *name, mpz_t n, mpz_t d, mpz_t p, mpz_t q,
+    mpz_t dp, mpz_t dq, mpz_t qinv);
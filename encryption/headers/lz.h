@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Most bytes compressed together. Streams are compressed a chunk at a time, so memory use doesn't grow
+// with their length, and every match offset fits in 16 bits.
+#define LZ_CHUNK (1 << 16)
+
+// Each chunk of a stream is written as a frame: its length in bytes (LZ_FRAME_HEADER bytes, big-endian),
+// with LZ_STORED set if the chunk didn't compress and is stored as is, followed by the chunk.
+#define LZ_FRAME_HEADER 4
+#define LZ_FRAME_MAX    (LZ_FRAME_HEADER + LZ_CHUNK)
+#define LZ_STORED       0x80000000u
+
+// No frame decompresses to more than LZ_RATIO_MAX times its own length.
+#define LZ_RATIO_MAX 256
+
+// Bits of the hash of each 4 byte sequence used to look for matches.
+#define LZ_HASH_BITS 14
+
+// State of a compressed stream in either direction.
+// Compression hands out the frame of one chunk at a time; decompression gathers a frame from whatever pieces
+// of the stream it is given, and decompresses it into "chunk" once it is whole.
+typedef struct {
+    uint32_t table[1 << LZ_HASH_BITS]; // Position (plus one) each hashed sequence was last seen at.
+    uint8_t frame[LZ_FRAME_MAX];       // The current frame.
+    size_t frame_len;                  // Length of the frame, once its header is in.
+    size_t frame_pos;                  // Bytes of the frame handed out or gathered so far.
+    uint8_t chunk[LZ_CHUNK];           // The last chunk decompressed.
+    size_t chunk_len;                  // Bytes in "chunk" waiting to be written out.
+    bool damaged;                      // Set once decompression meets a frame that isn't valid.
+} lz_stream;
+
+size_t lz_compress(uint32_t table[], const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+
+bool lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len);
+
+void lz_init(lz_stream *lz);
+
+void lz_pack(lz_stream *lz, const uint8_t *in, size_t len);
+
+size_t lz_unpack(lz_stream *lz, const uint8_t *in, size_t len);
+
+bool lz_finish(lz_stream *lz);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <gmp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest sliding window used by mont_pow(); the odd-power table holds 2^(w - 1) entries.
+#define MONT_MAX_WINDOW 7
+
+// An exponent recoded once into sliding windows, so that it can be reused for many bases.
+// Window i squares the accumulator shift[i] times, then multiplies it by a^value[i] (value[i] is odd, or 0 for none).
+typedef struct {
+    uint64_t w;       // Window width the table has to cover.
+    uint64_t count;   // Number of windows.
+    uint32_t *value;  // Odd window values; the first one seeds the accumulator.
+    uint32_t *shift;  // Squarings before each window's multiplication.
+} mont_recoding;
+
+// Largest modulus, in limbs, with a fixed-size kernel (4096 bits with 64-bit limbs).
+#define MONT_FIXED_MAX_LIMBS 64
+
+// A fixed-size exponentiation kernel: computes a^e mod n on plain limb arrays as long as n, with all of its
+// working storage on the stack. The exponent is the recoding "r", or "d" if "r" is NULL.
+typedef void (*mont_fixed_fn)(const mp_limb_t *np, const mp_limb_t *r2, mp_limb_t ninv, mp_limb_t *op,
+    const mp_limb_t *ap, const mont_recoding *r, mpz_srcptr d);
+
+// Constants for Montgomery arithmetic modulo an odd "n", with R = 2^(GMP_NUMB_BITS x limbs).
+// A context is read-only once initialized, so it can be shared between threads.
+typedef struct {
+    mpz_t n;             // The odd modulus.
+    mpz_t r2;            // R^2 mod n, used to move values into Montgomery form.
+    mpz_t one;           // R mod n, the Montgomery form of 1.
+    mp_limb_t ninv;      // -n^-1 mod 2^GMP_NUMB_BITS.
+    mp_size_t limbs;     // Number of limbs in n.
+    mp_limb_t *r2p;      // r2 padded to exactly "limbs" limbs, for the fixed-size kernel.
+    mont_fixed_fn fixed; // Fixed-size kernel for this many limbs, or NULL to use the mpz routines.
+} mont_ctx;
+
+// Working storage for Montgomery operations. Each thread needs its own.
+typedef struct {
+    mpz_t t;                                 // Double-width product awaiting reduction.
+    mpz_t acc;                               // Running accumulator for exponentiation.
+    mpz_t table[1 << (MONT_MAX_WINDOW - 1)]; // Odd powers a^1, a^3, ..., a^(2^w - 1).
+} mont_scratch;
+
+void mont_init(mont_ctx *ctx, mpz_t n);
+
+void mont_clear(mont_ctx *ctx);
+
+void mont_scratch_init(mont_scratch *sc);
+
+void mont_scratch_reserve(mont_scratch *sc, uint64_t bits);
+
+void mont_scratch_clear(mont_scratch *sc);
+
+uint64_t mont_window_bits(uint64_t ebits);
+
+void mont_to(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a);
+
+void mont_from(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a);
+
+void mont_mul(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t b);
+
+void mont_sqr(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a);
+
+void mont_exp(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t d);
+
+void mont_pow(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mpz_t d);
+
+void mont_recode(mont_recoding *r, mpz_t d);
+
+void mont_recoding_clear(mont_recoding *r);
+
+void mont_exp_recoded(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mont_recoding *r);
+
+void mont_pow_recoded(mont_ctx *ctx, mont_scratch *sc, mpz_t o, mpz_t a, mont_recoding *r);
+
+#ifdef __cplusplus
+}
+#endif
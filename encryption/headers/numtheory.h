@@ -4,6 +4,28 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "randstate.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counters kept by the prime search and modular exponentiation, summed over all threads.
+typedef struct {
+    uint64_t candidates;    // Numbers drawn or stepped to as possible primes.
+    uint64_t size_rejects;  // Candidates thrown away for having the wrong number of bits.
+    uint64_t sieve_rejects; // Candidates with a factor below the sieve limit.
+    uint64_t mr_rejects;    // Candidates the primality test found composite.
+    uint64_t mr_rounds;     // Miller-Rabin rounds run, including the base 2 round of Baillie-PSW.
+    uint64_t lucas_tests;   // Strong Lucas tests run by Baillie-PSW.
+    uint64_t pow_mod_calls; // Calls to pow_mod() and pow_mod_ui().
+} numtheory_stats;
+
+// Primality tests the prime search can use.
+typedef enum {
+    PRIME_TEST_MR,   // Miller-Rabin with random bases, as in is_prime().
+    PRIME_TEST_BPSW, // Baillie-PSW, as in is_prime_bpsw().
+} prime_test;
 
 void gcd(mpz_t g, mpz_t a, mpz_t b);
 
@@ -11,6 +33,23 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
 
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
+void pow_mod_ui(mpz_t o, mpz_t a, uint64_t d, mpz_t n);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+bool is_prime_r(mpz_t n, uint64_t iters, rand_state *rs);
+
+bool is_prime_bpsw(mpz_t n, uint64_t iters, rand_state *rs);
+
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, prime_test test);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, rand_state *rs);
+
+void make_primes_parallel(mpz_ptr primes[], uint64_t bits[], uint64_t count, uint64_t iters,
+    prime_test test, uint64_t threads);
+
+void numtheory_stats_get(numtheory_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
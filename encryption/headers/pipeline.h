@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One unit of work moving through the pipeline.
+// The reader fills "in", a worker turns it into "out", and the writer drains "out".
+typedef struct {
+    uint8_t *in;        // Input bytes for this block.
+    const uint8_t *src; // Input borrowed in place of "in" (such as part of a mapped file), or NULL.
+    size_t in_len;      // Number of valid bytes in "in", or at "src".
+    size_t in_cap;      // Allocated size of "in".
+    uint8_t *out;       // Output bytes for this block.
+    size_t out_len;     // Number of valid bytes in "out".
+    size_t out_cap;     // Allocated size of "out".
+    uint64_t items;     // Number of records packed into "in", for callbacks that pack more than one.
+    uint64_t seq;       // Position of this block in the stream.
+    int status;         // Internal slot status.
+} pipeline_slot;
+
+// Fills a slot with the next block. Returns false once there is no more input.
+typedef bool (*pipeline_read_fn)(void *arg, pipeline_slot *slot);
+
+// Processes a filled slot. "worker" identifies the calling thread in [0, threads).
+typedef void (*pipeline_work_fn)(void *arg, uint64_t worker, pipeline_slot *slot);
+
+// Writes out a processed slot. Slots are handed over strictly in input order.
+typedef void (*pipeline_write_fn)(void *arg, pipeline_slot *slot);
+
+uint64_t pipeline_slot_count(uint64_t threads);
+
+void pipeline_slots_init(pipeline_slot *slots, uint64_t count, size_t in_cap, size_t out_cap);
+
+void pipeline_slots_clear(pipeline_slot *slots, uint64_t count);
+
+void pipeline_run_slots(uint64_t threads, pipeline_slot *slots, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg);
+
+void pipeline_run(uint64_t threads, size_t in_cap, size_t out_cap, pipeline_read_fn read,
+    pipeline_work_fn work, pipeline_write_fn write, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire protocol between rsad and its clients, over a Unix domain stream socket.
+// Every message is a frame: a big-endian 4 byte length, then that many bytes, made up of a one byte code
+// and the payload. Requests carry an operation code, and responses carry a status code.
+//   RSAD_DECRYPT: the payload is one ciphertext block as a big-endian number. The response holds the
+//                 message bytes of the block, without the leading 0xFF added by encryption.
+//   RSAD_SIGN:    the payload is a big-endian number below n. The response holds the signature, as wide as n.
+// A client may send its next request as soon as it has read the response to the last one.
+#define RSAD_SOCKET "rsad.sock"
+
+// Largest frame either side accepts.
+#define RSAD_MAX_FRAME (1 << 20)
+
+// Request operations.
+enum { RSAD_DECRYPT = 1, RSAD_SIGN = 2 };
+
+// Response statuses.
+enum { RSAD_OK = 0, RSAD_BAD_REQUEST = 1 };
+
+bool proto_read_full(int fd, void *buf, size_t len);
+
+bool proto_write_full(int fd, const void *buf, size_t len);
+
+bool proto_send(int fd, uint8_t code, const uint8_t *payload, uint32_t len);
+
+bool proto_recv(int fd, uint8_t *code, uint8_t **payload, uint32_t *len, uint32_t *cap);
+
+int proto_connect(const char *path);
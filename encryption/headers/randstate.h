@@ -1,10 +1,63 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <gmp.h>
+#include "chacha20.h"
 
-extern gmp_randstate_t state;
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-void randstate_init(uint64_t seed);
+// Generators a random state can draw from.
+typedef enum {
+    RAND_CHACHA, // ChaCha20 keystream, rekeyed from its own output after every buffer (fast key erasure).
+    RAND_MT,     // GMP's Mersenne Twister, the generator older versions used.
+} rand_backend;
+
+// Bytes of ChaCha20 keystream made at a time; the first CHACHA20_KEY_SIZE become the next key.
+#define RAND_BUFFER 1024
+
+// Bytes of seed material handed from one random state to another with rand_draw_seed().
+#define RAND_SEED_SIZE CHACHA20_KEY_SIZE
+
+// A source of random numbers. Each thread needs its own; rand_draw_seed() and rand_init_seed() make
+// one per worker from a parent state, so a fixed seed gives the same numbers with any number of threads.
+typedef struct {
+    rand_backend backend;
+    gmp_randstate_t mt;                                   // The Mersenne Twister, for RAND_MT.
+    uint8_t key[CHACHA20_KEY_SIZE];                       // Key for the next buffer, for RAND_CHACHA.
+    uint8_t buf[RAND_BUFFER] __attribute__((aligned(8))); // Keystream waiting to be handed out.
+    size_t pos;                                           // Bytes of "buf" already used.
+} rand_state;
+
+extern rand_state state;
+
+void rand_init(rand_state *rs, rand_backend backend, uint64_t seed);
+
+bool rand_init_os(rand_state *rs, rand_backend backend);
+
+void rand_draw_seed(rand_state *rs, uint8_t seed[RAND_SEED_SIZE]);
+
+void rand_init_seed(rand_state *rs, rand_backend backend, const uint8_t seed[RAND_SEED_SIZE]);
+
+void rand_clear(rand_state *rs);
+
+void rand_bytes(rand_state *rs, uint8_t *buf, size_t len);
+
+uint64_t rand_bits(rand_state *rs, uint64_t bits);
+
+void rand_urandomb(mpz_t o, rand_state *rs, uint64_t bits);
+
+void rand_urandomm(mpz_t o, rand_state *rs, mpz_t n);
+
+void randstate_init(rand_backend backend, uint64_t seed);
+
+bool randstate_init_os(rand_backend backend);
 
 void randstate_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
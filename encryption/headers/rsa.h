@@ -4,27 +4,260 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "montgomery.h"
+#include "numtheory.h"
+#include "pipeline.h"
 
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Ciphertext formats written by rsa_encrypt_file().
+// RSA_FORMAT_HEX writes one hexstring per line; RSA_FORMAT_BIN writes a header followed by fixed-width big-endian blocks.
+// RSA_FORMAT_HYBRID writes a header, a random session key wrapped in fixed-width RSA blocks, then the data
+// encrypted with ChaCha20 under that key.
+// RSA_FORMAT_INDEXED writes the binary format followed by a block index, so that any range of the plaintext
+// can be decrypted on its own.
+typedef enum { RSA_FORMAT_HEX, RSA_FORMAT_BIN, RSA_FORMAT_HYBRID, RSA_FORMAT_INDEXED } rsa_format;
+
+// How rsa_encrypt_records() splits its input into records, and how rsa_decrypt_records() writes them back.
+// RSA_RECORDS_LINE takes each line as a record, without its newline; RSA_RECORDS_LEN takes a 4 byte
+// big-endian length followed by that many bytes.
+typedef enum { RSA_RECORDS_LINE, RSA_RECORDS_LEN } rsa_records;
+
+// Binary ciphertext header layout: magic (4 bytes), version (1), flags (1), reserved (2),
+// key size in bits (4), and block width in bytes (4). Multi-byte fields are big-endian.
+// Plain block files are written as version 1 so that older programs can still read them;
+// RSA_HEADER_VERSION is the newest version this program reads.
+#define RSA_HEADER_MAGIC   "RSAB"
+#define RSA_HEADER_VERSION 5
+#define RSA_HEADER_SIZE    16
+
+// Header flags.
+#define RSA_FLAG_HYBRID     0x1  // Hybrid format (version 2 and up).
+#define RSA_FLAG_INDEXED    0x2  // Indexed format (version 3 and up).
+#define RSA_FLAG_RECORDS    0x4  // Records format (version 4 and up).
+#define RSA_FLAG_LENGTH     0x8  // Records format whose records were length-prefixed rather than lines.
+#define RSA_FLAG_COMPRESSED 0x10 // Binary or hybrid format whose data is a stream of compressed frames
+                                 // (see lz.h) rather than the plaintext itself (version 5 and up).
+
+// Records format: the header, then a unit for every record of the plaintext, holding the number of blocks
+// (RSA_RECORD_COUNT_SIZE bytes, big-endian) followed by that many fixed-width blocks. The record is split
+// k - 1 bytes per block as in the binary format, except that an empty record has no blocks at all.
+// Each unit decrypts on its own, so a reader can take the records one at a time.
+// RSA_RECORD_OPEN is set in the count of a last line that had no newline, so that it comes back without one;
+// the blocks of a record always number less than it.
+#define RSA_RECORD_COUNT_SIZE 4
+#define RSA_RECORD_OPEN       0x80000000u
+
+// Block index at the end of the indexed format: an entry for the first of every RSA_INDEX_STRIDE blocks,
+// holding the plaintext offset (8 bytes) and file offset (8) where that block starts, then a trailer with
+// the file offset of the index (8), the number of entries (8), the plaintext length (8), the stride (4),
+// and the magic (4). Multi-byte fields are big-endian.
+#define RSA_INDEX_MAGIC        "RSAI"
+#define RSA_INDEX_STRIDE       8
+#define RSA_INDEX_ENTRY_SIZE   16
+#define RSA_INDEX_TRAILER_SIZE 32
+
+// Most primes a multi-prime key can have.
+#define RSA_MAX_PRIMES 4
+
+// The primes of a multi-prime key beyond p and q, with their CRT components as in RFC 8017:
+// for the i-th extra prime r[i], d[i] = d mod (r[i] - 1) and t[i] = (p x q x r[0] x ... x r[i - 1])^-1 mod r[i].
+// A two-prime key has a count of 2 and no extra primes.
+typedef struct {
+    uint64_t count; // Total number of primes, including p and q.
+    mpz_t r[RSA_MAX_PRIMES - 2];
+    mpz_t d[RSA_MAX_PRIMES - 2];
+    mpz_t t[RSA_MAX_PRIMES - 2];
+} rsa_primes;
+
+// Private-key state worked out once when a key is loaded and shared by every block it decrypts.
+// The Montgomery contexts and recoded exponents are only set up when "odd" is true.
+typedef struct {
+    bool crt; // True if the CRT components are used in place of d.
+    bool odd; // False if a modulus is even, in which case blocks fall back to the per-block routines.
+    mpz_ptr n, d, p, q, dp, dq, qinv;
+    rsa_primes *x; // Extra primes of a multi-prime key, or NULL.
+    mont_ctx mn, mp, mq;
+    mont_recoding rd, rp, rq;
+    mont_ctx mr[RSA_MAX_PRIMES - 2];      // Montgomery constants for each extra prime.
+    mont_recoding rr[RSA_MAX_PRIMES - 2]; // Recoded exponent for each extra prime.
+    mpz_t prod[RSA_MAX_PRIMES - 2];       // p x q x r[0] x ... x r[i - 1], the modulus recombined so far.
+} rsa_priv;
+
+// Per-thread working storage for private-key decryption.
+typedef struct {
+    mont_scratch sc;
+    mpz_t m1, m2, h;
+} rsa_priv_scratch;
+
+// Ciphertexts of recently encrypted blocks, kept by each worker of a public key context (see rsa_ctx_cache()).
+// Encryption without padding gives the same ciphertext for the same block every time, so runs of repeated
+// blocks, such as the zeros of a disk image, only need encrypting once. Entries are looked up by a hash of the
+// block and checked against the block itself, and the least recently used entry makes way for a new one.
+typedef struct {
+    uint32_t entries;   // Most blocks kept.
+    uint32_t used;      // Entries filled so far.
+    uint32_t buckets;   // Number of hash buckets, a power of two.
+    size_t key_width;   // Bytes kept of each block: the most a block holds after its 0xFF.
+    size_t width;       // Bytes kept of each ciphertext.
+    uint32_t head;      // Most recently used entry.
+    uint32_t tail;      // Least recently used entry.
+    uint32_t *bucket;   // First entry in each hash bucket.
+    uint32_t *chain;    // Next entry in the same bucket.
+    uint32_t *prev;     // Next more recently used entry.
+    uint32_t *next;     // Next less recently used entry.
+    uint64_t *hash;     // Hash of each entry's block.
+    uint32_t *len;      // Length of each entry's block.
+    uint8_t *data;      // Each entry's block (key_width bytes) followed by its ciphertext (width bytes).
+} rsa_cache;
+
+// Counters kept by a key context, summed over every file or buffer it has processed.
+// The times are only taken while the context's "timing" is set. The read and write times are spent in the
+// reader and writer stages; the parse and exponentiation times add up over all worker threads.
+typedef struct {
+    uint64_t blocks;       // RSA blocks encrypted or decrypted.
+    uint64_t bytes_in;     // Bytes read.
+    uint64_t bytes_out;    // Bytes written.
+    double read_time;      // Seconds spent reading input.
+    double write_time;     // Seconds spent writing output.
+    double parse_time;     // Seconds spent converting blocks between bytes or hexstrings and numbers.
+    double exp_time;       // Seconds spent in modular exponentiation.
+    double stream_time;    // Seconds spent in ChaCha20, for the hybrid format.
+    uint64_t cache_hits;   // Blocks whose ciphertext came out of the cache.
+    uint64_t cache_misses; // Blocks looked up in the cache and encrypted.
+} rsa_stats;
+
+// A key loaded once for any number of encryptions or decryptions.
+// The block size, Montgomery constants, and recoded exponents are worked out when the key is loaded,
+// and the per-worker values and pipeline buffers are kept between calls, so the per-block path doesn't
+// allocate. A context must not be copied once initialized, since "engine" points at its own key values.
+typedef struct {
+    mpz_t n, e, d, p, q, dp, dq, qinv; // Copies of the key; parts not loaded are 0.
+    rsa_primes x;                      // Copies of a multi-prime key's extra primes.
+    uint64_t k;                        // Block size in bytes, including the leading 0xFF.
+    size_t nbytes;                     // Bytes needed to hold n.
+    bool priv;                         // True for a private key context.
+    bool mont;                         // True if n is odd, so "mn" and "re" are set up for a public key.
+    mont_ctx mn;                       // Montgomery constants for n.
+    mont_recoding re;                  // The recoded public exponent.
+    rsa_priv engine;                   // Private-key state.
+    uint64_t threads;                  // Worker threads for files, or 0 to run the stages inline.
+    uint64_t workers;                  // Number of entries in "scratch", "m" and "c".
+    rsa_priv_scratch *scratch;
+    mpz_t *m;
+    mpz_t *c;
+    pipeline_slot *slots;
+    uint64_t nslots;
+    bool timing;      // True to time the stages of each call into "stats".
+    bool compress;    // True to compress data before encrypting it, in the binary and hybrid formats.
+    rsa_cache *cache; // Each worker's cache of block ciphertexts, or NULL (see rsa_ctx_cache()).
+    rsa_stats stats;  // Totals over every call so far.
+    rsa_stats *ws;    // Each worker's counts during a call, added into "stats" when it finishes.
+} rsa_ctx;
+
+// Fixed public exponent offered by keygen (the Fermat prime F4).
+#define RSA_FIXED_E 65537
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;
+    uint32_t bits;
+    uint32_t block_bytes;
+} rsa_header;
+
+void rsa_primes_init(rsa_primes *x, uint64_t count);
+
+void rsa_primes_clear(rsa_primes *x);
+
+void rsa_make_pub(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, prime_test test, uint64_t threads, uint64_t fixed_e);
+
+void rsa_make_pub_r(mpz_t p, mpz_t q, rsa_primes *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, prime_test test, uint64_t fixed_e, rand_state *rs);
 
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
-void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
+void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_primes *x);
+
+void rsa_make_crt(mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x, mpz_t d, mpz_t p, mpz_t q);
 
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
+void rsa_write_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_primes *x, FILE *pvfile);
 
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
+bool rsa_read_priv(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_primes *x, FILE *pvfile);
 
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+void rsa_write_header(FILE *outfile, rsa_header *hdr);
+
+bool rsa_read_header(FILE *infile, rsa_header *hdr);
+
+void rsa_ctx_init_pub(rsa_ctx *ctx, mpz_t n, mpz_t e, uint64_t threads);
+
+void rsa_ctx_init_priv(rsa_ctx *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_primes *x, uint64_t threads);
+
+void rsa_ctx_cache(rsa_ctx *ctx, uint64_t entries);
+
+void rsa_ctx_clear(rsa_ctx *ctx);
+
+void rsa_ctx_encrypt(rsa_ctx *ctx, uint64_t worker, mpz_t c, mpz_t m);
+
+void rsa_ctx_decrypt(rsa_ctx *ctx, uint64_t worker, mpz_t m, mpz_t c);
+
+bool rsa_encrypt_file(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_format format);
+
+bool rsa_encrypt_records(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_records records);
+
+size_t rsa_encrypt_size(const rsa_ctx *ctx, size_t len, rsa_format format);
+
+bool rsa_encrypt_buffer(rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap,
+    size_t *out_len, rsa_format format);
 
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+void rsa_decrypt_crt(
+    mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x);
+
+void rsa_priv_init(rsa_priv *pk, mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq,
+    mpz_t qinv, rsa_primes *x);
+
+void rsa_priv_clear(rsa_priv *pk);
+
+void rsa_priv_scratch_init(rsa_priv_scratch *ps);
+
+void rsa_priv_scratch_clear(rsa_priv_scratch *ps);
+
+void rsa_decrypt_priv(rsa_priv *pk, rsa_priv_scratch *ps, mpz_t m, mpz_t c);
+
+bool rsa_decrypt_file(rsa_ctx *ctx, FILE *infile, FILE *outfile);
+
+bool rsa_decrypt_range(rsa_ctx *ctx, FILE *infile, FILE *outfile, uint64_t start, uint64_t len);
+
+bool rsa_decrypt_records(rsa_ctx *ctx, FILE *infile, FILE *outfile, rsa_records records);
+
+size_t rsa_decrypt_size(const rsa_ctx *ctx, const uint8_t *in, size_t len);
+
+bool rsa_decrypt_buffer(
+    rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len);
+
+size_t rsa_decrypt_record(
+    rsa_ctx *ctx, const uint8_t *in, size_t len, uint8_t *out, size_t cap, size_t *out_len);
+
+void rsa_write_stats(FILE *f, const char *program, rsa_ctx *ctx, double wall);
 
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(
+    mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, rsa_primes *x);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+#ifdef __cplusplus
+}
+#endif